@@ -0,0 +1,82 @@
+import argparse
+import os
+import re
+import subprocess
+import sys
+import time
+
+# Runs the sorter over generated inputs and prints one CSV row per
+# run with the timings of its phases, so the results can be diffed
+# or plotted between builds. Several sorters (say, builds for other
+# key types) are run side by side on the same inputs.
+
+DISTRIBUTIONS = ['uniform', 'negative', 'sorted', 'reverse', 'equal', 'few', 'zipf', 'skewed']
+PHASES_RE = re.compile(r'Phases \(us\):\s+read=(\d+)\s+parse=(\d+)\s+sort=(\d+)\s+merge=(\d+)\s+write=(\d+)')
+
+parser = argparse.ArgumentParser(description="Benchmark the sorter on generated inputs")
+parser.add_argument('--sorter', type=str, action='append', required=True,
+                    help="sorter binary with its own arguments, may be repeated")
+parser.add_argument('--generator', type=str, required=True, help="native generator binary")
+parser.add_argument('--verifier', type=str, help="verifier binary, checks every output when given")
+parser.add_argument('--dir', type=str, default='bench_data', help="directory for the inputs")
+parser.add_argument('--sizes', type=str, default='100000,1000000',
+                    help="numbers in all the files of a run, comma separated")
+parser.add_argument('--files', type=str, default='1,8', help="file counts, comma separated")
+parser.add_argument('--dists', type=str, default=','.join(DISTRIBUTIONS),
+                    help="distributions, comma separated; 'skewed' is uniform numbers "
+                         "in files of halving sizes")
+parser.add_argument('--repeat', type=int, default=1, help="runs of each configuration")
+parser.add_argument('--args', type=str, default='', help="extra sorter arguments")
+parser.add_argument('--max', type=int, help="generated values are within [-MAX, MAX]")
+args = parser.parse_args()
+
+os.makedirs(args.dir, exist_ok=True)
+sorters = [(os.path.abspath(s.split()[0]), s.split()[1:], s) for s in args.sorter]
+generator = os.path.abspath(args.generator)
+verifier = os.path.abspath(args.verifier) if args.verifier else None
+
+
+def file_counts(dist, total, n_files):
+    if dist != 'skewed':
+        return [total // n_files + (1 if i < total % n_files else 0) for i in range(n_files)]
+    weights = [2 ** (n_files - 1 - i) for i in range(n_files)]
+    counts = [total * w // sum(weights) for w in weights]
+    counts[0] += total - sum(counts)
+    return counts
+
+
+def generate(dist, total, n_files):
+    names = []
+    for i, count in enumerate(file_counts(dist, total, n_files)):
+        name = os.path.join(args.dir, 'in%d.txt' % i)
+        subprocess.run([generator, '-f', name, '-c', str(count), '-s', str(i + 1),
+                        '-d', 'uniform' if dist == 'skewed' else dist] +
+                       (['-m', str(args.max)] if args.max is not None else []), check=True)
+        names.append(os.path.abspath(name))
+    return names
+
+
+print('sorter,dist,files,numbers,args,read_us,parse_us,sort_us,merge_us,write_us,wall_us')
+sys.stdout.flush()
+for dist in args.dists.split(','):
+    for total in map(int, args.sizes.split(',')):
+        for n_files in map(int, args.files.split(',')):
+            names = generate(dist, total, n_files)
+            for _ in range(args.repeat):
+                for sorter, sorter_args, label in sorters:
+                    start = time.monotonic()
+                    run = subprocess.run([sorter] + sorter_args + args.args.split() + names, cwd=args.dir,
+                                         stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+                                         universal_newlines=True)
+                    wall_us = int((time.monotonic() - start) * 1e6)
+                    match = PHASES_RE.search(run.stdout)
+                    if run.returncode != 0 or match is None:
+                        sys.exit('%s failed on %s, %d numbers in %d files' % (label, dist, total, n_files))
+                    if verifier is not None and subprocess.run([verifier, '-f', 'mergesorted.txt'] + names,
+                                                               cwd=args.dir,
+                                                               stdout=subprocess.DEVNULL).returncode != 0:
+                        sys.exit('wrong output of %s on %s, %d numbers in %d files' %
+                                 (label, dist, total, n_files))
+                    print('"%s",%s,%d,%d,"%s",%s,%s,%s,%s,%s,%d' % ((label, dist, n_files, total, args.args) +
+                                                                 match.groups() + (wall_us,)))
+                    sys.stdout.flush()
@@ -0,0 +1,241 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../source/num_type.h"
+#include "../source/num_parse.h"
+#include "../source/out_buf.h"
+#include "../source/run_format.h"
+
+/**
+ * Native generator of input files, a fast replacement of
+ * generator.py for big benchmark inputs.
+ *
+ * Usage: generator -f FILE -c COUNT [-m MAX] [-d DIST] [-s SEED]
+ *                  [-F text|raw|delta]
+ *
+ * Distributions:
+ *   uniform  - uniform in [0, MAX], like generator.py;
+ *   negative - uniform in [-MAX, MAX];
+ *   sorted   - non-decreasing;
+ *   reverse  - non-increasing;
+ *   equal    - all numbers are the same;
+ *   few      - 16 distinct values in [-MAX, MAX];
+ *   zipf     - Zipf-like in [1, MAX] with s = 1.1: few values are
+ *              very frequent, the tail is long.
+ *
+ * Formats are those of run_format.h, text is the default.
+ */
+
+enum Distribution
+{
+    DIST_UNIFORM,
+    DIST_NEGATIVE,
+    DIST_SORTED,
+    DIST_REVERSE,
+    DIST_EQUAL,
+    DIST_FEW,
+    DIST_ZIPF,
+};
+
+static const char *const DIST_NAMES[] = {
+    "uniform", "negative", "sorted", "reverse", "equal", "few", "zipf",
+};
+
+enum
+{
+    FEW_DISTINCT = 16,
+};
+
+static const char *const FORMAT_NAMES[] = {"text", "raw", "delta"};
+
+static const double ZIPF_S = 1.1;
+
+static uint64_t rng_state;
+
+/** splitmix64, good enough and much faster than the libc rand(). */
+static inline uint64_t
+NextRandom()
+{
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/** Uniform in [0, bound], bound < 2^63. */
+static inline num_t
+RandomUpTo(num_t bound)
+{
+    return (num_t) (NextRandom() % ((uint64_t) bound + 1));
+}
+
+static inline double
+RandomUnit()
+{
+    return (double) (NextRandom() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/** Inverse CDF of a continuous power law on [1, max + 1). */
+static inline num_t
+RandomZipf(num_t max)
+{
+    double one_minus_s = 1.0 - ZIPF_S;
+    double top = pow((double) max + 1.0, one_minus_s);
+    double x = pow((top - 1.0) * RandomUnit() + 1.0, 1.0 / one_minus_s);
+    num_t value = (num_t) x;
+    return value > max ? max : (value < 1 ? 1 : value);
+}
+
+static bool
+ParseDistribution(const char *name, enum Distribution *dist)
+{
+    for (size_t i = 0; i < sizeof(DIST_NAMES) / sizeof(DIST_NAMES[0]); i++) {
+        if (strcmp(name, DIST_NAMES[i]) == 0) {
+            *dist = (enum Distribution) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool
+ParseFormat(const char *name, enum rfmt_format *format)
+{
+    for (size_t i = 0; i < sizeof(FORMAT_NAMES) / sizeof(FORMAT_NAMES[0]); i++) {
+        if (strcmp(name, FORMAT_NAMES[i]) == 0) {
+            *format = (enum rfmt_format) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *file_name = NULL;
+    size_t count = 0;
+    bool has_count = false;
+    num_t max = (num_t) 1 << 31;
+    enum Distribution dist = DIST_UNIFORM;
+    enum rfmt_format format = RFMT_TEXT;
+    rng_state = (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 32);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:c:m:d:s:F:")) != -1) {
+        switch (opt) {
+            case 'f':
+                file_name = optarg;
+                break;
+            case 'c':
+                count = strtoull(optarg, NULL, 10);
+                has_count = true;
+                break;
+            case 'm':
+                max = strtoll(optarg, NULL, 10);
+                break;
+            case 'd':
+                if (!ParseDistribution(optarg, &dist)) {
+                    fprintf(stderr, "unknown distribution: \"%s\"\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+                rng_state = strtoull(optarg, NULL, 10);
+                break;
+            case 'F':
+                if (!ParseFormat(optarg, &format)) {
+                    fprintf(stderr, "unknown format: \"%s\"\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: %s -f FILE -c COUNT [-m MAX] [-d DIST] [-s SEED] "
+                        "[-F FORMAT]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (file_name == NULL || !has_count || max < 1 || max > INT64_MAX / 2) {
+        fprintf(stderr, "usage: %s -f FILE -c COUNT [-m MAX] [-d DIST] [-s SEED] "
+                        "[-F FORMAT]\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        perror(file_name);
+        return 1;
+    }
+    struct obuf out;
+    if (!obuf_create(&out, fd, OBUF_SIZE_DEFAULT)) {
+        fprintf(stderr, "unable to allocate an output buffer\n");
+        close(fd);
+        return 1;
+    }
+
+    num_t few[FEW_DISTINCT];
+    for (size_t i = 0; i < FEW_DISTINCT; i++) {
+        few[i] = RandomUpTo(2 * max) - max;
+    }
+    num_t equal = RandomUpTo(max);
+    // Sorted sequences step by random increments which add up to
+    // about max over the whole file, the rest is clamped:
+    num_t step_max = count > 0 ? 2 * (max / (num_t) count) : 0;
+    num_t current = dist == DIST_REVERSE ? max : 0;
+    num_t prev = 0;
+    if (format != RFMT_TEXT) {
+        char header[RFMT_HEADER_SIZE];
+        rfmt_make_header(format, header);
+        obuf_put_bytes(&out, header, sizeof(header));
+    }
+    for (size_t i = 0; i < count; i++) {
+        num_t value = 0;
+        switch (dist) {
+            case DIST_UNIFORM:
+                value = RandomUpTo(max);
+                break;
+            case DIST_NEGATIVE:
+                value = RandomUpTo(2 * max) - max;
+                break;
+            case DIST_SORTED:
+                value = current < max ? current : max;
+                current += RandomUpTo(step_max);
+                break;
+            case DIST_REVERSE:
+                value = current > -max ? current : -max;
+                current -= RandomUpTo(step_max);
+                break;
+            case DIST_EQUAL:
+                value = equal;
+                break;
+            case DIST_FEW:
+                value = few[NextRandom() % FEW_DISTINCT];
+                break;
+            case DIST_ZIPF:
+                value = RandomZipf(max);
+                break;
+        }
+        if (format == RFMT_RAW) {
+            obuf_put_raw(&out, rfmt_num_to_le(value));
+        } else if (format == RFMT_DELTA) {
+            obuf_put_varint(&out, rfmt_delta(&prev, value));
+        } else {
+            obuf_put_num(&out, value);
+        }
+    }
+    bool is_ok = obuf_flush(&out);
+    obuf_destroy(&out);
+    if (close(fd) != 0 || !is_ok) {
+        perror(file_name);
+        return 1;
+    }
+    return 0;
+}
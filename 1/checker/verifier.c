@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../source/num_type.h"
+#include "../source/num_parse.h"
+#include "../source/out_buf.h"
+#include "../source/run_format.h"
+
+/**
+ * Native replacement of checker.py which scales to huge outputs.
+ * Files are mapped and parsed piece by piece, so memory use does not
+ * depend on their size. The output must be non-decreasing. It must
+ * also be a permutation of the inputs. That is checked with an
+ * order-independent fingerprint of the multiset: count, sum and two
+ * sums of hashed values. Any parse error is reported, nothing is
+ * skipped. Binary files (see run_format.h) are detected by their
+ * header, so inputs and the output may be of any format. Build it
+ * with the same NUM_TYPE_* define as the sorter, see num_type.h.
+ *
+ * Usage: verifier [-a] -f OUTPUT [INPUT...]
+ *
+ * Without inputs only the order is checked. With -a the output is
+ * aggregated: "value count" pairs of increasing values.
+ */
+
+enum
+{
+    VERIFY_BLOCK_NUMBERS = 4096,
+};
+
+struct Fingerprint
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t hash1;
+    uint64_t hash2;
+};
+
+/** splitmix64 finalizer: a cheap bijective mixer of 64 bits. */
+static inline uint64_t
+Mix(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static inline void
+FingerprintAdd(struct Fingerprint *fp, num_t value)
+{
+    uint64_t v = num_bits(value);
+    fp->count++;
+    fp->sum += v;
+    fp->hash1 += Mix(v);
+    fp->hash2 += Mix(v ^ 0x2545F4914F6CDD1DULL);
+}
+
+/**
+ * Parse a whole file into @a fp. When @a check_order is set, the
+ * numbers must be non-decreasing. When @a is_aggregate is set, they
+ * are "value count" pairs, each value is added count times and must
+ * be greater than the previous one. Returns false and reports on any
+ * error.
+ */
+static bool
+ScanFile(const char *name, bool check_order, bool is_aggregate, struct Fingerprint *fp)
+{
+    int fd = open(name, O_RDONLY);
+    if (fd == -1) {
+        perror(name);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(name);
+        close(fd);
+        return false;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return true;
+    }
+    size_t size = (size_t) st.st_size;
+    char *data = (char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(name);
+        return false;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    bool is_ok = true;
+    bool has_prev = false;
+    num_t prev = 0;
+    /** The value of a pair whose count is not parsed yet. */
+    bool is_count_next = false;
+    num_t pair_value = 0;
+    num_t block[VERIFY_BLOCK_NUMBERS];
+    size_t header_size;
+    enum rfmt_format format = rfmt_detect(data, size, &header_size);
+    num_t delta_prev = 0;
+    const char *pos = data + header_size;
+    const char *end = data + size;
+    while (is_ok) {
+        size_t count = 0;
+        enum nparse_status status;
+        if (format == RFMT_RAW) {
+            status = rfmt_decode_raw(&pos, end, block, VERIFY_BLOCK_NUMBERS, &count);
+        } else if (format == RFMT_DELTA) {
+            status = rfmt_decode_delta(&pos, end, &delta_prev, block, VERIFY_BLOCK_NUMBERS, &count);
+        } else {
+            status = nparse_numbers(&pos, end, block, VERIFY_BLOCK_NUMBERS, &count);
+        }
+        for (size_t i = 0; i < count && is_aggregate; i++) {
+            if (!is_count_next) {
+                pair_value = block[i];
+                is_count_next = true;
+                continue;
+            }
+            is_count_next = false;
+            if (!(block[i] > 0) || (has_prev && !(pair_value > prev))) {
+                char text[OBUF_NUM_MAX_LEN + 1] = {0};
+                fprintf(stderr, "%s: bad pair at number %lu: %s\n", name, (unsigned long) (fp->count),
+                        obuf_format_num(pair_value, text + OBUF_NUM_MAX_LEN));
+                is_ok = false;
+                break;
+            }
+            for (uint64_t n = (uint64_t) block[i]; n > 0; n--) {
+                FingerprintAdd(fp, pair_value);
+            }
+            prev = pair_value;
+            has_prev = true;
+        }
+        for (size_t i = 0; i < count && !is_aggregate; i++) {
+            if (check_order && has_prev && block[i] < prev) {
+                char prev_text[OBUF_NUM_MAX_LEN + 1] = {0};
+                char next_text[OBUF_NUM_MAX_LEN + 1] = {0};
+                const char *prev_begin = obuf_format_num(prev, prev_text + OBUF_NUM_MAX_LEN);
+                const char *next_begin = obuf_format_num(block[i], next_text + OBUF_NUM_MAX_LEN);
+                fprintf(stderr, "%s: order is broken at number %lu: %s> %s\n", name,
+                        (unsigned long) (fp->count), prev_begin, next_begin);
+                is_ok = false;
+                break;
+            }
+            prev = block[i];
+            has_prev = true;
+            FingerprintAdd(fp, block[i]);
+        }
+        if (status == NPARSE_EOF) {
+            break;
+        }
+        if (status == NPARSE_UNKNOWN_SYMBOL || status == NPARSE_OVERFLOW) {
+            const char *what = "unexpected symbol";
+            if (status == NPARSE_OVERFLOW) {
+                what = format == RFMT_TEXT ? "number is out of range" : "too long varint";
+            } else if (format != RFMT_TEXT) {
+                what = "truncated number";
+            }
+            fprintf(stderr, "%s: %s at offset %lu\n", name, what, (unsigned long) (pos - data));
+            is_ok = false;
+        }
+    }
+    if (is_ok && is_count_next) {
+        fprintf(stderr, "%s: no count of the last value\n", name);
+        is_ok = false;
+    }
+    munmap(data, size);
+    return is_ok;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *program = argv[0];
+    bool is_aggregate = argc > 1 && strcmp(argv[1], "-a") == 0;
+    if (is_aggregate) {
+        argc--;
+        argv++;
+    }
+    if (argc < 3 || strcmp(argv[1], "-f") != 0) {
+        fprintf(stderr, "usage: %s [-a] -f OUTPUT [INPUT...]\n", program);
+        return 2;
+    }
+    struct Fingerprint out_fp = {0};
+    if (!ScanFile(argv[2], true, is_aggregate, &out_fp)) {
+        return 1;
+    }
+    if (argc == 3) {
+        printf("Order is ok (%lu numbers)\n", (unsigned long) out_fp.count);
+        return 0;
+    }
+    struct Fingerprint in_fp = {0};
+    for (int i = 3; i < argc; i++) {
+        if (!ScanFile(argv[i], false, false, &in_fp)) {
+            return 1;
+        }
+    }
+    if (memcmp(&in_fp, &out_fp, sizeof(in_fp)) != 0) {
+        fprintf(stderr, "output is not a permutation of the inputs: %lu numbers in the output, "
+                "%lu in the inputs%s\n", (unsigned long) out_fp.count, (unsigned long) in_fp.count,
+                in_fp.count == out_fp.count ? ", the values differ" : "");
+        return 1;
+    }
+    printf("All is ok (%lu numbers, fingerprint %016lx%016lx)\n", (unsigned long) out_fp.count,
+           (unsigned long) out_fp.hash1, (unsigned long) out_fp.hash2);
+    return 0;
+}
@@ -0,0 +1,114 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+/**
+ * Bump allocator over one anonymous mapping. The whole size is only
+ * reserved: a page takes memory when it is touched first, so arrays
+ * may be sized by an upper bound of what they will hold and never
+ * grow. The mapping may ask for transparent huge pages: they save TLB
+ * misses on big arrays, but each array takes up to a huge page more.
+ * Nothing is freed one by one, everything goes away in
+ * arena_destroy(). Possible example of usage:
+ *
+ *
+ * struct arena arena;
+ * arena_create(&arena, sum_of_bounds, false);
+ * foreach (file : files)
+ *     file.numbers = arena_alloc(&arena, bound(file) * sizeof(num_t));
+ * ...
+ * if (arena_owns(&arena, ptr))
+ *     arena_release(ptr, size);
+ * else
+ *     free(ptr);
+ * arena_destroy(&arena);
+ */
+
+enum {
+    /** Allocations are aligned to a cache line. */
+    ARENA_ALIGN = 64,
+    ARENA_PAGE = 4 << 10,
+    /** The size is rounded up to it, so huge pages cover all of it. */
+    ARENA_HUGE_PAGE = 2 << 20,
+};
+
+struct arena {
+    char *base;
+    size_t size;
+    size_t used;
+    /** madvise(MADV_HUGEPAGE) has been accepted. */
+    bool has_huge_pages;
+};
+
+static inline bool
+arena_create(struct arena *a, size_t size, bool use_huge_pages)
+{
+    a->used = 0;
+    a->has_huge_pages = false;
+    a->size = (size + ARENA_HUGE_PAGE - 1) / ARENA_HUGE_PAGE * ARENA_HUGE_PAGE;
+    void *base = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        a->base = NULL;
+        a->size = 0;
+        return false;
+    }
+    a->base = (char*) base;
+#ifdef MADV_HUGEPAGE
+    a->has_huge_pages = use_huge_pages && madvise(a->base, a->size, MADV_HUGEPAGE) == 0;
+#else
+    (void) use_huge_pages;
+#endif  // MADV_HUGEPAGE
+    return true;
+}
+
+/** Returns NULL when the arena is exhausted. */
+static inline void*
+arena_alloc(struct arena *a, size_t size)
+{
+    size_t start = (a->used + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    if (start > a->size || a->size - start < size) {
+        return NULL;
+    }
+    a->used = start + size;
+    return a->base + start;
+}
+
+static inline bool
+arena_owns(const struct arena *a, const void *ptr)
+{
+    return a->base != NULL && (const char*) ptr >= a->base && (const char*) ptr < a->base + a->size;
+}
+
+/**
+ * Give the memory of [@a ptr, @a ptr + @a size) back to the system,
+ * the range stays allocated and reads as zeros. Only whole pages
+ * inside the range are released.
+ */
+static inline void
+arena_release(void *ptr, size_t size)
+{
+    uintptr_t page = (uintptr_t) ARENA_PAGE;
+    uintptr_t from = ((uintptr_t) ptr + page - 1) / page * page;
+    uintptr_t to = ((uintptr_t) ptr + size) / page * page;
+    if (from < to) {
+        madvise((void*) from, to - from, MADV_DONTNEED);
+    }
+}
+
+static inline void
+arena_destroy(struct arena *a)
+{
+    if (a->base != NULL) {
+        munmap(a->base, a->size);
+    }
+    a->base = NULL;
+    a->size = 0;
+    a->used = 0;
+}
+
+#endif  // ARENA_H
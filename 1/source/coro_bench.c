@@ -0,0 +1,87 @@
+#define _GNU_SOURCE
+#define NDEBUG
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "macro.h"
+
+/**
+ * Microbenchmark of a coroutine switch. The coroutines ping-pong
+ * via coro_yield() with no work in between. Build it once per
+ * backend (-DCORO_BACKEND_STACK selects coro_stack.h) and compare.
+ *
+ * Usage: coro_bench [N_COROUTINES [N_SWITCHES_EACH]]
+ */
+
+#define CORO_LOCAL_DATA struct \
+{                               \
+    size_t n_switches;          \
+}
+
+#define CORO_COMMON_DATA struct \
+{                               \
+    size_t n_rounds;            \
+}
+
+struct bench_frame_t
+{
+    size_t unused;
+};
+#define CORO_LOCAL_STACK_FRAME struct bench_frame_t
+#define CORO_ENTRY PingPong
+void PingPong();
+#ifdef CORO_BACKEND_STACK
+#include "coro_stack.h"
+static const char *const BACKEND_NAME = "stack";
+#else
+#include "coro_jmp.h"
+static const char *const BACKEND_NAME = "jmp";
+#endif  // CORO_BACKEND_STACK
+
+void PingPong()
+{
+    while (coro_this()->n_switches < crt.n_rounds) {
+        coro_this()->n_switches++;
+        coro_yield();
+    }
+    coro_return();
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n_coros = argc > 1 ? strtoul(argv[1], NULL, 10) : 2;
+    crt.n_rounds = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    if (n_coros == 0) {
+        n_coros = 1;
+    }
+    coro_set_quantum(0);
+    crt.coro_count = n_coros;
+    crt.coros = (struct coro*) calloc(crt.coro_count, sizeof(struct coro));
+    if (crt.coros == NULL) {
+        LOG_FATAL("calloc(%lu) failed", crt.coro_count);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < crt.coro_count; ++i) {
+        if (coro_init(i) != 0) {
+            break;
+        }
+    }
+    coro_wait_all();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    size_t total = 0;
+    for (size_t i = 0; i < crt.coro_count; i++) {
+        total += crt.coros[i].n_switches;
+    }
+    double ns = (double) (end.tv_sec - start.tv_sec) * 1e9 + (double) (end.tv_nsec - start.tv_nsec);
+    printf("backend = %s\tcoroutines = %lu\tswitches = %lu\t%.1f ns/switch\n",
+           BACKEND_NAME, crt.coro_count, total, total > 0 ? ns / (double) total : 0.0);
+    free(crt.coros);
+    coro_destroy();
+    return 0;
+}
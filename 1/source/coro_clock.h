@@ -0,0 +1,62 @@
+#ifndef CORO_CLOCK_H
+#define CORO_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Cheap clock shared by the coroutine backends, used for the time
+ * accounting and the scheduling quanta. On x86 it is the TSC,
+ * elsewhere CLOCK_MONOTONIC_COARSE in nanoseconds. Use
+ * coro_ticks_to_ns() to get a real time, after
+ * coro_clock_calibrate() was called once.
+ */
+typedef uint64_t coro_ticks_t;
+
+static double coro_ticks_per_ns = 1.0;
+
+static inline coro_ticks_t
+coro_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (coro_ticks_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/** Measure the coro_ticks() rate against CLOCK_MONOTONIC. */
+static inline void
+coro_clock_calibrate()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec ts1, ts2;
+    const struct timespec nap = {0, 2000000};
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    coro_ticks_t t1 = coro_ticks();
+    nanosleep(&nap, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &ts2);
+    coro_ticks_t t2 = coro_ticks();
+    double ns = (double) (ts2.tv_sec - ts1.tv_sec) * 1e9 + (double) (ts2.tv_nsec - ts1.tv_nsec);
+    coro_ticks_per_ns = ns > 0 && t2 > t1 ? (double) (t2 - t1) / ns : 1.0;
+#endif
+}
+
+static inline uint64_t
+coro_ticks_to_ns(coro_ticks_t ticks)
+{
+    return (uint64_t) ((double) ticks / coro_ticks_per_ns);
+}
+
+static inline coro_ticks_t
+coro_ns_to_ticks(uint64_t ns)
+{
+    return (coro_ticks_t) ((double) ns * coro_ticks_per_ns);
+}
+
+#endif  // CORO_CLOCK_H
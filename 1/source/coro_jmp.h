@@ -1,8 +1,11 @@
 #include <setjmp.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include "coro_clock.h"
+#include "coro_phase.h"
 
 #ifndef CORO_COMMON_DATA
 #error "You are expected to specify what you want to share between coroutines "\
@@ -16,15 +19,26 @@
 #error "You are expected to specify a coroutine stack frame type "\
        "via CORO_LOCAL_STACK_FRAME"
 #endif  // CORO_LOCAL_STACK_FRAME
+#ifndef CORO_ENTRY
+#error "You are expected to specify a function which each coroutine runs "\
+       "via CORO_ENTRY"
+#endif  // CORO_ENTRY
+#ifndef CORO_FRAMES_MIN
+/** Frames allocated by the first coro_call(), deep enough for most recursions. */
+#define CORO_FRAMES_MIN 64
+#endif  // CORO_FRAMES_MIN
 
 /**
  * Coroutines library. It allows to split execution of a task
  * into a set of coroutines. Possible example of usage:
  *
  *
+ * #define CORO_ENTRY func_to_split
+ *
  * foreach (coro : coros)
- *     coro_init(coro);
- * coro_call(func_to_split);
+ *     if (coro_init(coro) != 0)
+ *         break;
+ * coro_wait_all();
  *
  *
  * void other_func1()
@@ -47,11 +61,37 @@
  *     ...
  *     coro_yield();
  *     ...
+ *     while (has_work()) {
+ *         do_a_bit_of_work();
+ *         coro_maybe_yield();
+ *     }
+ *     ...
  *     coro_call(other_func2);
  *     ...
- *     coro_finish();
- *     coro_wait_all();
+ *     coro_return();
  * }
+ *
+ *
+ * This backend runs all the coroutines on the caller's stack and
+ * switches them with setjmp/longjmp, so locals do not survive a
+ * switch. See coro_stack.h for a backend with real stacks.
+ *
+ * Coroutines are scheduled from a FIFO ready queue. A finished
+ * coroutine leaves it for good. A coroutine waiting for an event
+ * leaves it with coro_park() and comes back with coro_wake(), so
+ * nobody spins through the waiting ones:
+ *
+ *
+ * void poll_io(bool can_block)
+ * {
+ *     foreach (coro : done_or_wait_for_done(can_block))
+ *         coro_wake(coro);
+ * }
+ *
+ * coro_poller = poll_io;
+ * ...
+ * while (!is_read_done())
+ *     coro_park();
  */
 
 /**
@@ -83,6 +123,9 @@ struct coro {
      */
     bool is_finished;
 
+    /** Out of the ready queue until coro_wake(). */
+    bool is_parked;
+
     /**
      * Intended for checks outside of the coroutine that it was
      * finished with no errors.
@@ -90,10 +133,16 @@ struct coro {
     bool no_errors_occurred;
 
     struct {
-        clock_t clocks_spent;
-        clock_t timestamp;
+        /** Ticks of coro_ticks() spent in this coroutine. */
+        coro_ticks_t ticks_spent;
+        /** When the coroutine was scheduled last time. */
+        coro_ticks_t timestamp;
+        /** How many times the coroutine gave the CPU away. */
+        size_t switch_count;
+        /** The same split by phases, see coro_phase.h. */
+        struct coro_phases phases;
     };
-    
+
     CORO_LOCAL_DATA;
 
     /** Coroutine local stack */
@@ -113,9 +162,47 @@ static struct CoRuntime
     size_t coro_count;
     size_t curr_coro_i;
     struct coro *coros;
+
+    /**
+     * A coroutine is allowed to run that long before
+     * coro_maybe_yield() switches it out. Set by
+     * coro_set_quantum().
+     */
+    coro_ticks_t quantum_ticks;
+
+    /**
+     * Ring of the ready coroutines, the current one is not in
+     * it. Each coroutine is queued at most once, so coro_count
+     * slots are enough.
+     */
+    size_t *ready;
+    size_t ready_head;
+    size_t n_ready;
+    size_t n_parked;
+    size_t n_finished;
+    /** How many times coro_poller() was let to block. */
+    size_t n_idle_waits;
     CORO_COMMON_DATA;
 } crt;
 
+/**
+ * Wakes parked coroutines whose events have happened. It is called
+ * with @a can_block = false on each switch while some coroutines are
+ * parked, and with true when nothing is ready: then it should sleep
+ * in the kernel (aio_suspend(), io_uring, eventfd, ...) until it can
+ * wake at least one coroutine.
+ */
+typedef void (*coro_poll_f)(bool can_block);
+static coro_poll_f coro_poller;
+
+/** Set the scheduling quantum in microseconds. */
+static inline void
+coro_set_quantum(size_t quantum_us)
+{
+    coro_clock_calibrate();
+    crt.quantum_ticks = coro_ns_to_ticks((uint64_t) quantum_us * 1000);
+}
+
 /**
  * Index of the currently working coroutine. It is used to learn
  * which coroutine should be scheduled next, and to get your
@@ -126,6 +213,69 @@ static struct CoRuntime
 /** Get currently working coroutine. */
 #define coro_this() (&crt.coros[crt.curr_coro_i])
 
+/** Index of the currently working coroutine. */
+#define coro_id() (crt.curr_coro_i)
+
+/** Free the ready queue. */
+#define coro_destroy() ({ \
+    free(crt.ready);    \
+    crt.ready = NULL;   \
+})
+
+static inline void
+coro_ready_push(size_t idx)
+{
+    ASSERT(crt.n_ready < crt.coro_count);
+    crt.ready[(crt.ready_head + crt.n_ready++) % crt.coro_count] = idx;
+}
+
+/** Put a parked coroutine back into the ready queue. */
+static inline void
+coro_wake(size_t idx)
+{
+    if (crt.coros[idx].is_parked) {
+        crt.coros[idx].is_parked = false;
+        crt.n_parked--;
+        coro_ready_push(idx);
+    }
+}
+
+/**
+ * Take the coroutine to run after @a curr_i, queueing @a curr_i
+ * again if it is neither parked nor finished. When it is the only one
+ * able to run, it is returned itself. When nothing is ready, wait for
+ * a parked coroutine to be woken. Returns SIZE_MAX if nothing is left
+ * to run. It is not inline: its locals would be in the frame of the
+ * caller's setjmp() and might be clobbered by longjmp().
+ */
+__attribute__((noinline)) static size_t
+coro_ready_take(size_t curr_i)
+{
+    if (crt.n_parked > 0 && coro_poller != NULL) {
+        coro_poller(false);
+    }
+    if (!crt.coros[curr_i].is_parked && !crt.coros[curr_i].is_finished) {
+        if (crt.n_ready == 0) {
+            return curr_i;
+        }
+        coro_ready_push(curr_i);
+    }
+    while (crt.n_ready == 0) {
+        if (crt.n_parked == 0) {
+            return SIZE_MAX;
+        }
+        if (coro_poller == NULL) {
+            LOG_FATAL("%lu coroutines are parked and nothing wakes them", crt.n_parked);
+        }
+        crt.n_idle_waits++;
+        coro_poller(true);
+    }
+    size_t idx = crt.ready[crt.ready_head];
+    crt.ready_head = (crt.ready_head + 1) % crt.coro_count;
+    crt.n_ready--;
+    return idx;
+}
+
 /** Declare that this curoutine has finished. */
 #define coro_finish() ({ \
     if (coro_this()->stack_pointer != 0) {                          \
@@ -136,41 +286,115 @@ static struct CoRuntime
     free(coro_this()->stack);                                       \
     coro_this()->stack = NULL;                                      \
     coro_this()->is_finished = true;                                \
-    coro_this()->clocks_spent += clock() - coro_this()->timestamp;  \
-    coro_this()->timestamp = clock();                               \
+    crt.n_finished++;                                               \
+    coro_ticks_t stamp = coro_ticks();                              \
+    coro_this()->ticks_spent += stamp - coro_this()->timestamp;     \
+    coro_this()->timestamp = stamp;                                 \
+    coro_phases_close(&coro_this()->phases, stamp,                  \
+                      coro_this()->ticks_spent,                     \
+                      coro_this()->switch_count);                   \
 })
 
 /**
- * This macro stops the current coroutine and switches to another
- * one. Check is not in a function, because setjmp result can not
- * be used after 'return'. You should keep it as macros. In your
- * code instead of real call and 'return' use coro_call() and
- * coro_return().
+ * Switch from the current coroutine to the next ready one. The
+ * current one is queued again unless it is parked or finished.
+ * When it is the only one able to run, it goes on with a new
+ * quantum. Check is not in a function, because setjmp result can
+ * not be used after 'return'.
  */
-#define coro_yield() ({ \
-    int old_i = crt.curr_coro_i;                                                \
-    crt.curr_coro_i = (crt.curr_coro_i + 1) % crt.coro_count;                   \
-    if (setjmp(crt.coros[old_i].exec_point) == 0) {                             \
-        ASSERT(crt.coros[old_i].timestamp != -1);                               \
-        clock_t stamp = clock();                                                \
-        crt.coros[old_i].clocks_spent += stamp - crt.coros[old_i].timestamp;    \
-        crt.coros[crt.curr_coro_i].timestamp = stamp;                           \
-        longjmp(crt.coros[crt.curr_coro_i].exec_point, 1);                      \
+#define coro_switch() ({ \
+    size_t old_i = crt.curr_coro_i;                                             \
+    size_t next_i = coro_ready_take(old_i);                                     \
+    if (next_i != SIZE_MAX && next_i != old_i) {                                \
+        crt.curr_coro_i = next_i;                                               \
+        if (setjmp(crt.coros[old_i].exec_point) == 0) {                         \
+            coro_ticks_t stamp = coro_ticks();                                  \
+            if (!crt.coros[old_i].is_finished) {                                \
+                ASSERT(crt.coros[old_i].timestamp != 0);                        \
+                crt.coros[old_i].ticks_spent +=                                 \
+                    stamp - crt.coros[old_i].timestamp;                         \
+                crt.coros[old_i].switch_count++;                                \
+            }                                                                   \
+            crt.coros[next_i].timestamp = stamp;                                \
+            coro_phases_switch(crt.coros[old_i].is_finished ?                   \
+                               NULL : &crt.coros[old_i].phases,                 \
+                               &crt.coros[next_i].phases, stamp);               \
+            longjmp(crt.coros[next_i].exec_point, 1);                           \
+        }                                                                       \
+    } else if (next_i == old_i) {                                               \
+        /* A new quantum, or coro_maybe_yield() would poll on each call. */     \
+        coro_ticks_t stamp = coro_ticks();                                      \
+        crt.coros[old_i].ticks_spent += stamp - crt.coros[old_i].timestamp;     \
+        crt.coros[old_i].timestamp = stamp;                                     \
     }                                                                           \
 })
 
-/** Initialize a coroutine. */
+/**
+ * This macro stops the current coroutine and switches to another
+ * one. You should keep it as macros. In your code instead of real
+ * call and 'return' use coro_call() and coro_return().
+ */
+#define coro_yield() coro_switch()
+
+/**
+ * Stop the current coroutine until somebody calls coro_wake() for
+ * it, usually coro_poller(). The wake-up may be spurious, check the
+ * condition again after it.
+ */
+#define coro_park() ({ \
+    coro_this()->is_parked = true;  \
+    crt.n_parked++;                 \
+    coro_switch();                  \
+})
+
+/**
+ * Yield only when the current coroutine has used up its quantum.
+ * It is cheap enough to be put into hot loops, but the same rules
+ * as for coro_yield() apply: locals are not preserved if the
+ * switch happens, keep the state in the coroutine.
+ */
+#define coro_maybe_yield() ({ \
+    if (coro_ticks() - coro_this()->timestamp >= crt.quantum_ticks) {   \
+        coro_yield();                                                   \
+    }                                                                   \
+})
+
+/**
+ * Initialize a coroutine. The caller continues as the first one,
+ * so a runtime can be initialized and waited for more than once.
+ * Coroutines are initialized in order starting with 0.
+ */
 #define coro_init(coro_idx) ({ \
     ASSERT(crt.coros != NULL);                      \
+    crt.curr_coro_i = 0;                            \
+    if ((coro_idx) == 0) {                          \
+        free(crt.ready);                            \
+        crt.ready = (size_t*) calloc(crt.coro_count,\
+                                     sizeof(size_t));\
+        if (crt.ready == NULL) {                    \
+            LOG_FATAL("calloc(%lu) failed",         \
+                      crt.coro_count);              \
+        }                                           \
+        crt.ready_head = 0;                         \
+        crt.n_ready = 0;                            \
+        crt.n_parked = 0;                           \
+        crt.n_finished = 0;                         \
+    } else {                                        \
+        coro_ready_push(coro_idx);                  \
+    }                                               \
     crt.coros[coro_idx].is_finished = false;        \
+    crt.coros[coro_idx].is_parked = false;          \
     crt.coros[coro_idx].no_errors_occurred = true;  \
                                                     \
     crt.coros[coro_idx].stack_pointer = 0;          \
     crt.coros[coro_idx].stack_capacity = 0;         \
     crt.coros[coro_idx].stack = NULL;               \
                                                     \
-    crt.coros[coro_idx].clocks_spent = 0;           \
-    crt.coros[coro_idx].timestamp = -1;             \
+    crt.coros[coro_idx].ticks_spent = 0;            \
+    crt.coros[coro_idx].timestamp = 0;              \
+    crt.coros[coro_idx].switch_count = 0;           \
+    memset(&crt.coros[coro_idx].phases, 0,          \
+           sizeof(struct coro_phases));             \
                                                     \
     setjmp(crt.coros[coro_idx].exec_point);         \
 })
@@ -183,6 +407,7 @@ static struct CoRuntime
     struct coro *c = coro_this();                                                           \
     if ((c->stack_pointer + 1) >= c->stack_capacity) {                                      \
         size_t new_cap = (c->stack_pointer + 1) * 2;                                        \
+        new_cap = new_cap > CORO_FRAMES_MIN ? new_cap : CORO_FRAMES_MIN;                    \
         LOG_DEBUG("reallocating stack to (%lu)", new_cap);                                  \
         size_t new_size = new_cap * sizeof(struct coro_stack_frame);                        \
         c->stack =                                                                          \
@@ -216,21 +441,21 @@ static struct CoRuntime
     longjmp(c->stack[(c->stack_pointer)--].ret_point, 1);   \
 })
 
-/** Wait until all the coroutines have finished. */
+/**
+ * Run CORO_ENTRY in the current coroutine, then wait until all the
+ * coroutines have finished. Each coroutine comes here once, from
+ * coro_init() when it is scheduled the first time.
+ */
 #define coro_wait_all() do { \
-    bool is_all_finished = true;                        \
-    for (size_t i = 0; i < crt.coro_count; ++i) {       \
-        if (! crt.coros[i].is_finished) {               \
-            fprintf(stderr, "Coro %lu: still active,"   \
-                " re-scheduling\n", i);                 \
-            is_all_finished = false;                    \
-            break;                                      \
-        }                                               \
+    if (coro_this()->timestamp == 0) {                  \
+        coro_this()->timestamp = coro_ticks();          \
+        coro_phases_switch(NULL, &coro_this()->phases,  \
+                           coro_this()->timestamp);     \
     }                                                   \
-    if (is_all_finished) {                              \
-        fprintf(stderr, "No more active coros to "      \
-            "schedule.\n");                             \
-        break;                                          \
+    coro_call(CORO_ENTRY);                              \
+    coro_finish();                                      \
+    /* Never comes back unless it is the last one: */   \
+    while (crt.n_finished < crt.coro_count) {           \
+        coro_switch();                                  \
     }                                                   \
-    coro_yield();                                       \
-} while (true)
+} while (false)
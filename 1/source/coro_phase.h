@@ -0,0 +1,137 @@
+#ifndef CORO_PHASE_H
+#define CORO_PHASE_H
+
+#include <stdint.h>
+#include <string.h>
+#include "coro_clock.h"
+
+/**
+ * Per-phase accounting shared by the coroutine backends. A coroutine
+ * names the phase of its work with coro_phase_set(), and gets the
+ * wall time, the time it was scheduled and the switches of each
+ * phase in coro_this()->phases. Possible example of usage:
+ *
+ *
+ * coro_phase_sampler = read_thread_counters;
+ * ...
+ * coro_phase_set(PHASE_PARSE);
+ * parse();
+ * coro_phase_set(PHASE_SORT);
+ * sort();
+ * ...
+ * // After coro_wait_all():
+ * crt.coros[i].phases.busy[PHASE_PARSE];
+ *
+ *
+ * A coroutine starts in phase 0. When coro_phase_sampler is set,
+ * it is called on each switch on the thread which switches, and
+ * the deltas of its CORO_COUNTERS values (thread CPU time,
+ * hardware counters) are charged to the phase of the coroutine
+ * which was running. Without it switches stay as cheap as they
+ * were.
+ */
+
+enum {
+    CORO_PHASE_MAX = 8,
+    CORO_COUNTERS = 4,
+};
+
+/** Read CORO_COUNTERS counters of the calling thread. */
+typedef void (*coro_sample_f)(uint64_t *counters);
+
+static coro_sample_f coro_phase_sampler;
+
+struct coro_phases {
+    unsigned current;
+    /** When the current phase started, 0 until the first schedule. */
+    coro_ticks_t started;
+    /** Busy ticks and switches of the coroutine at that moment. */
+    coro_ticks_t busy_mark;
+    size_t switch_mark;
+    /** Thread counters when the coroutine got the CPU last time. */
+    uint64_t sample[CORO_COUNTERS];
+
+    coro_ticks_t wall[CORO_PHASE_MAX];
+    coro_ticks_t busy[CORO_PHASE_MAX];
+    size_t switches[CORO_PHASE_MAX];
+    uint64_t counters[CORO_PHASE_MAX][CORO_COUNTERS];
+};
+
+static inline void
+coro_phases_charge(struct coro_phases *p, const uint64_t *sample)
+{
+    for (unsigned k = 0; k < CORO_COUNTERS; k++) {
+        p->counters[p->current][k] += sample[k] - p->sample[k];
+    }
+    memcpy(p->sample, sample, sizeof(p->sample));
+}
+
+/**
+ * Account a switch at @a stamp from @a from to @a to, either of
+ * them may be NULL. The counters are sampled once for both.
+ */
+static inline void
+coro_phases_switch(struct coro_phases *from, struct coro_phases *to, coro_ticks_t stamp)
+{
+    if (to != NULL && to->started == 0) {
+        to->started = stamp;
+    }
+    if (coro_phase_sampler == NULL) {
+        return;
+    }
+    uint64_t sample[CORO_COUNTERS];
+    coro_phase_sampler(sample);
+    if (from != NULL) {
+        coro_phases_charge(from, sample);
+    }
+    if (to != NULL) {
+        memcpy(to->sample, sample, sizeof(to->sample));
+    }
+}
+
+/**
+ * Close the current phase at @a stamp, when the coroutine has been
+ * busy for @a busy ticks and switched @a switches times in total.
+ * The coroutine must be running.
+ */
+static inline void
+coro_phases_close(struct coro_phases *p, coro_ticks_t stamp, coro_ticks_t busy, size_t switches)
+{
+    p->wall[p->current] += stamp - p->started;
+    p->busy[p->current] += busy - p->busy_mark;
+    p->switches[p->current] += switches - p->switch_mark;
+    if (coro_phase_sampler != NULL) {
+        uint64_t sample[CORO_COUNTERS];
+        coro_phase_sampler(sample);
+        coro_phases_charge(p, sample);
+    }
+    p->started = stamp;
+    p->busy_mark = busy;
+    p->switch_mark = switches;
+}
+
+/** Sum the closed phases of @a src into @a dst. */
+static inline void
+coro_phases_add(struct coro_phases *dst, const struct coro_phases *src)
+{
+    for (unsigned i = 0; i < CORO_PHASE_MAX; i++) {
+        dst->wall[i] += src->wall[i];
+        dst->busy[i] += src->busy[i];
+        dst->switches[i] += src->switches[i];
+        for (unsigned k = 0; k < CORO_COUNTERS; k++) {
+            dst->counters[i][k] += src->counters[i][k];
+        }
+    }
+}
+
+/** Switch the current coroutine to phase @a phase. */
+#define coro_phase_set(phase) ({ \
+    struct coro *pc = coro_this();                                          \
+    coro_ticks_t pstamp = coro_ticks();                                     \
+    coro_phases_close(&pc->phases, pstamp,                                  \
+                      pc->ticks_spent + (pstamp - pc->timestamp),           \
+                      pc->switch_count);                                    \
+    pc->phases.current = (phase);                                           \
+})
+
+#endif  // CORO_PHASE_H
@@ -0,0 +1,824 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "coro_clock.h"
+#include "coro_phase.h"
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#include <sanitizer/common_interface_defs.h>
+#endif  // __SANITIZE_ADDRESS__
+
+#ifndef CORO_COMMON_DATA
+#error "You are expected to specify what you want to share between coroutines "\
+       "via CORO_COMMON_DATA"
+#endif  // CORO_COMMON_DATA
+#ifndef CORO_LOCAL_DATA
+#error "You are expected to specify what you want to store in a coroutine "\
+       "via CORO_LOCAL_DATA"
+#endif  // CORO_LOCAL_DATA
+#ifndef CORO_LOCAL_STACK_FRAME
+#error "You are expected to specify a coroutine stack frame type "\
+       "via CORO_LOCAL_STACK_FRAME"
+#endif  // CORO_LOCAL_STACK_FRAME
+#ifndef CORO_ENTRY
+#error "You are expected to specify a function which each coroutine runs "\
+       "via CORO_ENTRY"
+#endif  // CORO_ENTRY
+#ifndef CORO_STACK_SIZE
+#define CORO_STACK_SIZE (256 * 1024)
+#endif  // CORO_STACK_SIZE
+#ifndef CORO_FRAMES_MIN
+/** Frames allocated by the first coro_call(), deep enough for most recursions. */
+#define CORO_FRAMES_MIN 64
+#endif  // CORO_FRAMES_MIN
+
+/**
+ * Stackful coroutines library. It has the same interface as
+ * coro_jmp.h, but each coroutine runs on its own mmap'ed stack
+ * with a guard page below it, and the switch saves and restores
+ * the callee-saved registers. So unlike coro_jmp.h, locals survive
+ * coro_yield(), and coro_call()/coro_return() are plain calls and
+ * returns. Possible example of usage:
+ *
+ *
+ * #define CORO_ENTRY func_to_split
+ *
+ * foreach (coro : coros)
+ *     coro_init(coro);
+ * coro_wait_all();
+ *
+ *
+ * void func_to_split()
+ * {
+ *     size_t i = 0;
+ *     while (i < n) {
+ *         do_a_bit_of_work(i++);
+ *         coro_maybe_yield();
+ *     }
+ *     coro_return();
+ * }
+ *
+ *
+ * The switch is hand-written for x86-64 and goes through
+ * swapcontext() on the other architectures.
+ *
+ * The coroutines can be run by several worker threads, see
+ * crt.n_workers. Each worker owns a FIFO run queue; a yielding
+ * coroutine goes to the tail of its worker's queue, and a worker
+ * with an empty queue steals from the heads of the others. Fields
+ * of CORO_COMMON_DATA, updated from the coroutines, must be atomic
+ * then.
+ *
+ * A parked coroutine is in no queue, coro_wake() pushes it to the
+ * queue of the waking worker. A worker with nothing to steal calls
+ * coro_poller(true) if some coroutines are parked and no other worker
+ * polls, otherwise it sleeps on a futex until a coroutine is queued
+ * or the last one finishes.
+ */
+
+#if defined(__x86_64__)
+struct coro_context {
+    void *sp;
+};
+
+/**
+ * Save the callee-saved registers on the current stack, store its
+ * position to @a save_sp and restore the registers from @a new_sp.
+ * It is naked and static, so each translation unit gets a local copy
+ * and no global symbol is defined by the header.
+ */
+__attribute__((naked, unused)) static void
+coro_context_jump(__attribute__((unused)) void **save_sp, __attribute__((unused)) void *new_sp)
+{
+    __asm__(
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq %rsi, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+    );
+}
+
+/**
+ * Prepare a context, which starts @a entry on the given stack when
+ * it is switched to the first time. @a entry must never return.
+ */
+static inline void
+coro_context_make(struct coro_context *ctx, void *stack, size_t size, void (*entry)())
+{
+    void **sp = (void**) (((uintptr_t) stack + size) & ~(uintptr_t) 15);
+    /* Fake return address of the entry, keeps the ABI alignment. */
+    *--sp = NULL;
+    *--sp = (void*) entry;
+    for (int i = 0; i < 6; i++) {
+        *--sp = NULL;
+    }
+    ctx->sp = sp;
+}
+
+static inline void
+coro_context_switch(struct coro_context *from, struct coro_context *to)
+{
+    coro_context_jump(&from->sp, to->sp);
+}
+#else
+struct coro_context {
+    ucontext_t uc;
+};
+
+static inline void
+coro_context_make(struct coro_context *ctx, void *stack, size_t size, void (*entry)())
+{
+    getcontext(&ctx->uc);
+    ctx->uc.uc_stack.ss_sp = stack;
+    ctx->uc.uc_stack.ss_size = size;
+    ctx->uc.uc_link = NULL;
+    makecontext(&ctx->uc, entry, 0);
+}
+
+static inline void
+coro_context_switch(struct coro_context *from, struct coro_context *to)
+{
+    swapcontext(&from->uc, &to->uc);
+}
+#endif  // __x86_64__
+
+/**
+ * Lock-free run queue of coroutine indexes. Only the owner worker
+ * pushes to the tail, any worker takes from the head, so it is a
+ * FIFO for the owner and a steal target for the others. Each
+ * coroutine is in at most one queue, so a capacity of coro_count
+ * is never exceeded.
+ */
+struct coro_queue {
+    _Atomic int64_t head;
+    _Atomic int64_t tail;
+    int64_t mask;
+    _Atomic size_t *items;
+};
+
+static inline bool
+coro_queue_create(struct coro_queue *q, size_t min_capacity)
+{
+    size_t capacity = 1;
+    while (capacity < min_capacity) {
+        capacity <<= 1;
+    }
+    q->items = (_Atomic size_t*) calloc(capacity, sizeof(*q->items));
+    q->mask = (int64_t) capacity - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return q->items != NULL;
+}
+
+static inline void
+coro_queue_push(struct coro_queue *q, size_t idx)
+{
+    int64_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    atomic_store_explicit(&q->items[tail & q->mask], idx, memory_order_relaxed);
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+static inline bool
+coro_queue_take(struct coro_queue *q, size_t *idx)
+{
+    int64_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    while (head < atomic_load_explicit(&q->tail, memory_order_acquire)) {
+        size_t item = atomic_load_explicit(&q->items[head & q->mask], memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(&q->head, &head, head + 1,
+                                                  memory_order_acq_rel,
+                                                  memory_order_acquire)) {
+            *idx = item;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct coro;
+
+/** A thread which runs coroutines. */
+struct coro_worker {
+    pthread_t thread;
+    size_t id;
+    struct coro_queue queue;
+    /** Context of the worker loop, resumed when there is no work. */
+    struct coro_context sched_context;
+    struct coro *current;
+    /**
+     * Coroutine which was switched away from. It is queued by the
+     * coroutine switched to, only when its registers are saved.
+     */
+    struct coro *pending;
+#ifdef __SANITIZE_ADDRESS__
+    const void *stack_bottom;
+    size_t stack_size;
+#endif  // __SANITIZE_ADDRESS__
+    unsigned random_state;
+
+    /** Statistics. */
+    struct {
+        /** Time spent in coroutines, not in the worker loop. */
+        coro_ticks_t busy_ticks;
+        coro_ticks_t wall_ticks;
+        size_t n_steals;
+        /** Sleeps on the futex and blocking polls when idle. */
+        size_t n_sleeps;
+        size_t n_idle_waits;
+    };
+};
+
+/**
+ * The worker of the current thread. It is not inline, so that
+ * the compiler does not cache the thread pointer across a switch:
+ * a coroutine can be resumed by another thread.
+ */
+static __thread struct coro_worker *coro_tls_worker;
+
+__attribute__((noinline)) static struct coro_worker*
+coro_worker_self()
+{
+    struct coro_worker *w = coro_tls_worker;
+    __asm__ volatile("" ::: "memory");
+    return w;
+}
+
+/**
+ * Arguments of a function called via coro_call(). With real stacks
+ * they could be normal arguments, but the frames are kept for the
+ * compatibility with coro_jmp.h.
+ */
+struct coro_stack_frame {
+    CORO_LOCAL_STACK_FRAME uframe;
+};
+
+struct coro {
+    /** Registers and stack position where the coroutine stopped. */
+    struct coro_context context;
+
+    /** The whole mapping, including the guard page. */
+    void *stack_mem;
+    size_t stack_mem_size;
+
+    /**
+     * This flag is set when the coroutine has finished its
+     * task. It is used to wait until all the coroutines are
+     * finished.
+     */
+    bool is_finished;
+
+    /**
+     * Intended for checks outside of the coroutine that it was
+     * finished with no errors.
+     */
+    bool no_errors_occurred;
+
+    /** One of enum coro_park_state, see coro_park(). */
+    atomic_int park_state;
+
+    struct {
+        /** Ticks of coro_ticks() spent in this coroutine. */
+        coro_ticks_t ticks_spent;
+        /** When the coroutine was scheduled last time. */
+        coro_ticks_t timestamp;
+        /** How many times the coroutine gave the CPU away. */
+        size_t switch_count;
+        /** The same split by phases, see coro_phase.h. */
+        struct coro_phases phases;
+    };
+
+    CORO_LOCAL_DATA;
+
+    /** Frames of coro_call() arguments. */
+    struct {
+        size_t stack_pointer;
+        size_t stack_capacity;
+        struct coro_stack_frame *stack;
+    };
+};
+
+static struct CoRuntime
+{
+    size_t coro_count;
+    struct coro *coros;
+
+    /**
+     * A coroutine is allowed to run that long before
+     * coro_maybe_yield() switches it out. Set by
+     * coro_set_quantum().
+     */
+    coro_ticks_t quantum_ticks;
+
+    /**
+     * Number of worker threads, set before coro_wait_all(). 0 and
+     * 1 mean the calling thread only.
+     */
+    size_t n_workers;
+    struct coro_worker *workers;
+    atomic_size_t n_finished;
+    atomic_size_t n_parked;
+    /** Set while a worker is in coro_poller(), it is called by one at a time. */
+    atomic_bool is_polling;
+    /** Idle workers sleep on the futex of idle_seq while it is not changed. */
+    atomic_size_t n_sleeping;
+    _Atomic uint32_t idle_seq;
+    CORO_COMMON_DATA;
+} crt;
+
+enum coro_park_state {
+    CORO_RUNNING,
+    /** Woken while running: the next coro_park() returns at once. */
+    CORO_NOTIFIED,
+    /** Parked, but its registers are not saved yet. */
+    CORO_PARKING,
+    CORO_PARKED,
+};
+
+/**
+ * Wakes parked coroutines whose events have happened, see coro_jmp.h.
+ * It may be called by any worker, but never by two at once.
+ */
+typedef void (*coro_poll_f)(bool can_block);
+static coro_poll_f coro_poller;
+
+/** Set the scheduling quantum in microseconds. */
+static inline void
+coro_set_quantum(size_t quantum_us)
+{
+    coro_clock_calibrate();
+    crt.quantum_ticks = coro_ns_to_ticks((uint64_t) quantum_us * 1000);
+}
+
+/** Get currently working coroutine. */
+#define coro_this() (coro_worker_self()->current)
+
+/** Index of the currently working coroutine. */
+#define coro_id() ((size_t) (coro_this() - crt.coros))
+
+/**
+ * Switch between two contexts and tell ASan that the stack is
+ * changed. A finished coroutine passes @a is_last, then its fake
+ * stack is dropped. @a to_coro is NULL when switching to the
+ * worker loop.
+ */
+static inline void
+coro_switch_context(struct coro_context *from, struct coro_context *to, struct coro *to_coro,
+                    bool is_last)
+{
+#ifdef __SANITIZE_ADDRESS__
+    void *fake_stack = NULL;
+    const void *bottom;
+    size_t size;
+    if (to_coro != NULL) {
+        bottom = (char*) to_coro->stack_mem + (to_coro->stack_mem_size - CORO_STACK_SIZE);
+        size = CORO_STACK_SIZE;
+    } else {
+        bottom = coro_worker_self()->stack_bottom;
+        size = coro_worker_self()->stack_size;
+    }
+    __sanitizer_start_switch_fiber(is_last ? NULL : &fake_stack, bottom, size);
+    coro_context_switch(from, to);
+    __sanitizer_finish_switch_fiber(fake_stack, NULL, NULL);
+#else
+    (void) to_coro;
+    (void) is_last;
+    coro_context_switch(from, to);
+#endif  // __SANITIZE_ADDRESS__
+}
+
+static inline void
+coro_futex_wake(int n)
+{
+    atomic_fetch_add_explicit(&crt.idle_seq, 1, memory_order_seq_cst);
+    syscall(SYS_futex, &crt.idle_seq, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/** Queue a coroutine to the worker @a w and wake a sleeping worker to steal it. */
+static inline void
+coro_ready_push(struct coro_worker *w, size_t idx)
+{
+    coro_queue_push(&w->queue, idx);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&crt.n_sleeping, memory_order_relaxed) > 0) {
+        coro_futex_wake(1);
+    }
+}
+
+/**
+ * Queue the coroutine we have just switched away from. A parking
+ * one is queued only if it has been woken meanwhile.
+ */
+static inline void
+coro_after_switch()
+{
+    struct coro_worker *w = coro_worker_self();
+    struct coro *c = w->pending;
+    if (c == NULL) {
+        return;
+    }
+    w->pending = NULL;
+    int state = CORO_PARKING;
+    if (!atomic_compare_exchange_strong(&c->park_state, &state, CORO_PARKED)) {
+        coro_ready_push(w, (size_t) (c - crt.coros));
+    }
+}
+
+/** Let one worker at a time poll for the events of parked coroutines. */
+static inline bool
+coro_poll(struct coro_worker *w, bool can_block)
+{
+    if (coro_poller == NULL || atomic_load_explicit(&crt.n_parked, memory_order_acquire) == 0 ||
+        atomic_exchange_explicit(&crt.is_polling, true, memory_order_acquire)) {
+        return false;
+    }
+    if (can_block) {
+        w->n_idle_waits++;
+    }
+    coro_poller(can_block);
+    atomic_store_explicit(&crt.is_polling, false, memory_order_release);
+    return true;
+}
+
+/** Take a coroutine from the own queue, or steal one. */
+static inline bool
+coro_worker_next(struct coro_worker *w, size_t *idx)
+{
+    if (coro_queue_take(&w->queue, idx)) {
+        return true;
+    }
+    size_t n = crt.n_workers;
+    if (n <= 1) {
+        return false;
+    }
+    w->random_state = w->random_state * 1103515245 + 12345;
+    size_t start = (size_t) (w->random_state >> 16) % n;
+    for (size_t k = 0; k < n; k++) {
+        struct coro_worker *victim = &crt.workers[(start + k) % n];
+        if (victim != w && coro_queue_take(&victim->queue, idx)) {
+            w->n_steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Give the CPU to the next coroutine of this worker. If there is
+ * none, a running coroutine just continues, and a finished or a
+ * parking one goes back to the worker loop. A parking one is not
+ * queued again, coro_wake() does it.
+ */
+static inline void
+coro_switch_next(bool is_parking)
+{
+    struct coro_worker *w = coro_worker_self();
+    struct coro *old = w->current;
+    coro_poll(w, false);
+    coro_ticks_t stamp = coro_ticks();
+    if (!old->is_finished) {
+        old->ticks_spent += stamp - old->timestamp;
+        old->timestamp = stamp;
+    }
+    size_t next_i;
+    if (!coro_worker_next(w, &next_i)) {
+        if (old->is_finished) {
+            w->current = NULL;
+            coro_switch_context(&old->context, &w->sched_context, NULL, true);
+        } else if (is_parking) {
+            old->switch_count++;
+            coro_phases_switch(&old->phases, NULL, stamp);
+            w->pending = old;
+            w->current = NULL;
+            coro_switch_context(&old->context, &w->sched_context, NULL, false);
+            coro_after_switch();
+        }
+        return;
+    }
+    struct coro *next = &crt.coros[next_i];
+    if (!old->is_finished) {
+        old->switch_count++;
+        w->pending = old;
+    }
+    next->timestamp = stamp;
+    coro_phases_switch(old->is_finished ? NULL : &old->phases, &next->phases, stamp);
+    w->current = next;
+    coro_switch_context(&old->context, &next->context, next, old->is_finished);
+    coro_after_switch();
+}
+
+/** Declare that this curoutine has finished. */
+#define coro_finish() ({ \
+    if (coro_this()->stack_pointer != 0) {                          \
+        LOG_ERROR("coro[%lu] stack is corrupted, sp = %lu",         \
+                  coro_id(), coro_this()->stack_pointer);           \
+        coro_this()->no_errors_occurred = false;                    \
+    }                                                               \
+    free(coro_this()->stack);                                       \
+    coro_this()->stack = NULL;                                      \
+    coro_this()->is_finished = true;                                \
+    coro_ticks_t stamp = coro_ticks();                              \
+    coro_this()->ticks_spent += stamp - coro_this()->timestamp;     \
+    coro_this()->timestamp = stamp;                                 \
+    coro_phases_close(&coro_this()->phases, stamp,                  \
+                      coro_this()->ticks_spent,                     \
+                      coro_this()->switch_count);                   \
+})
+
+/** Stop the current coroutine and switch to another one. */
+#define coro_yield() coro_switch_next(false)
+
+/**
+ * Stop the current coroutine until somebody calls coro_wake() for
+ * it, usually coro_poller(). The wake-up may be spurious, check the
+ * condition again after it. A wake-up which comes before the park
+ * is not lost, the park returns at once then.
+ */
+static inline void
+coro_park()
+{
+    struct coro *c = coro_this();
+    int state = CORO_RUNNING;
+    atomic_fetch_add(&crt.n_parked, 1);
+    if (!atomic_compare_exchange_strong(&c->park_state, &state, CORO_PARKING)) {
+        atomic_fetch_sub(&crt.n_parked, 1);
+        atomic_store(&c->park_state, CORO_RUNNING);
+        return;
+    }
+    coro_switch_next(true);
+}
+
+/** Queue a parked coroutine to the current worker, or notify a running one. */
+static inline void
+coro_wake(size_t idx)
+{
+    struct coro *c = &crt.coros[idx];
+    int state = atomic_load(&c->park_state);
+    int new_state;
+    do {
+        if (state == CORO_NOTIFIED) {
+            return;
+        }
+        /* A parking one is queued by coro_after_switch(). */
+        new_state = state == CORO_RUNNING ? CORO_NOTIFIED : CORO_RUNNING;
+    } while (!atomic_compare_exchange_weak(&c->park_state, &state, new_state));
+    if (state == CORO_RUNNING) {
+        return;
+    }
+    atomic_fetch_sub(&crt.n_parked, 1);
+    if (state == CORO_PARKED) {
+        coro_ready_push(coro_worker_self(), idx);
+    }
+}
+
+/**
+ * Yield only when the current coroutine has used up its quantum.
+ * It is cheap enough to be put into hot loops.
+ */
+#define coro_maybe_yield() ({ \
+    if (coro_ticks() - coro_this()->timestamp >= crt.quantum_ticks) {   \
+        coro_yield();                                                   \
+    }                                                                   \
+})
+
+/**
+ * Call a function with arguments in a new stack frame, they are
+ * available via coro_this()->stack[coro_this()->stack_pointer].
+ */
+#define coro_call(func, ...) ({ \
+    struct coro *c = coro_this();                                                           \
+    if ((c->stack_pointer + 1) >= c->stack_capacity) {                                      \
+        size_t new_cap = (c->stack_pointer + 1) * 2;                                        \
+        new_cap = new_cap > CORO_FRAMES_MIN ? new_cap : CORO_FRAMES_MIN;                    \
+        LOG_DEBUG("reallocating stack to (%lu)", new_cap);                                  \
+        size_t new_size = new_cap * sizeof(struct coro_stack_frame);                        \
+        c->stack =                                                                          \
+            (struct coro_stack_frame*) realloc(c->stack, new_size);                         \
+        if (c->stack == NULL) {                                                             \
+            LOG_FATAL("unable to realloc(%lu) stack", new_size);                            \
+        }                                                                                   \
+        c->stack_capacity = new_cap;                                                        \
+    }                                                                                       \
+    c->stack[c->stack_pointer + 1].uframe = (CORO_LOCAL_STACK_FRAME) {__VA_ARGS__};         \
+    (c->stack_pointer)++;                                                                   \
+    func();                                                                                 \
+})
+
+/** Return from a function, previously called via coro_call(). */
+#define coro_return() do { \
+    ASSERT(coro_this()->stack_pointer > 0);     \
+    coro_this()->stack_pointer--;               \
+    return;                                     \
+} while (false)
+
+static void
+coro_trampoline()
+{
+#ifdef __SANITIZE_ADDRESS__
+    __sanitizer_finish_switch_fiber(NULL, NULL, NULL);
+#endif  // __SANITIZE_ADDRESS__
+    coro_after_switch();
+    coro_call(CORO_ENTRY);
+    coro_finish();
+    if (atomic_fetch_add_explicit(&crt.n_finished, 1, memory_order_release) + 1 == crt.coro_count) {
+        coro_futex_wake(INT_MAX);
+    }
+    coro_switch_next(false);
+    /* A finished coroutine is never resumed. */
+    abort();
+}
+
+/**
+ * Initialize a coroutine: map its stack and prepare it to start
+ * CORO_ENTRY. Always returns 0, the value is kept for the
+ * compatibility with coro_jmp.h.
+ */
+static inline int
+coro_init(size_t coro_idx)
+{
+    ASSERT(crt.coros != NULL);
+    struct coro *c = &crt.coros[coro_idx];
+    c->is_finished = false;
+    c->no_errors_occurred = true;
+    atomic_store(&c->park_state, CORO_RUNNING);
+
+    c->stack_pointer = 0;
+    c->stack_capacity = 0;
+    c->stack = NULL;
+
+    c->ticks_spent = 0;
+    c->timestamp = 0;
+    c->switch_count = 0;
+    memset(&c->phases, 0, sizeof(c->phases));
+
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    c->stack_mem_size = CORO_STACK_SIZE + page;
+    c->stack_mem = mmap(NULL, c->stack_mem_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (c->stack_mem == MAP_FAILED) {
+        LOG_FATAL("unable to mmap(%lu) a coroutine stack", c->stack_mem_size);
+    }
+    /* Stacks grow down, the guard page is the lowest one. */
+    if (mprotect(c->stack_mem, page, PROT_NONE) != 0) {
+        LOG_FATAL("unable to protect a guard page");
+    }
+    coro_context_make(&c->context, (char*) c->stack_mem + page, CORO_STACK_SIZE,
+                      coro_trampoline);
+    return 0;
+}
+
+/**
+ * Nothing to run or to steal: poll for the parked coroutines, or
+ * sleep until a coroutine is queued. The queues are checked again
+ * after announcing the sleep, so a push in between is not missed.
+ */
+static inline void
+coro_worker_idle(struct coro_worker *w)
+{
+    if (coro_poll(w, true)) {
+        return;
+    }
+    atomic_fetch_add_explicit(&crt.n_sleeping, 1, memory_order_seq_cst);
+    uint32_t seq = atomic_load_explicit(&crt.idle_seq, memory_order_seq_cst);
+    bool has_work = atomic_load(&crt.n_finished) == crt.coro_count;
+    for (size_t i = 0; i < crt.n_workers && !has_work; i++) {
+        struct coro_queue *q = &crt.workers[i].queue;
+        has_work = atomic_load(&q->head) < atomic_load(&q->tail);
+    }
+    if (!has_work) {
+        w->n_sleeps++;
+        syscall(SYS_futex, &crt.idle_seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+    }
+    atomic_fetch_sub_explicit(&crt.n_sleeping, 1, memory_order_relaxed);
+}
+
+/** Worker loop: run coroutines until all of them have finished. */
+static void*
+coro_worker_main(void *arg)
+{
+    struct coro_worker *w = (struct coro_worker*) arg;
+    coro_tls_worker = w;
+#ifdef __SANITIZE_ADDRESS__
+    pthread_attr_t attr;
+    void *stack_addr = NULL;
+    size_t stack_size = 0;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        pthread_attr_getstack(&attr, &stack_addr, &stack_size);
+        pthread_attr_destroy(&attr);
+    }
+    w->stack_bottom = stack_addr;
+    w->stack_size = stack_size;
+#endif  // __SANITIZE_ADDRESS__
+    coro_ticks_t start = coro_ticks();
+    while (atomic_load_explicit(&crt.n_finished, memory_order_acquire) < crt.coro_count) {
+        size_t idx;
+        if (!coro_worker_next(w, &idx)) {
+            coro_worker_idle(w);
+            continue;
+        }
+        struct coro *c = &crt.coros[idx];
+        coro_ticks_t stamp = coro_ticks();
+        c->timestamp = stamp;
+        coro_phases_switch(NULL, &c->phases, stamp);
+        w->current = c;
+        coro_switch_context(&w->sched_context, &c->context, c, false);
+        coro_after_switch();
+        w->busy_ticks += coro_ticks() - stamp;
+    }
+    w->wall_ticks = coro_ticks() - start;
+    coro_tls_worker = NULL;
+    return NULL;
+}
+
+/**
+ * Run the coroutines on crt.n_workers threads (the calling one is
+ * the first of them) until all of them have finished, then unmap
+ * their stacks. It is called from outside of the coroutines.
+ * Worker statistics stay in crt.workers until coro_destroy().
+ */
+static inline void
+coro_wait_all()
+{
+    size_t n = crt.n_workers > 0 ? crt.n_workers : 1;
+    crt.n_workers = n;
+    free(crt.workers);
+    crt.workers = (struct coro_worker*) calloc(n, sizeof(struct coro_worker));
+    if (crt.workers == NULL) {
+        LOG_FATAL("calloc(%lu) failed", n);
+    }
+    size_t n_finished = 0;
+    for (size_t i = 0; i < n; i++) {
+        crt.workers[i].id = i;
+        crt.workers[i].random_state = (unsigned) i + 1;
+        if (!coro_queue_create(&crt.workers[i].queue, crt.coro_count)) {
+            LOG_FATAL("unable to allocate a run queue (%lu)", crt.coro_count);
+        }
+    }
+    for (size_t i = 0; i < crt.coro_count; i++) {
+        if (crt.coros[i].is_finished) {
+            n_finished++;
+        } else {
+            coro_queue_push(&crt.workers[i % n].queue, i);
+        }
+    }
+    atomic_store(&crt.n_finished, n_finished);
+    atomic_store(&crt.n_parked, 0);
+    atomic_store(&crt.is_polling, false);
+
+    for (size_t i = 1; i < n; i++) {
+        if (pthread_create(&crt.workers[i].thread, NULL, coro_worker_main, &crt.workers[i]) != 0) {
+            LOG_FATAL("unable to start worker %lu", i);
+        }
+    }
+    coro_worker_main(&crt.workers[0]);
+    for (size_t i = 1; i < n; i++) {
+        pthread_join(crt.workers[i].thread, NULL);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        free(crt.workers[i].queue.items);
+        crt.workers[i].queue.items = NULL;
+    }
+    for (size_t i = 0; i < crt.coro_count; i++) {
+        ASSERT(crt.coros[i].is_finished);
+        if (crt.coros[i].stack_mem != NULL) {
+#ifdef __SANITIZE_ADDRESS__
+            // A finished coroutine never unwinds its frames, their
+            // redzones would be inherited by the next mapping here:
+            __asan_unpoison_memory_region(crt.coros[i].stack_mem, crt.coros[i].stack_mem_size);
+#endif  // __SANITIZE_ADDRESS__
+            munmap(crt.coros[i].stack_mem, crt.coros[i].stack_mem_size);
+            crt.coros[i].stack_mem = NULL;
+        }
+    }
+}
+
+/** Free the runtime internals, including the worker statistics. */
+static inline void
+coro_destroy()
+{
+    free(crt.workers);
+    crt.workers = NULL;
+}
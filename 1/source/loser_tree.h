@@ -0,0 +1,184 @@
+#ifndef LOSER_TREE_H
+#define LOSER_TREE_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/**
+ * Tournament (loser) tree for a k-way merge of sorted runs.
+ * num_t is expected to be defined before this header. Possible
+ * example of usage:
+ *
+ *
+ * struct ltree tree;
+ * ltree_init(&tree, k);
+ * foreach (run : runs)
+ *     ltree_set_run(&tree, i, run.numbers, run.size);
+ * ltree_build(&tree);
+ * while (ltree_pop(&tree, &value))
+ *     consume(value);
+ * ltree_destroy(&tree);
+ *
+ *
+ * Each pop costs O(log k) comparisons instead of O(k) of a linear
+ * scan. When half of the runs are exhausted, the tree is rebuilt
+ * over the remaining ones, so the dead leaves do not take part in
+ * the replays.
+ *
+ * Runs which do not fit into memory are streamed: when a run's
+ * array is over, ltree.refill is asked for its next block.
+ */
+
+struct ltree_run {
+    const num_t *cur;
+    const num_t *end;
+    /** Index given to ltree_set_run(), the leaves are reordered. */
+    size_t id;
+};
+
+/**
+ * Give the next block of the run @a id, return false when the run
+ * is over.
+ */
+typedef bool (*ltree_refill_f)(void *ctx, size_t id, const num_t **cur, const num_t **end);
+
+struct ltree {
+    /** Number of leaves. It shrinks while runs get exhausted. */
+    size_t k;
+    /** Number of runs which still have numbers. */
+    size_t n_active;
+    /**
+     * Internal nodes [1, k) keep the index of the run which lost
+     * the match in that node, nodes[0] keeps the overall winner.
+     */
+    size_t *nodes;
+    struct ltree_run *runs;
+    /** Optional source of the next blocks of the runs. */
+    ltree_refill_f refill;
+    void *refill_ctx;
+};
+
+/** Exhausted runs lose to everybody. */
+static inline bool
+ltree_less(const struct ltree *t, size_t a, size_t b)
+{
+    const struct ltree_run *ra = &t->runs[a];
+    const struct ltree_run *rb = &t->runs[b];
+    if (ra->cur == ra->end) {
+        return false;
+    }
+    if (rb->cur == rb->end) {
+        return true;
+    }
+    return *ra->cur < *rb->cur;
+}
+
+static inline bool
+ltree_init(struct ltree *t, size_t k)
+{
+    t->k = k;
+    t->n_active = 0;
+    t->refill = NULL;
+    t->refill_ctx = NULL;
+    t->nodes = (size_t*) calloc(k > 0 ? k : 1, sizeof(size_t));
+    t->runs = (struct ltree_run*) calloc(k > 0 ? k : 1, sizeof(struct ltree_run));
+    if (t->nodes == NULL || t->runs == NULL) {
+        free(t->nodes);
+        free(t->runs);
+        t->nodes = NULL;
+        t->runs = NULL;
+        return false;
+    }
+    return true;
+}
+
+static inline void
+ltree_set_run(struct ltree *t, size_t i, const num_t *numbers, size_t size)
+{
+    t->runs[i].cur = numbers;
+    t->runs[i].end = numbers + size;
+    t->runs[i].id = i;
+}
+
+/** Play the matches of the subtree rooted at @a node, return its winner. */
+static size_t
+ltree_play(struct ltree *t, size_t node)
+{
+    if (node >= t->k) {
+        return node - t->k;
+    }
+    size_t left = ltree_play(t, 2 * node);
+    size_t right = ltree_play(t, 2 * node + 1);
+    if (ltree_less(t, right, left)) {
+        t->nodes[node] = left;
+        return right;
+    }
+    t->nodes[node] = right;
+    return left;
+}
+
+/**
+ * (Re)build the tree. Exhausted runs are dropped from the leaves
+ * first, so the tree only contains runs with numbers.
+ */
+static inline void
+ltree_build(struct ltree *t)
+{
+    size_t active = 0;
+    for (size_t i = 0; i < t->k; i++) {
+        if (t->runs[i].cur != t->runs[i].end) {
+            t->runs[active++] = t->runs[i];
+        }
+    }
+    t->k = active;
+    t->n_active = active;
+    if (active == 0) {
+        return;
+    }
+    t->nodes[0] = ltree_play(t, 1);
+}
+
+/**
+ * Take the smallest number out of the tree. Returns false when
+ * all the runs are exhausted.
+ */
+static inline bool
+ltree_pop(struct ltree *t, num_t *value)
+{
+    if (t->n_active == 0) {
+        return false;
+    }
+    size_t winner = t->nodes[0];
+    struct ltree_run *run = &t->runs[winner];
+    *value = *run->cur++;
+    if (run->cur == run->end &&
+        (t->refill == NULL || !t->refill(t->refill_ctx, run->id, &run->cur, &run->end))) {
+        t->n_active--;
+        if (t->n_active * 2 <= t->k) {
+            ltree_build(t);
+            return true;
+        }
+    }
+    for (size_t node = (winner + t->k) >> 1; node > 0; node >>= 1) {
+        size_t loser = t->nodes[node];
+        if (ltree_less(t, loser, winner)) {
+            t->nodes[node] = winner;
+            winner = loser;
+        }
+    }
+    t->nodes[0] = winner;
+    return true;
+}
+
+static inline void
+ltree_destroy(struct ltree *t)
+{
+    free(t->nodes);
+    free(t->runs);
+    t->nodes = NULL;
+    t->runs = NULL;
+    t->k = 0;
+    t->n_active = 0;
+}
+
+#endif  // LOSER_TREE_H
@@ -24,7 +24,7 @@
     printf("\n");
 #ifdef DEBUG_EXTRA
 #define LOG_DEBUG_EXTRA(...) \
-    printf("D/LOG/%s(%lu): ", __func__, crt.curr_coro_i); \
+    printf("D/LOG/%s(%lu): ", __func__, coro_id()); \
     printf(__VA_ARGS__);\
     printf("\n");
 #endif  // LOG_DEBUG_EXTRA
@@ -1,48 +1,137 @@
+#define _GNU_SOURCE
 #define NDEBUG
 #define DEBUG_EXTRA
 #include <aio.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 #include "macro.h"
+#include "num_type.h"
 
-typedef long int num_t;
 const char* const O_FILE_NAME = "mergesorted.txt";
 enum
 {
-    NUMBERS_PER_FILE_DEFAULT = 1000
+    NUMBERS_PER_FILE_DEFAULT = 1000,
+    /** How many numbers are parsed between two yields. */
+    PARSE_CHUNK_NUMBERS = 4096,
+    /** How many numbers are scanned by a partition between two yield checks. */
+    PARTITION_STEP = 8192,
+    /** The same for the heap sort fallback, in sifts. */
+    HEAP_SORT_STEP = 512,
+    /** How many numbers a radix or a counting sort handles between two yield checks. */
+    RADIX_STEP = 8192,
+    /** How many numbers an early merge moves between two yield checks. */
+    EARLY_MERGE_STEP = 8192,
+    QUANTUM_US_DEFAULT = 500,
+    /** Output buffers: one is merged into while the other is written. */
+    OUT_BUFFERS_DEFAULT = 2,
+    /** Smallest slice of a parallel merge, in numbers. */
+    MERGE_SLICE_MIN = 1 << 16,
+    /** Widest key range of the histograms summed by the final merge. */
+    HIST_MERGE_MAX = 1 << 22,
+    URING_ENTRIES = 64,
+    /** Inputs are read by io_uring in pieces of that size. */
+    URING_READ_CHUNK = 1 << 20,
+
+    /**
+     * Memory taken by one byte of a chunk in the external sort: the
+     * text itself plus up to a number per two bytes.
+     */
+    EXTERNAL_BYTES_PER_CHUNK_BYTE = 1 + sizeof(num_t) / 2,
+    /** Radix sort needs a second array of the numbers. */
+    EXTERNAL_RADIX_BYTES_PER_CHUNK_BYTE = EXTERNAL_BYTES_PER_CHUNK_BYTE + sizeof(num_t) / 2,
+    EXTERNAL_CHUNK_MIN = 64,
+    /** Limits of a read-ahead block of a spilled run. */
+    EXTERNAL_BLOCK_MIN = 4 << 10,
+    EXTERNAL_BLOCK_MAX = 4 << 20,
+    /** Desired number of runs merged at once. */
+    EXTERNAL_FAN_IN = 64,
+    /** How many bytes are read at once looking for a chunk boundary. */
+    EXTERNAL_BOUNDARY_WINDOW = 256,
 };
 
+#include "sort_engine.h"
+#include "num_parse.h"
+#include "run_format.h"
+
+enum SortEngine
+{
+    /**
+     * Counting for more numbers than keys in their range, radix sort
+     * for big arrays with a narrow key range, introsort otherwise.
+     */
+    ENGINE_AUTO,
+    ENGINE_QUICK,
+    ENGINE_INTRO,
+    ENGINE_RADIX,
+    /** Histogram of the keys, see CountSort(). */
+    ENGINE_COUNT,
+};
 
 #define CORO_LOCAL_DATA struct \
 {                               \
     /* File representation */   \
     struct aiocb aio_control;   \
+    char *map_base;             \
+    size_t map_size;            \
+    long long load_ns;          \
+    _Atomic size_t reads_pending;\
+    bool read_failed;           \
                                 \
     /* File parsing */          \
+    enum rfmt_format format;    \
+    /* Header bytes to skip */  \
+    size_t header_size;         \
+    num_t delta_prev;           \
     num_t *numbers;             \
     num_t temp_number;          \
     size_t numbers_size;        \
     size_t numbers_capacity;    \
     char *end_ptr;              \
     char *start_ptr;            \
+    long long parse_ns;         \
                                 \
     num_t target;               \
     size_t lower_idx;           \
     size_t upper_idx;           \
                                 \
-    /* Misc */                  \
-    size_t cur_pos;             \
+    /* Sort engines */          \
+    enum SortEngine engine;     \
+    /* Radix sort of 32-bit keys */\
+    bool is_narrow;             \
+    num_t key_min;              \
+    num_t key_max;              \
+    coro_ticks_t sort_ticks;    \
+    struct sort_heap heap;      \
+    struct sort_radix *radix;   \
+    num_t *radix_tmp;           \
+    /* Run of a counting sort */\
+    struct sort_hist hist;      \
+                                \
+    /* Early merge */           \
+    size_t merge_other;         \
+    num_t *merge_dst;           \
+    size_t merge_i;             \
+    size_t merge_j;             \
 }
 
 #define CORO_COMMON_DATA struct \
 {                               \
-    size_t total_n_numbers;     \
+    _Atomic size_t total_n_numbers;\
 }
 
 
@@ -51,64 +140,481 @@ struct sframe_t
     size_t sort_from;
     size_t sort_to;
     size_t sep_idx;
+    /** Introsort turns to heap sort when it runs out of depth. */
+    size_t depth_left;
 };
 #define CORO_LOCAL_STACK_FRAME struct sframe_t
+#define CORO_ENTRY CoroExec
+void CoroExec();
+#ifdef CORO_BACKEND_STACK
+#include "coro_stack.h"
+#else
 #include "coro_jmp.h"
+#endif  // CORO_BACKEND_STACK
+#include "arena.h"
+#include "loser_tree.h"
+#include "out_buf.h"
+#include "run_io.h"
+#include "uring_io.h"
+
+/** Phases of a coroutine, see coro_phase_set(). */
+enum Phase
+{
+    /** Waiting for the input to be read. */
+    PHASE_WAIT,
+    PHASE_PARSE,
+    PHASE_SORT,
+    /** Merging the sorted run with others, see MergeEarly(). */
+    PHASE_MERGE,
+    PHASE_COUNT,
+};
+
+/** Counters sampled on each switch when the profiling is on. */
+enum Counter
+{
+    COUNTER_CPU_NS,
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_MISSES,
+    COUNTER_COUNT,
+};
+static const char *const phase_names[] = {"wait", "parse", "sort", "early_merge"};
+static const char *const counter_names[] = {"cpu", "cycles", "instructions", "cache_misses"};
+_Static_assert((int) PHASE_COUNT <= (int) CORO_PHASE_MAX && (int) COUNTER_COUNT <= (int) CORO_COUNTERS,
+               "coro_phase.h has no room for the phases or the counters");
+
+enum InputMode
+{
+    /** Read each file into a buffer with aio_read(). */
+    INPUT_AIO,
+    /** Parse straight from a read-only mapping of the file. */
+    INPUT_MMAP,
+    /** Read with io_uring, falls back to INPUT_AIO without it. */
+    INPUT_URING,
+};
+
+struct SortOptions
+{
+    size_t out_buf_size;
+    /** Output buffers written in turn with aio_write(), 1 writes synchronously. */
+    size_t out_buffers;
+    size_t quantum_us;
+    size_t n_workers;
+    enum InputMode input_mode;
+    enum SortEngine sort_engine;
+    /** Not 0 turns on the external sort, see SortChunks(). */
+    size_t memory_limit;
+    const char *tmp_dir;
+    /** Read hardware counters with perf_event_open(). */
+    bool use_perf;
+    /** Not NULL turns on the profiling and exports it to that file. */
+    const char *stats_json;
+    /** Input format is detected from the header of each file, unless forced. */
+    bool is_in_format_forced;
+    enum rfmt_format in_format;
+    enum rfmt_format out_format;
+    /** Merge sorted runs while other files are still parsed. */
+    bool use_early_merge;
+    /** Threads of the final in-memory merge, 0 takes one per worker. */
+    size_t merge_threads;
+    /** Back the numbers with transparent huge pages, see arena.h. */
+    bool use_huge_pages;
+    /** Radix sort 32-bit keys when the key range of a run allows. */
+    bool use_narrow_keys;
+    /** Write "value count" lines instead of every number. */
+    bool use_aggregate;
+
+    char **filenames;
+    size_t n_files;
+};
+static struct SortOptions opts = {
+    .out_buf_size = OBUF_SIZE_DEFAULT,
+    .out_buffers = OUT_BUFFERS_DEFAULT,
+    .quantum_us = QUANTUM_US_DEFAULT,
+    .n_workers = 1,
+    .input_mode = INPUT_URING,
+    .use_early_merge = true,
+    .use_narrow_keys = true,
+};
+
+/** Output writer, kept global for the statistics. */
+static struct obuf output;
+
+/** Format of each input file, see DetectFormat(). */
+struct InputFile
+{
+    enum rfmt_format format;
+    size_t header_size;
+};
+static struct InputFile *input_files;
+
+/**
+ * A slice of the output of a parallel merge, see MergeParallel().
+ * Run i gives numbers [begin[i], end[i]) to the slice.
+ */
+struct MergeSlice
+{
+    const size_t *begin;
+    const size_t *end;
+    size_t n_numbers;
+    /** The number before the slice, the delta format starts from it. */
+    num_t prev;
+    /** Where the slice goes in the output file, and its length. */
+    off_t offset;
+    size_t bytes;
+    int fd;
+    struct obuf out;
+    bool is_ok;
+};
+
+/** Parallel merge statistics. */
+static struct
+{
+    size_t n_slices;
+    long long split_ns;
+    long long measure_ns;
+} pmerge;
+
+/**
+ * Histograms of the runs summed by the final merge, see
+ * SumHistograms(). When some runs are numbers or the keys are too
+ * far apart, the histograms are expanded into runs instead.
+ */
+static struct
+{
+    struct sort_hist total;
+    size_t n_histograms;
+    size_t n_expanded;
+} hmerge;
+
+/**
+ * Memory of the parsed numbers, see AllocateNumbers(). The external
+ * sort sizes its chunk buffers by the budget instead.
+ */
+static struct
+{
+    struct arena arena;
+    /** Read buffers freed right after parsing. */
+    _Atomic size_t released_bytes;
+} memory;
+
+/** Input statistics, summed over all the batches. */
+static struct
+{
+    long long read_submit_ns;
+    long long load_ns;
+    size_t bytes;
+} input;
+
+/**
+ * Machine readable timings of the phases. Reading is the wall time
+ * until the last input of a batch is loaded. Parsing and sorting
+ * are summed over the coroutines, without the time they spent
+ * switched out. Merging is the wall time of the final merge.
+ * Writing is the time spent inside write() by the output and the
+ * spilled runs, it is a part of the merges.
+ */
+static struct
+{
+    long long read_ns;
+    long long parse_ns;
+    long long sort_ns;
+    long long merge_ns;
+    long long write_ns;
+} phases;
+
+/**
+ * Profile of the phases, filled when the counters are sampled on
+ * the switches (--perf or --stats-json). Slot i sums coroutine i
+ * over all the batches. The merge runs on the main thread outside
+ * of the coroutines, it is measured as a whole.
+ */
+static struct
+{
+    bool is_enabled;
+    struct coro_phases *coros;
+    size_t n_coros;
+    uint64_t merge_counters[CORO_COUNTERS];
+
+    /** Destroys perf events of the worker threads when they exit. */
+    pthread_key_t perf_key;
+    bool has_perf_key;
+    atomic_bool is_perf_unavailable;
+} profile;
+
+/** Perf events of a thread, opened on the first sample. */
+struct PerfEvents
+{
+    bool is_open;
+    /** The group leader first, then the members. */
+    int fds[COUNTER_COUNT];
+    /** Counter of each value of a group read. */
+    enum Counter order[COUNTER_COUNT];
+    size_t n_events;
+    /** The last values read, reused if a read fails. */
+    uint64_t last[COUNTER_COUNT];
+};
+static __thread struct PerfEvents perf_events;
+
+/** aio and io_uring input state, see PollInput() and ReapReads(). */
+static struct
+{
+    struct uring ring;
+    bool is_enabled;
+    bool is_unavailable;
+    bool is_registration_done;
+    /** Buffer i is the read buffer of coroutine i. */
+    bool has_fixed_buffers;
+    /** The next read to queue: a coroutine and an offset in its input. */
+    size_t next_coro;
+    size_t next_offset;
+    size_t n_in_flight;
+    _Atomic size_t n_running;
+    _Atomic size_t n_waiting;
+    atomic_bool is_reaping;
+    /** aio: the coroutines whose reads are not known to be done. */
+    size_t *aio_waiters;
+    size_t n_aio_waiters;
+    const struct aiocb **aio_list;
+
+    /** Statistics. */
+    size_t n_reads;
+    size_t n_kernel_waits;
+} io;
+
+/**
+ * Runs sorted before the others, see MergeEarly(). A coroutine which
+ * has sorted its run while some are still busy merges it with a
+ * ready one instead of leaving everything to the final merge. The
+ * runs are taken in the order they are done, so the final merge gets
+ * fewer runs and no core idles while slow files are parsed.
+ */
+static struct
+{
+    pthread_mutex_t lock;
+    /** Coroutines with a sorted run nobody merges. */
+    size_t *ready;
+    size_t n_ready;
+    /** Coroutines which have not sorted their run yet. */
+    _Atomic size_t n_sorting;
+
+    /** Statistics. */
+    _Atomic size_t n_merges;
+    _Atomic size_t n_numbers;
+} early = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/** A piece of an input file, sorted in memory by one coroutine. */
+struct Chunk
+{
+    size_t file_idx;
+    off_t offset;
+    size_t size;
+};
+
+/**
+ * State of the external sort. Chunks are sorted by batches of
+ * coroutines, each batch is merged into a run spilled to a
+ * temporary file, then the runs are merged by groups of fan_in
+ * until they fit into one final merge.
+ */
+struct ExternalSort
+{
+    struct Chunk *chunks;
+    size_t n_chunks;
+    size_t chunk_bytes;
+    size_t batch_width;
+    /** The first chunk of the current batch. */
+    size_t batch_start;
+    /** Size of each of the two read-ahead blocks of a run. */
+    size_t block_bytes;
+    size_t fan_in;
+
+    /** Sorted runs, unlinked temporary files. */
+    int *run_fds;
+    size_t n_runs;
+
+    /** Statistics. */
+    size_t n_batches;
+    size_t n_passes;
+    size_t n_spilled_runs;
+    size_t spilled_bytes;
+};
+static struct ExternalSort ext;
 
 bool InitRuntime(int argc, char *argv[]);
-bool AllocateCoroutines(int argc);
-bool OpenFiles(char *argv[]);
+bool ParseOptions(int argc, char *argv[]);
+bool ParseSize(const char *str, size_t *size);
+bool AllocateCoroutines(size_t n_coros, size_t numbers_capacity);
+bool AllocateNumbers();
+size_t NumbersBound(const struct coro *c);
+void FreeNumbers(num_t *numbers, size_t capacity);
+bool OpenFiles(char *filenames[]);
+bool ParseFormat(const char *name, enum rfmt_format *format);
+bool DetectFormat(int fd, size_t file_idx);
 bool AsyncReadFiles();
+bool PlanExternalSort();
+bool PlanFileChunks(size_t file_idx, size_t *capacity);
+bool FindChunkEnd(int fd, off_t from, off_t to, off_t *end);
+bool OpenChunks();
+bool UringReadFiles();
+void RegisterBuffers();
+bool SubmitReads();
+void ReapReads(bool can_block);
+void PollInput(bool can_block);
+void PollAio(bool can_block);
+bool MapInput(struct coro *c, off_t offset, size_t size);
+void UnmapInput(struct coro *c);
 
-void CoroExec();
+bool SortFiles();
+bool SortChunks();
+void RunCoroutines();
+bool CheckCoroutines();
+
+void LoadInput();
 void ParseFile();
+enum nparse_status ParseChunk();
+bool GrowNumbers();
+long long GetTimeNs();
+void SampleCounters(uint64_t *counters);
+void OpenPerfEvents(struct PerfEvents *pe);
+void ClosePerfEvents(void *arg);
+void SortNumbers();
+void MergeEarly();
+bool MergeEarlyStart();
+bool MergeEarlyStep();
+void MergeEarlyFinish();
+coro_ticks_t CoroBusyTicks();
 void QuickSort();
+void IntroSort();
+#ifdef CORO_BACKEND_STACK
+void SortRange(num_t *numbers, size_t from, size_t to);
+void IntroSortRange(num_t *numbers, size_t from, size_t to, size_t depth_left);
+void HeapSortRange(num_t *numbers, size_t from, size_t to);
+size_t Partition(num_t *numbers, size_t from, size_t to, num_t target);
+#else
 void SortRange(/* size_t sort_from, size_t sort_to */);
+void IntroSortRange(/* size_t sort_from, size_t sort_to, size_t depth_left */);
+void HeapSortRange(/* size_t sort_from, size_t sort_to */);
+bool PartitionStep();
+#endif  // CORO_BACKEND_STACK
+void RadixSort();
+void CountSort();
+void CountStep();
+bool CountExpandStep();
 void AtomicSwap(num_t *x, num_t *y);
 
 bool MergeFiles();
-num_t GetMinimalNumber(size_t *coro_idx);
+bool SumHistograms();
+bool ExpandHistograms();
+bool WriteHistogram(const struct sort_hist *h);
+bool MergeParallel(size_t n_slices);
+void CoRank(size_t rank, size_t *split);
+size_t CountRanked(num_t value);
+size_t CountLess(const struct coro *c, num_t value);
+size_t CountNotGreater(const struct coro *c, num_t value);
+bool RunSlices(struct MergeSlice *slices, size_t n_slices, void *(*func)(void*));
+bool InitSliceTree(const struct MergeSlice *slice, struct ltree *tree);
+void *MeasureSlice(void *arg);
+void *WriteSlice(void *arg);
+bool SpillBatch();
+bool CreateRun(int *fd);
+bool MergeRuns();
+bool MergeRunGroup(size_t first, size_t n, int out_fd);
+bool RefillRun(void *ctx, size_t id, const num_t **cur, const num_t **end);
+bool WriteMerged(struct ltree *tree);
+bool OpenOutput();
+bool CloseOutput(size_t n_written);
+void PutAggregate(struct obuf *out, num_t value, size_t count);
 
 bool Free();
 
 void PrintStatistics(clock_t dif_sort, clock_t dif_merge);
+void PrintProfile();
+void PrintCounters(const uint64_t *counters);
+bool WriteStatsJson(const char *path);
+void WriteCountersJson(FILE *f, const uint64_t *counters);
 
 int main(int argc, char* argv[])
 {
     clock_t stamp1 = clock();
     if (!InitRuntime(argc, argv)) {
-        LOG_FATAL("failed to initialize runtime");
+        LOG_ERROR("failed to initialize runtime");
+        Free();
+        return 1;
     }
 
-    for (size_t i = 0; i < crt.coro_count; ++i) {
-        if (coro_init(i) != 0) {
-            break;
-        }
+    bool is_external = opts.memory_limit != 0;
+    if (!(is_external ? SortChunks() : SortFiles())) {
+        Free();
+        return 1;
     }
-    coro_this()->timestamp = clock();
-    coro_call(CoroExec);
-    coro_finish();
-    coro_wait_all();
 
     clock_t stamp2 = clock();
+    phases.merge_ns = GetTimeNs();
+    uint64_t merge_start[CORO_COUNTERS] = {0};
+    if (profile.is_enabled) {
+        SampleCounters(merge_start);
+    }
 
-    if (!MergeFiles()) {
+    if (!(is_external ? MergeRuns() : MergeFiles())) {
+        Free();
         return 1;
     }
 
+    phases.merge_ns = GetTimeNs() - phases.merge_ns;
+    if (profile.is_enabled) {
+        SampleCounters(profile.merge_counters);
+        for (size_t k = 0; k < CORO_COUNTERS; k++) {
+            profile.merge_counters[k] -= merge_start[k];
+        }
+    }
     clock_t stamp3 = clock();
 
     PrintStatistics(stamp2 - stamp1, stamp3 - stamp2);
+    if (opts.stats_json != NULL && !WriteStatsJson(opts.stats_json)) {
+        Free();
+        return 1;
+    }
 
     return Free() ? 0 : 1;
 }
 
 bool InitRuntime(int argc, char *argv[])
 {
-    if (!AllocateCoroutines(argc)) {
+    if (!ParseOptions(argc, argv)) {
+        return false;
+    }
+    coro_set_quantum(opts.quantum_us);
+    if (opts.use_perf || opts.stats_json != NULL) {
+        profile.is_enabled = true;
+        profile.has_perf_key = pthread_key_create(&profile.perf_key, ClosePerfEvents) == 0;
+        coro_phase_sampler = SampleCounters;
+    }
+    coro_poller = PollInput;
+    if (opts.input_mode == INPUT_URING) {
+        io.is_enabled = uring_create(&io.ring, URING_ENTRIES);
+        if (!io.is_enabled) {
+            io.is_unavailable = true;
+            opts.input_mode = INPUT_AIO;
+        }
+    }
+    if (opts.memory_limit != 0) {
+        return PlanExternalSort();
+    }
+    if (!AllocateCoroutines(opts.n_files, 0)) {
+        return false;
+    }
+    early.ready = (size_t*) calloc(crt.coro_count > 0 ? crt.coro_count : 1, sizeof(size_t));
+    if (early.ready == NULL) {
+        LOG_ERROR("calloc(%lu) failed", crt.coro_count);
         return false;
     }
-    if (!OpenFiles(argv)) {
+    if (!OpenFiles(opts.filenames)) {
+        return false;
+    }
+    if (!AllocateNumbers()) {
         return false;
     }
     if (!AsyncReadFiles()) {
@@ -117,35 +623,313 @@ bool InitRuntime(int argc, char *argv[])
     return true;
 }
 
-bool AllocateCoroutines(int argc)
+bool ParseOptions(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"out-buf-size", required_argument, NULL, 'b'},
+        {"quantum-us", required_argument, NULL, 'q'},
+        {"workers", required_argument, NULL, 'j'},
+        {"memory-limit", required_argument, NULL, 'm'},
+        {"tmp-dir", required_argument, NULL, 'T'},
+        {"input", required_argument, NULL, 'i'},
+        {"sort", required_argument, NULL, 's'},
+        {"perf", no_argument, NULL, 'P'},
+        {"stats-json", required_argument, NULL, 'J'},
+        {"in-format", required_argument, NULL, 'I'},
+        {"out-format", required_argument, NULL, 'O'},
+        {"out-buffers", required_argument, NULL, 'B'},
+        {"no-early-merge", no_argument, NULL, 'E'},
+        {"merge-threads", required_argument, NULL, 'M'},
+        {"huge-pages", no_argument, NULL, 'H'},
+        {"no-narrow", no_argument, NULL, 'N'},
+        {"aggregate", no_argument, NULL, 'A'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:q:j:m:T:i:s:PJ:I:O:B:EM:HNA", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                if (!ParseSize(optarg, &opts.out_buf_size) || opts.out_buf_size == 0) {
+                    LOG_ERROR("invalid output buffer size: \"%s\"", optarg);
+                    return false;
+                }
+                break;
+            case 'B':
+                if (!ParseSize(optarg, &opts.out_buffers) || opts.out_buffers == 0 ||
+                    opts.out_buffers > OBUF_BUFFERS_MAX) {
+                    LOG_ERROR("invalid number of output buffers: \"%s\", expected 1 to %d", optarg,
+                              OBUF_BUFFERS_MAX);
+                    return false;
+                }
+                break;
+            case 'E':
+                opts.use_early_merge = false;
+                break;
+            case 'H':
+                opts.use_huge_pages = true;
+                break;
+            case 'N':
+                opts.use_narrow_keys = false;
+                break;
+            case 'A':
+                opts.use_aggregate = true;
+                break;
+            case 'M':
+                if (!ParseSize(optarg, &opts.merge_threads) || opts.merge_threads == 0) {
+                    LOG_ERROR("invalid number of merge threads: \"%s\"", optarg);
+                    return false;
+                }
+                break;
+            case 'q':
+                if (!ParseSize(optarg, &opts.quantum_us)) {
+                    LOG_ERROR("invalid scheduling quantum: \"%s\"", optarg);
+                    return false;
+                }
+                break;
+            case 'j':
+                if (!ParseSize(optarg, &opts.n_workers) || opts.n_workers == 0) {
+                    LOG_ERROR("invalid number of workers: \"%s\"", optarg);
+                    return false;
+                }
+#ifndef CORO_BACKEND_STACK
+                if (opts.n_workers > 1) {
+                    LOG_ERROR("worker threads need the stackful backend (CORO_BACKEND=stack)");
+                    return false;
+                }
+#endif  // CORO_BACKEND_STACK
+                break;
+            case 'm':
+                if (!ParseSize(optarg, &opts.memory_limit) || opts.memory_limit == 0) {
+                    LOG_ERROR("invalid memory limit: \"%s\"", optarg);
+                    return false;
+                }
+                break;
+            case 'T':
+                opts.tmp_dir = optarg;
+                break;
+            case 'i':
+                if (strcmp(optarg, "aio") == 0) {
+                    opts.input_mode = INPUT_AIO;
+                } else if (strcmp(optarg, "mmap") == 0) {
+                    opts.input_mode = INPUT_MMAP;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    opts.input_mode = INPUT_URING;
+                } else {
+                    LOG_ERROR("unknown input mode: \"%s\", expected uring, aio or mmap", optarg);
+                    return false;
+                }
+                break;
+            case 's':
+                if (strcmp(optarg, "auto") == 0) {
+                    opts.sort_engine = ENGINE_AUTO;
+                } else if (strcmp(optarg, "quick") == 0) {
+                    opts.sort_engine = ENGINE_QUICK;
+                } else if (strcmp(optarg, "intro") == 0) {
+                    opts.sort_engine = ENGINE_INTRO;
+                } else if (strcmp(optarg, "radix") == 0) {
+                    opts.sort_engine = ENGINE_RADIX;
+                } else if (strcmp(optarg, "count") == 0) {
+                    opts.sort_engine = ENGINE_COUNT;
+                } else {
+                    LOG_ERROR("unknown sort engine: \"%s\", expected auto, quick, intro, radix or count",
+                              optarg);
+                    return false;
+                }
+                break;
+            case 'P':
+                opts.use_perf = true;
+                break;
+            case 'J':
+                opts.stats_json = optarg;
+                break;
+            case 'I':
+                opts.is_in_format_forced = strcmp(optarg, "auto") != 0;
+                if (opts.is_in_format_forced && !ParseFormat(optarg, &opts.in_format)) {
+                    LOG_ERROR("unknown input format: \"%s\", expected auto, text, raw or delta",
+                              optarg);
+                    return false;
+                }
+                break;
+            case 'O':
+                if (!ParseFormat(optarg, &opts.out_format)) {
+                    LOG_ERROR("unknown output format: \"%s\", expected text, raw or delta", optarg);
+                    return false;
+                }
+                break;
+            default:
+                dprintf(STDERR_FILENO, "usage: %s [-b|--out-buf-size BYTES[K|M|G]] "
+                        "[-B|--out-buffers N] [-q|--quantum-us USEC] [-j|--workers N] [-i|--input uring|aio|mmap] "
+                        "[-s|--sort auto|quick|intro|radix|count] "
+                        "[-m|--memory-limit BYTES[K|M|G] [-T|--tmp-dir DIR]] "
+                        "[-P|--perf] [-J|--stats-json FILE] [-I|--in-format auto|text|raw|delta] "
+                        "[-O|--out-format text|raw|delta] [-E|--no-early-merge] "
+                        "[-M|--merge-threads N] [-H|--huge-pages] [-N|--no-narrow] [-A|--aggregate] FILE...\n",
+                        argv[0]);
+                return false;
+        }
+    }
+    if (opts.use_aggregate && opts.out_format != RFMT_TEXT) {
+        LOG_ERROR("aggregated output is only written as text");
+        return false;
+    }
+    if (opts.merge_threads == 0) {
+        opts.merge_threads = opts.n_workers;
+    }
+    if (opts.tmp_dir == NULL) {
+        opts.tmp_dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    }
+    opts.filenames = argv + optind;
+    opts.n_files = (size_t) (argc - optind);
+    input_files = (struct InputFile*) calloc(opts.n_files > 0 ? opts.n_files : 1,
+                                             sizeof(struct InputFile));
+    if (input_files == NULL) {
+        LOG_ERROR("calloc(%lu) failed", opts.n_files);
+        return false;
+    }
+    return true;
+}
+
+bool ParseSize(const char *str, size_t *size)
+{
+    // strtoull() takes "-1" for ULLONG_MAX, a size has no sign:
+    while (isspace((unsigned char) *str)) {
+        str++;
+    }
+    if (*str == '-') {
+        return false;
+    }
+    char *end = NULL;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (errno != 0 || end == str) {
+        errno = 0;
+        return false;
+    }
+    int n_shifts = 0;
+    switch (*end) {
+        case 'G': case 'g':
+            n_shifts++;
+            // fall through
+        case 'M': case 'm':
+            n_shifts++;
+            // fall through
+        case 'K': case 'k':
+            n_shifts++;
+            end++;
+            break;
+        default:
+            break;
+    }
+    if (*end != '\0' || value > SIZE_MAX) {
+        return false;
+    }
+    for (; n_shifts > 0; n_shifts--) {
+        // A value which does not fit is rejected, not wrapped:
+        if (value > SIZE_MAX >> 10) {
+            return false;
+        }
+        value <<= 10;
+    }
+    *size = (size_t) value;
+    return true;
+}
+
+bool AllocateCoroutines(size_t n_coros, size_t numbers_capacity)
 {
-    if (argc <= 1) {
+    if (n_coros == 0) {
         LOG_ERROR("no input files provided");
         return false;
     }
-    crt.coro_count = argc - 1;
+    crt.coro_count = n_coros;
+#ifdef CORO_BACKEND_STACK
+    crt.n_workers = opts.n_workers;
+#endif  // CORO_BACKEND_STACK
     crt.coros = (struct coro*) calloc(crt.coro_count, sizeof(struct coro));
     if (crt.coros == NULL) {
         LOG_ERROR("calloc(%lu) failed", crt.coro_count);
         return false;
     }
     for (size_t i = 0; i < crt.coro_count; i++) {
-        crt.coros[i].numbers = (num_t*) calloc((size_t) NUMBERS_PER_FILE_DEFAULT, sizeof(num_t));
+        crt.coros[i].aio_control.aio_fildes = -1;
+    }
+    for (size_t i = 0; i < crt.coro_count && numbers_capacity > 0; i++) {
+        crt.coros[i].numbers = (num_t*) calloc(numbers_capacity, sizeof(num_t));
         if (crt.coros[i].numbers == NULL) {
-            LOG_ERROR("calloc(%lu) failed", (size_t) NUMBERS_PER_FILE_DEFAULT);
+            LOG_ERROR("calloc(%lu) failed", numbers_capacity);
             return false;
         }
-        crt.coros[i].numbers_capacity = (size_t) NUMBERS_PER_FILE_DEFAULT;
+        crt.coros[i].numbers_capacity = numbers_capacity;
         crt.coros[i].numbers_size = 0;
     }
+    profile.coros = (struct coro_phases*) calloc(n_coros, sizeof(struct coro_phases));
+    if (profile.coros == NULL) {
+        LOG_ERROR("calloc(%lu) failed", n_coros);
+        return false;
+    }
+    profile.n_coros = n_coros;
+    return true;
+}
+
+/**
+ * Give each opened file room for as many numbers as it may hold, so
+ * the arrays never grow while parsing. They are cut from one arena:
+ * the bounds are loose, but only the pages the numbers take are
+ * backed by memory. Without the arena the arrays start small and
+ * grow.
+ */
+bool AllocateNumbers()
+{
+    size_t total = 0;
+    for (size_t i = 0; i < crt.coro_count; i++) {
+        total += NumbersBound(&crt.coros[i]) * sizeof(num_t) + ARENA_ALIGN;
+    }
+    bool has_arena = arena_create(&memory.arena, total, opts.use_huge_pages);
+    if (!has_arena) {
+        LOG_DEBUG("unable to reserve %lu bytes for the numbers", total);
+    }
+    for (size_t i = 0; i < crt.coro_count; i++) {
+        struct coro *c = &crt.coros[i];
+        c->numbers_capacity = has_arena ? NumbersBound(c) : NUMBERS_PER_FILE_DEFAULT;
+        c->numbers = has_arena ? (num_t*) arena_alloc(&memory.arena, c->numbers_capacity * sizeof(num_t))
+                               : (num_t*) calloc(c->numbers_capacity, sizeof(num_t));
+        if (c->numbers == NULL) {
+            LOG_ERROR("unable to allocate %lu numbers", c->numbers_capacity);
+            return false;
+        }
+    }
     return true;
 }
 
-bool OpenFiles(char *argv[])
+/**
+ * The most numbers the input of @a c may hold: a text number takes
+ * at least a digit and a separator, a varint at least a byte.
+ */
+size_t NumbersBound(const struct coro *c)
+{
+    size_t size = c->aio_control.aio_nbytes - c->header_size;
+    if (c->format == RFMT_RAW) {
+        return size / sizeof(num_t) + 1;
+    }
+    if (c->format == RFMT_DELTA) {
+        return size + 1;
+    }
+    return (size + 1) / 2 + 1;
+}
+
+/** Free numbers which may be in the arena. */
+void FreeNumbers(num_t *numbers, size_t capacity)
+{
+    if (arena_owns(&memory.arena, numbers)) {
+        arena_release(numbers, capacity * sizeof(num_t));
+    } else {
+        free(numbers);
+    }
+}
+
+bool OpenFiles(char *filenames[])
 {
     crt.total_n_numbers = 0;
     ASSERT(crt.coros != NULL);
-    char** filenames = argv + 1;
 
     for (size_t i = 0; i < crt.coro_count; i++) {
         memset(&crt.coros[i].aio_control, 0, sizeof(struct aiocb));
@@ -166,6 +950,19 @@ bool OpenFiles(char *argv[])
         crt.coros[i].aio_control.aio_nbytes = (size_t) eof_pos;
         ASSERT(old_pos != (off_t) -1);
         lseek(crt.coros[i].aio_control.aio_fildes, old_pos, SEEK_SET);
+        if (!DetectFormat(crt.coros[i].aio_control.aio_fildes, i)) {
+            return false;
+        }
+        crt.coros[i].format = input_files[i].format;
+        crt.coros[i].header_size = input_files[i].header_size;
+
+        if (opts.input_mode == INPUT_MMAP) {
+            if (!MapInput(&crt.coros[i], 0, (size_t) eof_pos)) {
+                LOG_ERROR("Unable to map a file: \"%s\"", filenames[i]);
+                return false;
+            }
+            continue;
+        }
 
         // Allocate (size + 1) bytes because of EOF ('\0'):
         crt.coros[i].aio_control.aio_buf = (char*) calloc(crt.coros[i].aio_control.aio_nbytes + 1,
@@ -179,165 +976,1354 @@ bool OpenFiles(char *argv[])
     return true;
 }
 
+static const char *const format_names[] = {"text", "raw", "delta"};
+
+bool ParseFormat(const char *name, enum rfmt_format *format)
+{
+    for (size_t i = 0; i < sizeof(format_names) / sizeof(format_names[0]); i++) {
+        if (strcmp(name, format_names[i]) == 0) {
+            *format = (enum rfmt_format) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Learn the format of an opened input file from its header. A
+ * forced format is taken as is, but a header of another format is
+ * an error rather than garbage to sort.
+ */
+bool DetectFormat(int fd, size_t file_idx)
+{
+    char header[RFMT_HEADER_SIZE];
+    ssize_t n = pread(fd, header, sizeof(header), 0);
+    if (n < 0) {
+        LOG_ERROR("Unable to read a file: \"%s\"", opts.filenames[file_idx]);
+        return false;
+    }
+    struct InputFile *file = &input_files[file_idx];
+    file->format = rfmt_detect(header, (size_t) n, &file->header_size);
+    if (file->header_size == 0 && n == sizeof(header) && memcmp(header, rfmt_magic, sizeof(rfmt_magic)) == 0) {
+        LOG_ERROR("file \"%s\" is binary, but not of %s keys or of another version",
+                  opts.filenames[file_idx], num_kind_names[NUM_KIND]);
+        return false;
+    }
+    if (!opts.is_in_format_forced) {
+        return true;
+    }
+    if (file->header_size != 0 && file->format != opts.in_format) {
+        LOG_ERROR("file \"%s\" is %s, not %s", opts.filenames[file_idx],
+                  format_names[file->format], format_names[opts.in_format]);
+        return false;
+    }
+    file->format = opts.in_format;
+    return true;
+}
+
 bool AsyncReadFiles()
 {
     ASSERT(crt.coros != NULL);
+    if (opts.input_mode == INPUT_MMAP) {
+        return true;
+    }
+    input.read_submit_ns = GetTimeNs();
+    if (opts.input_mode == INPUT_URING) {
+        return UringReadFiles();
+    }
+    if (io.aio_waiters == NULL) {
+        // The first batch is the widest one:
+        io.aio_waiters = (size_t*) calloc(crt.coro_count, sizeof(size_t));
+        io.aio_list = (const struct aiocb**) calloc(crt.coro_count, sizeof(struct aiocb*));
+        if (io.aio_waiters == NULL || io.aio_list == NULL) {
+            LOG_ERROR("calloc(%lu) failed", crt.coro_count);
+            return false;
+        }
+    }
     for (size_t i = 0; i < crt.coro_count; i++) {
         aio_read(&crt.coros[i].aio_control);
+        io.aio_waiters[i] = i;
     }
+    io.n_aio_waiters = crt.coro_count;
     return true;
 }
 
-void CoroExec()
+bool PlanExternalSort()
 {
-    while (aio_error(&coro_this()->aio_control) == EINPROGRESS) {
-        LOG_DEBUG("read-request[%lu] is in progress", crt.curr_coro_i);
-        coro_yield();
+    if (opts.n_files == 0) {
+        LOG_ERROR("no input files provided");
+        return false;
     }
-    if (close(coro_this()->aio_control.aio_fildes) != 0) {
-        LOG_ERROR("Unable to close file[%lu]", crt.curr_coro_i);
-        coro_this()->no_errors_occurred = false;
-        coro_return();
+    // The output buffers are taken out of the budget, everything else
+    // is shared by the chunks of one batch:
+    size_t out_buf_max = opts.memory_limit / (8 * opts.out_buffers);
+    if (opts.out_buf_size > out_buf_max) {
+        opts.out_buf_size = out_buf_max > OBUF_NUM_MAX_LEN ? out_buf_max : OBUF_NUM_MAX_LEN;
     }
-    coro_this()->aio_control.aio_fildes = -1;
-    if (aio_return(&coro_this()->aio_control) != (ssize_t) coro_this()->aio_control.aio_nbytes) {
-        LOG_ERROR("unable to read file[%lu]", crt.curr_coro_i);
-        coro_this()->no_errors_occurred = false;
-        coro_return();
+    size_t out_bytes = opts.out_buffers * opts.out_buf_size;
+    size_t budget = opts.memory_limit > out_bytes ? opts.memory_limit - out_bytes : 0;
+    // Chunk buffers are allocated once for all the batches, they are
+    // not swapped for merged ones:
+    opts.use_early_merge = false;
+    ext.batch_width = opts.n_workers > 1 ? opts.n_workers : 2;
+    size_t bytes_per_chunk_byte = opts.sort_engine == ENGINE_RADIX ? EXTERNAL_RADIX_BYTES_PER_CHUNK_BYTE
+                                                                   : EXTERNAL_BYTES_PER_CHUNK_BYTE;
+    ext.chunk_bytes = budget / (ext.batch_width * bytes_per_chunk_byte);
+    if (ext.chunk_bytes < EXTERNAL_CHUNK_MIN) {
+        LOG_ERROR("memory limit %lu is too small", opts.memory_limit);
+        return false;
     }
-    LOG_DEBUG("AIO-read a file[%lu]", crt.curr_coro_i);
-
-    coro_call(ParseFile);
-    coro_yield();
-
-    if (coro_this()->no_errors_occurred) {
-        coro_call(QuickSort);
-    } else {
-        LOG_ERROR("Unable to parse file (idx = %lu)", crt.curr_coro_i);
+    ext.block_bytes = budget / (2 * EXTERNAL_FAN_IN);
+    if (ext.block_bytes < EXTERNAL_BLOCK_MIN) {
+        ext.block_bytes = EXTERNAL_BLOCK_MIN;
+    } else if (ext.block_bytes > EXTERNAL_BLOCK_MAX) {
+        ext.block_bytes = EXTERNAL_BLOCK_MAX;
+    }
+    ext.fan_in = budget / (2 * ext.block_bytes);
+    if (ext.fan_in < 2) {
+        ext.fan_in = 2;
     }
-    coro_yield();
 
-#ifndef NDEBUG
-    LOG_DEBUG_EXTRA("Sorted file (%lu):", crt.curr_coro_i);
-    for (size_t i = 0; i < coro_this()->numbers_size; i++) {
-        LOG_DEBUG_EXTRA("%ld ", coro_this()->numbers[i]);
+    size_t capacity = 0;
+    for (size_t i = 0; i < opts.n_files; i++) {
+        if (!PlanFileChunks(i, &capacity)) {
+            return false;
+        }
+    }
+    if (ext.batch_width > ext.n_chunks) {
+        ext.batch_width = ext.n_chunks > 0 ? ext.n_chunks : 1;
+    }
+    size_t max_runs = (ext.n_chunks + ext.batch_width - 1) / ext.batch_width;
+    ext.run_fds = (int*) calloc(max_runs > 0 ? max_runs : 1, sizeof(int));
+    if (ext.run_fds == NULL) {
+        LOG_ERROR("calloc(%lu) failed", max_runs);
+        return false;
     }
-#endif  // NDEBUG
 
-    coro_yield();
-    coro_return();
+    // A chunk of T bytes has at most (T + 1) / 2 numbers, so the
+    // buffers are allocated once and never grow:
+    if (!AllocateCoroutines(ext.batch_width, (ext.chunk_bytes + 1) / 2 + 1)) {
+        return false;
+    }
+    for (size_t i = 0; i < crt.coro_count && opts.input_mode != INPUT_MMAP; i++) {
+        crt.coros[i].aio_control.aio_buf = (char*) malloc(ext.chunk_bytes + 1);
+        if (crt.coros[i].aio_control.aio_buf == NULL) {
+            LOG_ERROR("malloc(%lu) failed", ext.chunk_bytes + 1);
+            return false;
+        }
+    }
+    LOG_DEBUG("External sort: %lu chunks of %lu bytes, %lu per batch", ext.n_chunks,
+              ext.chunk_bytes, ext.batch_width);
+    return true;
 }
 
-void ParseFile()
+bool PlanFileChunks(size_t file_idx, size_t *capacity)
 {
-    coro_this()->end_ptr = NULL;                                                                    coro_yield();
-    coro_this()->start_ptr = (char*) coro_this()->aio_control.aio_buf;                              coro_yield();
-    coro_this()->numbers_size = 0;                                                                  coro_yield();
-    while (*coro_this()->start_ptr != '\0') {
-        if (coro_this()->numbers_size >= coro_this()->numbers_capacity) {
-            LOG_DEBUG("reallocating from %lu to %lu", coro_this()->numbers_capacity,
-                                                      (coro_this()->numbers_capacity + 1) * 2);
-            coro_this()->numbers_capacity = (coro_this()->numbers_capacity + 1) * 2;                coro_yield();
-            coro_this()->numbers = reallocarray(coro_this()->numbers, coro_this()->numbers_capacity,
-                                                sizeof(num_t));                                     coro_yield();
-            if (coro_this()->numbers == NULL) {
-                LOG_ERROR("realloc(%lu) failed", coro_this()->numbers_capacity * sizeof(num_t));    coro_yield();
-                coro_this()->no_errors_occurred = false;                                            coro_yield();
-                coro_return();
-            }
-        }
-        ASSERT(errno == 0);
-        coro_this()->numbers[coro_this()->numbers_size] = strtol(coro_this()->start_ptr,
-                                                                 &coro_this()->end_ptr, 0);         coro_yield();
-        coro_this()->numbers_size++;                                                                coro_yield();
-        if (errno != 0) {
-            LOG_ERROR("strtoll() failed");                                                          coro_yield();
-            coro_this()->no_errors_occurred = false;                                                coro_yield();
-            coro_return();
+    const char *filename = opts.filenames[file_idx];
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        LOG_ERROR("Unable to open a file: \"%s\"", filename);
+        return false;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size == (off_t) -1) {
+        LOG_ERROR("Can't get file size");
+        close(fd);
+        return false;
+    }
+    if (!DetectFormat(fd, file_idx)) {
+        close(fd);
+        return false;
+    }
+    const struct InputFile *file = &input_files[file_idx];
+    if (file->format == RFMT_DELTA) {
+        // Each value depends on all the previous ones:
+        LOG_ERROR("delta file \"%s\" can not be split into chunks, use text or raw", filename);
+        close(fd);
+        return false;
+    }
+    off_t offset = 0;
+    while (offset < size) {
+        off_t end = size;
+        if (size - offset <= (off_t) ext.chunk_bytes) {
+            // The rest fits into one chunk.
+        } else if (file->format == RFMT_RAW) {
+            end = offset + (off_t) ext.chunk_bytes;
+            end -= (end - (off_t) file->header_size) % (off_t) sizeof(num_t);
+        } else if (!FindChunkEnd(fd, offset, offset + (off_t) ext.chunk_bytes, &end)) {
+            LOG_ERROR("no separator in \"%s\" within %lu bytes after offset %ld", filename,
+                      ext.chunk_bytes, (long) offset);
+            close(fd);
+            return false;
         }
-        if (coro_this()->start_ptr == coro_this()->end_ptr) {
-            while (isspace(*coro_this()->start_ptr)) {                                              coro_yield();
-                coro_this()->start_ptr++;
-            }
-            if (*coro_this()->start_ptr == '\0') {                                                  coro_yield();
-                break;
+        if (ext.n_chunks == *capacity) {
+            size_t new_capacity = (*capacity + 1) * 2;
+            struct Chunk *chunks = reallocarray(ext.chunks, new_capacity, sizeof(struct Chunk));
+            if (chunks == NULL) {
+                LOG_ERROR("realloc(%lu) failed", new_capacity * sizeof(struct Chunk));
+                close(fd);
+                return false;
             }
-            LOG_ERROR("Unknown symbol: '%c'", *coro_this()->start_ptr);                             coro_yield();
-            coro_this()->no_errors_occurred = false;                                                coro_yield();
-            coro_return();
+            ext.chunks = chunks;
+            *capacity = new_capacity;
         }
-        coro_this()->start_ptr = coro_this()->end_ptr;                                              coro_yield();
+        ext.chunks[ext.n_chunks].file_idx = file_idx;
+        ext.chunks[ext.n_chunks].offset = offset;
+        ext.chunks[ext.n_chunks].size = (size_t) (end - offset);
+        ext.n_chunks++;
+        offset = end;
     }
-    crt.total_n_numbers += coro_this()->numbers_size;                                               coro_yield();
-    LOG_DEBUG("Parsed file (idx = %lu, n_numbers = %lu)", crt.curr_coro_i,
-              coro_this()->numbers_size);                                                           coro_yield();
-    coro_this()->no_errors_occurred = (*coro_this()->start_ptr == '\0') ? true : false;             coro_yield();
-    coro_return();
+    close(fd);
+    return true;
 }
 
-void QuickSort()
+/**
+ * Find the last separator in (from, to], so that a chunk [from,
+ * *end) does not cut a number and is not longer than to - from.
+ */
+bool FindChunkEnd(int fd, off_t from, off_t to, off_t *end)
 {
-    if (coro_this()->numbers_size > 1) {
-        coro_call(SortRange, 0, coro_this()->numbers_size - 1);
+    char window[EXTERNAL_BOUNDARY_WINDOW];
+    off_t upper = to + 1;
+    while (upper > from + 1) {
+        off_t lower = upper - EXTERNAL_BOUNDARY_WINDOW;
+        if (lower < from + 1) {
+            lower = from + 1;
+        }
+        ssize_t n = pread(fd, window, (size_t) (upper - lower), lower);
+        if (n != upper - lower) {
+            return false;
+        }
+        for (ssize_t i = n - 1; i >= 0; i--) {
+            if (nparse_is_space(window[i])) {
+                *end = lower + i;
+                return true;
+            }
+        }
+        upper = lower;
     }
-    coro_return();
+    return false;
 }
 
-void SortRange(/* size_t sort_from, size_t sort_to */)
+/** Start reading the chunks of the current batch. */
+bool OpenChunks()
 {
-#define SFRAME coro_this()->stack[coro_this()->stack_pointer].uframe
-    LOG_DEBUG_EXTRA("SortRange %lu:%lu", SFRAME.sort_from, SFRAME.sort_to);
-    ASSERT(SFRAME.sort_from < SFRAME.sort_to);
-    coro_this()->lower_idx = SFRAME.sort_from;                                              
-    coro_this()->upper_idx = SFRAME.sort_to;                                              
-    coro_this()->target = coro_this()->numbers[(SFRAME.sort_from + SFRAME.sort_to) / 2];  
-#define TARGET coro_this()->target
-#define LOWER coro_this()->numbers[coro_this()->lower_idx]
-#define UPPER coro_this()->numbers[coro_this()->upper_idx]
-    while (true) {
-        while (LOWER < TARGET) {
-            LOG_DEBUG_EXTRA("inc\t%ld[%lu]\t<=\t%ld", LOWER, coro_this()->lower_idx, TARGET);
-            coro_this()->lower_idx++;                                                               coro_yield();
-        }
-        while (UPPER > TARGET) {;
-            LOG_DEBUG_EXTRA("dec\t%ld[%lu]\t>=\t%ld", UPPER, coro_this()->upper_idx, TARGET);
-            coro_this()->upper_idx--;                                                               coro_yield();
+    for (size_t i = 0; i < crt.coro_count; i++) {
+        const struct Chunk *chunk = &ext.chunks[ext.batch_start + i];
+        struct aiocb *aio = &crt.coros[i].aio_control;
+        volatile void *buf = aio->aio_buf;
+        memset(aio, 0, sizeof(*aio));
+        aio->aio_buf = buf;
+        aio->aio_fildes = open(opts.filenames[chunk->file_idx], O_RDONLY);
+        if (aio->aio_fildes == -1) {
+            LOG_ERROR("Unable to open a file: \"%s\"", opts.filenames[chunk->file_idx]);
+            return false;
         }
-        if (coro_this()->lower_idx >= coro_this()->upper_idx) {
-            LOG_DEBUG_EXTRA("breaking");
-            break;
+        aio->aio_offset = chunk->offset;
+        aio->aio_nbytes = chunk->size;
+        crt.coros[i].numbers_size = 0;
+        crt.coros[i].format = input_files[chunk->file_idx].format;
+        crt.coros[i].header_size = chunk->offset == 0 ? input_files[chunk->file_idx].header_size : 0;
+        if (opts.input_mode == INPUT_MMAP && !MapInput(&crt.coros[i], chunk->offset, chunk->size)) {
+            LOG_ERROR("Unable to map a file: \"%s\"", opts.filenames[chunk->file_idx]);
+            return false;
         }
-        LOG_DEBUG_EXTRA("before swap:\n%ld[%lu]\t%ld[]\t%ld[%lu]\n",
-                        LOWER, coro_this()->lower_idx, TARGET, UPPER, coro_this()->upper_idx);
-        coro_yield();
-        AtomicSwap(&LOWER, &UPPER);
-        coro_yield();
-        coro_this()->lower_idx++;
-        coro_this()->upper_idx--;
-    }
-    coro_yield();
-#undef TARGET
-#undef LOWER
-#undef UPPER
-
-    // Save on coro's stack because it may be overwritten after recursive call:
-    SFRAME.sep_idx = coro_this()->upper_idx;                                                coro_yield();
-    LOG_DEBUG_EXTRA("Separate idx = %lu", SFRAME.sep_idx);
-    // Sort lower part:
-    if (SFRAME.sep_idx > SFRAME.sort_from) {
-        LOG_DEBUG_EXTRA("sort lower %lu:%lu", SFRAME.sort_from, SFRAME.sep_idx);
-        coro_call(SortRange, SFRAME.sort_from, SFRAME.sep_idx);                             coro_yield();
-    }
-    
-    // Sort upper part:
-    if (SFRAME.sort_to > (SFRAME.sep_idx + 1)) {
-        LOG_DEBUG_EXTRA("sort upper %lu:%lu", (SFRAME.sep_idx + 1), SFRAME.sort_to);
-        coro_call(SortRange, (SFRAME.sep_idx + 1), SFRAME.sort_to);                         coro_yield();
     }
-    coro_return();
+    return true;
 }
 
-void AtomicSwap(num_t *x, num_t *y)
+/**
+ * Queue the reads of all the inputs in pieces of URING_READ_CHUNK.
+ * They are submitted as the completion queue has room for them.
+ */
+bool UringReadFiles()
+{
+    if (!io.is_registration_done) {
+        RegisterBuffers();
+    }
+    for (size_t i = 0; i < crt.coro_count; i++) {
+        struct coro *c = &crt.coros[i];
+        c->reads_pending = (c->aio_control.aio_nbytes + URING_READ_CHUNK - 1) / URING_READ_CHUNK;
+        c->read_failed = false;
+    }
+    io.next_coro = 0;
+    io.next_offset = 0;
+    if (!SubmitReads()) {
+        LOG_ERROR("unable to submit reads to io_uring");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Register the read buffers once, the external sort reuses them
+ * for every batch. Reads into registered buffers skip pinning the
+ * pages per request. Registration may fail on a low memlock limit,
+ * then plain reads are used.
+ */
+void RegisterBuffers()
+{
+    io.is_registration_done = true;
+    struct iovec *iov = (struct iovec*) calloc(crt.coro_count, sizeof(struct iovec));
+    if (iov == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < crt.coro_count; i++) {
+        iov[i].iov_base = (void*) crt.coros[i].aio_control.aio_buf;
+        iov[i].iov_len = (opts.memory_limit != 0 ? ext.chunk_bytes : crt.coros[i].aio_control.aio_nbytes) + 1;
+    }
+    io.has_fixed_buffers = uring_register_buffers(&io.ring, iov, (unsigned) crt.coro_count);
+    free(iov);
+}
+
+/**
+ * Queue as many of the remaining reads as the completion queue can
+ * take. A read carries its coroutine and its size in user_data.
+ */
+bool SubmitReads()
+{
+    while (io.next_coro < crt.coro_count && io.n_in_flight < io.ring.cq_entries) {
+        struct coro *c = &crt.coros[io.next_coro];
+        size_t size = c->aio_control.aio_nbytes;
+        if (io.next_offset >= size) {
+            io.next_coro++;
+            io.next_offset = 0;
+            continue;
+        }
+        size_t len = size - io.next_offset < URING_READ_CHUNK ? size - io.next_offset : URING_READ_CHUNK;
+        if (!uring_prep_read(&io.ring, c->aio_control.aio_fildes, (char*) c->aio_control.aio_buf + io.next_offset,
+                             (unsigned) len, (uint64_t) (c->aio_control.aio_offset + (off_t) io.next_offset),
+                             io.has_fixed_buffers ? (int) io.next_coro : -1,
+                             (uint64_t) io.next_coro | ((uint64_t) len << 32))) {
+            // The submission queue is full:
+            if (!uring_submit(&io.ring, 0)) {
+                return false;
+            }
+            continue;
+        }
+        io.next_offset += len;
+        io.n_in_flight++;
+        io.n_reads++;
+    }
+    return io.ring.n_to_submit == 0 || uring_submit(&io.ring, 0);
+}
+
+/**
+ * Drain the completion queue, mark the finished reads in their
+ * coroutines, wake those with all their reads done and queue the
+ * next reads. With @a can_block, sleep in the kernel until a read
+ * completes instead of returning empty-handed. Only one thread reaps
+ * at a time, the others just go on.
+ */
+void ReapReads(bool can_block)
+{
+    if (atomic_exchange(&io.is_reaping, true)) {
+        return;
+    }
+    size_t n_reaped = 0;
+    struct io_uring_cqe cqe;
+    while (true) {
+        while (uring_peek(&io.ring, &cqe)) {
+            size_t idx = cqe.user_data & UINT32_MAX;
+            struct coro *c = &crt.coros[idx];
+            if (cqe.res != (int) (cqe.user_data >> 32)) {
+                c->read_failed = true;
+            }
+            io.n_in_flight--;
+            n_reaped++;
+            // Goes last, so the owner sees read_failed after it:
+            if (atomic_fetch_sub(&c->reads_pending, 1) == 1) {
+                coro_wake(idx);
+            }
+        }
+        if (n_reaped > 0 || io.n_in_flight == 0 || !can_block) {
+            break;
+        }
+        io.n_kernel_waits++;
+        if (!uring_submit(&io.ring, 1)) {
+            break;
+        }
+    }
+    SubmitReads();
+    atomic_store(&io.is_reaping, false);
+}
+
+/**
+ * coro_poller: wake the coroutines parked in LoadInput() whose input
+ * has been read.
+ */
+void PollInput(bool can_block)
+{
+    if (opts.input_mode == INPUT_URING) {
+        ReapReads(can_block);
+    } else if (opts.input_mode == INPUT_AIO) {
+        PollAio(can_block);
+    }
+}
+
+/**
+ * Wake the coroutines with a finished aio read and forget them.
+ * With @a can_block, sleep in aio_suspend() until one finishes.
+ */
+void PollAio(bool can_block)
+{
+    while (io.n_aio_waiters > 0) {
+        size_t n_left = 0;
+        for (size_t i = 0; i < io.n_aio_waiters; i++) {
+            size_t idx = io.aio_waiters[i];
+            if (aio_error(&crt.coros[idx].aio_control) == EINPROGRESS) {
+                io.aio_list[n_left] = &crt.coros[idx].aio_control;
+                io.aio_waiters[n_left++] = idx;
+            } else {
+                coro_wake(idx);
+            }
+        }
+        bool has_woken = n_left < io.n_aio_waiters;
+        io.n_aio_waiters = n_left;
+        if (has_woken || !can_block || n_left == 0) {
+            return;
+        }
+        io.n_kernel_waits++;
+        // EINTR and EAGAIN just scan again:
+        aio_suspend(io.aio_list, (int) n_left, NULL);
+    }
+}
+
+/**
+ * Map [offset, offset + size) of the opened file of @a c and make
+ * it the input instead of a read buffer. The file is closed, the
+ * mapping keeps it. There is no terminating '\0' after the data,
+ * the parser is bounded by aio_nbytes.
+ */
+bool MapInput(struct coro *c, off_t offset, size_t size)
+{
+    static char empty_input[1];
+    long long start = GetTimeNs();
+    struct aiocb *aio = &c->aio_control;
+    aio->aio_buf = empty_input;
+    aio->aio_nbytes = size;
+    if (size > 0) {
+        // The offset of a mapping must be page aligned:
+        off_t page = (off_t) sysconf(_SC_PAGESIZE);
+        off_t delta = offset % page;
+        c->map_size = size + (size_t) delta;
+        c->map_base = (char*) mmap(NULL, c->map_size, PROT_READ, MAP_PRIVATE, aio->aio_fildes,
+                                   offset - delta);
+        if (c->map_base == MAP_FAILED) {
+            c->map_base = NULL;
+            c->map_size = 0;
+            return false;
+        }
+        madvise(c->map_base, c->map_size, MADV_SEQUENTIAL);
+        aio->aio_buf = c->map_base + delta;
+    }
+    int rc = close(aio->aio_fildes);
+    aio->aio_fildes = -1;
+    c->load_ns = GetTimeNs() - start;
+    return rc == 0;
+}
+
+/** Drop the mapping as soon as the input is parsed. */
+void UnmapInput(struct coro *c)
+{
+    if (c->map_base != NULL) {
+        munmap(c->map_base, c->map_size);
+        c->map_base = NULL;
+        c->map_size = 0;
+    }
+    c->aio_control.aio_buf = NULL;
+}
+
+bool SortFiles()
+{
+    RunCoroutines();
+    return CheckCoroutines();
+}
+
+/**
+ * Sort the chunks batch by batch with the same coroutines. Each
+ * sorted batch is spilled as one run, unless all the input fits
+ * into the first batch: then it is merged straight to the output.
+ */
+bool SortChunks()
+{
+    // Only globals are used: the coroutines may clobber the locals.
+    for (ext.batch_start = 0; ext.batch_start < ext.n_chunks;
+         ext.batch_start += crt.coro_count) {
+        crt.coro_count = ext.n_chunks - ext.batch_start;
+        if (crt.coro_count > ext.batch_width) {
+            crt.coro_count = ext.batch_width;
+        }
+        if (!OpenChunks() || !AsyncReadFiles()) {
+            return false;
+        }
+        RunCoroutines();
+        if (!CheckCoroutines()) {
+            return false;
+        }
+        ext.n_batches++;
+        if (ext.n_batches == 1 && crt.coro_count == ext.n_chunks) {
+            break;
+        }
+        if (!SpillBatch()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void RunCoroutines()
+{
+    io.n_running = crt.coro_count;
+    io.n_waiting = 0;
+    early.n_sorting = crt.coro_count;
+    early.n_ready = 0;
+    // Volatile, because the loop is left by a longjmp():
+    for (volatile size_t i = 0; i < crt.coro_count; ++i) {
+        if (coro_init(i) != 0) {
+            break;
+        }
+    }
+    coro_wait_all();
+    long long read_ns = 0;
+    for (size_t i = 0; i < crt.coro_count; i++) {
+        const struct coro *c = &crt.coros[i];
+        input.load_ns += c->load_ns;
+        input.bytes += c->aio_control.aio_nbytes;
+        read_ns = c->load_ns > read_ns ? c->load_ns : read_ns;
+        phases.parse_ns += c->parse_ns;
+        phases.sort_ns += coro_ticks_to_ns(c->sort_ticks);
+        coro_phases_add(&profile.coros[i], &c->phases);
+    }
+    phases.read_ns += read_ns;
+}
+
+bool CheckCoroutines()
+{
+    for (size_t i = 0; i < crt.coro_count; i++) {
+        if (crt.coros[i].no_errors_occurred) {
+            continue;
+        }
+        if (opts.memory_limit != 0) {
+            const struct Chunk *chunk = &ext.chunks[ext.batch_start + i];
+            LOG_ERROR("file \"%s\" was not sorted (chunk at offset %ld)",
+                      opts.filenames[chunk->file_idx], (long) chunk->offset);
+        } else {
+            LOG_ERROR("file \"%s\" was not sorted", opts.filenames[i]);
+        }
+        return false;
+    }
+    return true;
+}
+
+void CoroExec()
+{
+    coro_call(LoadInput);
+    if (coro_this()->no_errors_occurred) {
+        coro_call(ParseFile);
+        if (opts.input_mode == INPUT_MMAP) {
+            UnmapInput(coro_this());
+        } else if (opts.memory_limit == 0) {
+            // The text is not needed any more. The external sort
+            // reads the next batch into the same buffers.
+            free((char*) coro_this()->aio_control.aio_buf);
+            coro_this()->aio_control.aio_buf = NULL;
+            atomic_fetch_add(&memory.released_bytes, coro_this()->aio_control.aio_nbytes);
+        }
+        coro_maybe_yield();
+
+        if (coro_this()->no_errors_occurred) {
+            coro_call(SortNumbers);
+        } else {
+            LOG_ERROR("Unable to parse file (idx = %lu)", coro_id());
+        }
+        coro_maybe_yield();
+    }
+
+#ifndef NDEBUG
+    LOG_DEBUG_EXTRA("Sorted file (%lu):", coro_id());
+    for (size_t i = 0; i < coro_this()->numbers_size; i++) {
+        LOG_DEBUG_EXTRA("%ld ", coro_this()->numbers[i]);
+    }
+#endif  // NDEBUG
+
+    atomic_fetch_sub(&early.n_sorting, 1);
+    // Histograms are summed by the final merge:
+    if (opts.use_early_merge && coro_this()->no_errors_occurred && coro_this()->hist.counts == NULL) {
+        // The run may be taken by another coroutine after that:
+        coro_call(MergeEarly);
+    }
+    atomic_fetch_sub(&io.n_running, 1);
+    coro_return();
+}
+
+/** Wait until the input of the coroutine is read. */
+void LoadInput()
+{
+    if (opts.input_mode == INPUT_MMAP) {
+        coro_return();
+    }
+    if (opts.input_mode == INPUT_URING) {
+        atomic_fetch_add(&io.n_waiting, 1);
+        while (coro_this()->reads_pending > 0) {
+            // Sleep in the kernel when every running coroutine waits:
+            ReapReads(io.n_waiting >= io.n_running);
+            if (coro_this()->reads_pending == 0) {
+                break;
+            }
+            coro_park();
+        }
+        atomic_fetch_sub(&io.n_waiting, 1);
+    } else {
+        while (aio_error(&coro_this()->aio_control) == EINPROGRESS) {
+            LOG_DEBUG("read-request[%lu] is in progress", coro_id());
+            coro_park();
+        }
+    }
+    coro_this()->load_ns = GetTimeNs() - input.read_submit_ns;
+    if (close(coro_this()->aio_control.aio_fildes) != 0) {
+        LOG_ERROR("Unable to close file[%lu]", coro_id());
+        coro_this()->no_errors_occurred = false;
+        coro_return();
+    }
+    coro_this()->aio_control.aio_fildes = -1;
+    bool is_read = opts.input_mode == INPUT_URING ?
+        !coro_this()->read_failed :
+        aio_return(&coro_this()->aio_control) == (ssize_t) coro_this()->aio_control.aio_nbytes;
+    if (!is_read) {
+        LOG_ERROR("unable to read file[%lu]", coro_id());
+        coro_this()->no_errors_occurred = false;
+        coro_return();
+    }
+    LOG_DEBUG("read a file[%lu]", coro_id());
+    coro_return();
+}
+
+void ParseFile()
+{
+    coro_phase_set(PHASE_PARSE);
+    coro_this()->start_ptr = (char*) coro_this()->aio_control.aio_buf;
+    coro_this()->end_ptr = coro_this()->start_ptr + coro_this()->aio_control.aio_nbytes;
+    coro_this()->start_ptr += coro_this()->header_size;
+    coro_this()->delta_prev = 0;
+    coro_this()->numbers_size = 0;
+    coro_this()->key_min = 0;
+    coro_this()->key_max = 0;
+    coro_this()->parse_ns = 0;
+    while (true) {
+        if (coro_this()->numbers_size >= coro_this()->numbers_capacity &&
+            !GrowNumbers()) {
+            coro_this()->no_errors_occurred = false;
+            coro_return();
+        }
+        enum nparse_status status = ParseChunk();
+        if (status == NPARSE_EOF) {
+            break;
+        }
+        if (status == NPARSE_UNKNOWN_SYMBOL && coro_this()->format != RFMT_TEXT) {
+            LOG_ERROR("truncated %s input at offset %lu", format_names[coro_this()->format],
+                      (size_t) (coro_this()->start_ptr - (char*) coro_this()->aio_control.aio_buf));
+            coro_this()->no_errors_occurred = false;
+            coro_return();
+        }
+        if (status == NPARSE_UNKNOWN_SYMBOL) {
+            LOG_ERROR("Unknown symbol: '%c'", *coro_this()->start_ptr);
+            coro_this()->no_errors_occurred = false;
+            coro_return();
+        }
+        if (status == NPARSE_OVERFLOW) {
+            errno = ERANGE;
+            LOG_ERROR("number is out of range at offset %lu",
+                      (size_t) (coro_this()->start_ptr - (char*) coro_this()->aio_control.aio_buf));
+            errno = 0;
+            coro_this()->no_errors_occurred = false;
+            coro_return();
+        }
+        coro_maybe_yield();
+    }
+    atomic_fetch_add(&crt.total_n_numbers, coro_this()->numbers_size);
+    LOG_DEBUG("Parsed file (idx = %lu, n_numbers = %lu)", coro_id(),
+              coro_this()->numbers_size);
+    coro_return();
+}
+
+enum nparse_status ParseChunk()
+{
+    struct coro *c = coro_this();
+    size_t max = c->numbers_capacity - c->numbers_size;
+    if (max > PARSE_CHUNK_NUMBERS) {
+        max = PARSE_CHUNK_NUMBERS;
+    }
+    long long start = GetTimeNs();
+    const char *pos = c->start_ptr;
+    size_t count = 0;
+    num_t *out = c->numbers + c->numbers_size;
+    enum nparse_status status;
+    if (c->format == RFMT_RAW) {
+        status = rfmt_decode_raw(&pos, c->end_ptr, out, max, &count);
+    } else if (c->format == RFMT_DELTA) {
+        status = rfmt_decode_delta(&pos, c->end_ptr, &c->delta_prev, out, max, &count);
+    } else {
+        status = nparse_numbers(&pos, c->end_ptr, out, max, &count);
+    }
+    // The key range is found while the numbers are still in the cache:
+    if (count > 0) {
+        if (c->numbers_size == 0) {
+            c->key_min = out[0];
+            c->key_max = out[0];
+        }
+        sort_minmax(out, 0, count, &c->key_min, &c->key_max);
+    }
+    c->numbers_size += count;
+    c->start_ptr = (char*) pos;
+    c->parse_ns += GetTimeNs() - start;
+    return status;
+}
+
+bool GrowNumbers()
+{
+    struct coro *c = coro_this();
+    size_t new_capacity = (c->numbers_capacity + 1) * 2;
+    LOG_DEBUG("reallocating from %lu to %lu", c->numbers_capacity, new_capacity);
+    num_t *numbers;
+    if (arena_owns(&memory.arena, c->numbers)) {
+        numbers = (num_t*) malloc(new_capacity * sizeof(num_t));
+        if (numbers != NULL) {
+            memcpy(numbers, c->numbers, c->numbers_size * sizeof(num_t));
+            FreeNumbers(c->numbers, c->numbers_capacity);
+        }
+    } else {
+        numbers = reallocarray(c->numbers, new_capacity, sizeof(num_t));
+    }
+    if (numbers == NULL) {
+        LOG_ERROR("realloc(%lu) failed", new_capacity * sizeof(num_t));
+        return false;
+    }
+    c->numbers = numbers;
+    c->numbers_capacity = new_capacity;
+    return true;
+}
+
+long long GetTimeNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * The sampler of the phase profile: CPU time of the calling thread
+ * and, with --perf, its hardware counters. The counters which are
+ * unavailable stay 0.
+ */
+void SampleCounters(uint64_t *counters)
+{
+    memset(counters, 0, CORO_COUNTERS * sizeof(uint64_t));
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    counters[COUNTER_CPU_NS] = (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+    if (!opts.use_perf) {
+        return;
+    }
+    struct PerfEvents *pe = &perf_events;
+    if (!pe->is_open) {
+        OpenPerfEvents(pe);
+    }
+    if (pe->n_events == 0) {
+        return;
+    }
+    // A group read: the number of values, then the values:
+    uint64_t values[1 + COUNTER_COUNT];
+    ssize_t rc = read(pe->fds[0], values, sizeof(values));
+    if (rc >= (ssize_t) ((1 + pe->n_events) * sizeof(uint64_t))) {
+        for (size_t i = 0; i < pe->n_events; i++) {
+            pe->last[pe->order[i]] = values[1 + i];
+        }
+    }
+    for (size_t i = 0; i < pe->n_events; i++) {
+        counters[pe->order[i]] = pe->last[pe->order[i]];
+    }
+}
+
+/**
+ * Open the hardware counters of the calling thread as one group, so
+ * they are read with one system call. Those the kernel or the
+ * hardware does not give are skipped.
+ */
+void OpenPerfEvents(struct PerfEvents *pe)
+{
+    static const struct
+    {
+        enum Counter counter;
+        uint64_t config;
+    } events[] = {
+        {COUNTER_CYCLES, PERF_COUNT_HW_CPU_CYCLES},
+        {COUNTER_INSTRUCTIONS, PERF_COUNT_HW_INSTRUCTIONS},
+        {COUNTER_CACHE_MISSES, PERF_COUNT_HW_CACHE_MISSES},
+    };
+    memset(pe, 0, sizeof(*pe));
+    pe->is_open = true;
+    for (size_t i = 0; i < sizeof(events) / sizeof(events[0]); i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = events[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        int leader = pe->n_events > 0 ? pe->fds[0] : -1;
+        int fd = (int) syscall(__NR_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        pe->fds[pe->n_events] = fd;
+        pe->order[pe->n_events] = events[i].counter;
+        pe->n_events++;
+    }
+    if (pe->n_events == 0) {
+        profile.is_perf_unavailable = true;
+        return;
+    }
+    if (profile.has_perf_key) {
+        pthread_setspecific(profile.perf_key, pe);
+    }
+}
+
+/** Close the perf events of a thread, called when a worker exits. */
+void ClosePerfEvents(void *arg)
+{
+    struct PerfEvents *pe = (struct PerfEvents*) arg;
+    // Members first, the leader keeps the group alive:
+    for (size_t i = pe->n_events; i > 0; i--) {
+        close(pe->fds[i - 1]);
+    }
+    pe->n_events = 0;
+}
+
+/**
+ * Sort the numbers with the chosen engine. The automatic choice
+ * needs the key range found by ParseChunk(), it also tells radix
+ * sort how many passes are needed and sizes a histogram. The
+ * external sort picks neither radix nor counting sort by itself,
+ * its memory budget has no room for the second array or the counts.
+ */
+void SortNumbers()
+{
+    coro_phase_set(PHASE_SORT);
+    coro_this()->sort_ticks = CoroBusyTicks();
+    coro_this()->engine = opts.sort_engine;
+    coro_this()->is_narrow = false;
+    if (coro_this()->engine == ENGINE_AUTO) {
+        struct coro *c = coro_this();
+        if (opts.memory_limit != 0) {
+            c->engine = ENGINE_INTRO;
+        } else if (sort_hist_is_better(c->numbers_size, c->key_min, c->key_max)) {
+            c->engine = ENGINE_COUNT;
+        } else if (sort_radix_is_better(c->numbers_size, c->key_min, c->key_max)) {
+            c->engine = ENGINE_RADIX;
+        } else {
+            c->engine = ENGINE_INTRO;
+        }
+    }
+    if (coro_this()->engine == ENGINE_COUNT) {
+        coro_call(CountSort);
+    } else if (coro_this()->engine == ENGINE_RADIX) {
+        coro_call(RadixSort);
+    } else if (coro_this()->engine == ENGINE_INTRO) {
+        coro_call(IntroSort);
+    } else {
+        coro_call(QuickSort);
+    }
+    coro_this()->sort_ticks = CoroBusyTicks() - coro_this()->sort_ticks;
+    coro_return();
+}
+
+/**
+ * Merge the sorted run with the ready ones while other coroutines
+ * still parse or sort, then leave it ready for the final merge or
+ * for another coroutine.
+ */
+void MergeEarly()
+{
+    coro_phase_set(PHASE_MERGE);
+    while (MergeEarlyStart()) {
+        while (!MergeEarlyStep()) {
+            coro_maybe_yield();
+        }
+        MergeEarlyFinish();
+        coro_maybe_yield();
+    }
+    coro_return();
+}
+
+/**
+ * Take a ready run and allocate the merged one. Returns false when
+ * the run of the coroutine is left ready instead: nobody to merge
+ * with, all the runs are sorted and the final merge takes them at
+ * once, or there is no memory for the merge.
+ */
+bool MergeEarlyStart()
+{
+    struct coro *c = coro_this();
+    pthread_mutex_lock(&early.lock);
+    if (early.n_ready == 0 || early.n_sorting == 0) {
+        early.ready[early.n_ready++] = coro_id();
+        pthread_mutex_unlock(&early.lock);
+        return false;
+    }
+    c->merge_other = early.ready[--early.n_ready];
+    pthread_mutex_unlock(&early.lock);
+
+    size_t size = c->numbers_size + crt.coros[c->merge_other].numbers_size;
+    c->merge_dst = (num_t*) malloc(size * sizeof(num_t));
+    c->merge_i = 0;
+    c->merge_j = 0;
+    if (c->merge_dst == NULL) {
+        pthread_mutex_lock(&early.lock);
+        early.ready[early.n_ready++] = c->merge_other;
+        early.ready[early.n_ready++] = coro_id();
+        pthread_mutex_unlock(&early.lock);
+        return false;
+    }
+    return true;
+}
+
+/** Merge the next EARLY_MERGE_STEP numbers, true when it is done. */
+bool MergeEarlyStep()
+{
+    struct coro *c = coro_this();
+    const struct coro *other = &crt.coros[c->merge_other];
+    const num_t *a = c->numbers;
+    const num_t *b = other->numbers;
+    size_t a_size = c->numbers_size;
+    size_t b_size = other->numbers_size;
+    size_t i = c->merge_i;
+    size_t j = c->merge_j;
+    size_t k = i + j;
+    size_t end = a_size + b_size - k > EARLY_MERGE_STEP ? k + EARLY_MERGE_STEP : a_size + b_size;
+    num_t *dst = c->merge_dst;
+    while (k < end && i < a_size && j < b_size) {
+        dst[k++] = b[j] < a[i] ? b[j++] : a[i++];
+    }
+    for (; k < end && i < a_size; k++) {
+        dst[k] = a[i++];
+    }
+    for (; k < end && j < b_size; k++) {
+        dst[k] = b[j++];
+    }
+    c->merge_i = i;
+    c->merge_j = j;
+    return k == a_size + b_size;
+}
+
+/** Take the merged run over, the other coroutine is left empty. */
+void MergeEarlyFinish()
+{
+    struct coro *c = coro_this();
+    struct coro *other = &crt.coros[c->merge_other];
+    size_t size = c->numbers_size + other->numbers_size;
+    FreeNumbers(c->numbers, c->numbers_capacity);
+    c->numbers = c->merge_dst;
+    c->numbers_size = size;
+    c->numbers_capacity = size;
+    c->merge_dst = NULL;
+    FreeNumbers(other->numbers, other->numbers_capacity);
+    other->numbers = NULL;
+    other->numbers_size = 0;
+    other->numbers_capacity = 0;
+    atomic_fetch_add(&early.n_merges, 1);
+    atomic_fetch_add(&early.n_numbers, size);
+}
+
+/** Time the current coroutine has been running, up to now. */
+coro_ticks_t CoroBusyTicks()
+{
+    return coro_this()->ticks_spent + (coro_ticks() - coro_this()->timestamp);
+}
+
+#ifdef CORO_BACKEND_STACK
+/*
+ * Locals survive a switch on the stacks of coro_stack.h, so there the
+ * sorts below take plain arguments and keep their state in locals
+ * instead of coro_call() frames and fields of the coroutine. The
+ * versions after #else are the same algorithms for coro_jmp.h.
+ */
+void QuickSort()
+{
+    if (coro_this()->numbers_size > 1) {
+        SortRange(coro_this()->numbers, 0, coro_this()->numbers_size - 1);
+    }
+    coro_return();
+}
+
+/**
+ * Quicksort of [from, to]. Only the smaller part is sorted by a
+ * recursive call, the range is narrowed to the larger one: the depth
+ * is O(log n) even on bad pivots.
+ */
+void SortRange(num_t *numbers, size_t from, size_t to)
+{
+    while (from < to) {
+        size_t sep = Partition(numbers, from, to, numbers[(from + to) / 2]);
+        coro_maybe_yield();
+        if (sep - from < to - sep) {
+            if (sep > from) {
+                SortRange(numbers, from, sep);
+            }
+            from = sep + 1;
+        } else {
+            if (to > sep + 1) {
+                SortRange(numbers, sep + 1, to);
+            }
+            to = sep;
+        }
+    }
+}
+
+void IntroSort()
+{
+    if (coro_this()->numbers_size > 1) {
+        IntroSortRange(coro_this()->numbers, 0, coro_this()->numbers_size - 1,
+                       2 * sort_log2(coro_this()->numbers_size));
+    }
+    coro_return();
+}
+
+/** SortRange() with a median of three, insertion and heap sorts. */
+void IntroSortRange(num_t *numbers, size_t from, size_t to, size_t depth_left)
+{
+    while (from < to) {
+        if (to - from < SORT_INSERTION_MAX) {
+            sort_insertion(numbers + from, to - from + 1);
+            return;
+        }
+        if (depth_left == 0) {
+            HeapSortRange(numbers, from, to);
+            return;
+        }
+        sort_median_of_three(numbers, from, to);
+        size_t sep = Partition(numbers, from, to, numbers[(from + to) / 2]);
+        depth_left--;
+        coro_maybe_yield();
+        if (sep - from < to - sep) {
+            if (sep > from) {
+                IntroSortRange(numbers, from, sep, depth_left);
+            }
+            from = sep + 1;
+        } else {
+            if (to > sep + 1) {
+                IntroSortRange(numbers, sep + 1, to, depth_left);
+            }
+            to = sep;
+        }
+    }
+}
+
+void HeapSortRange(num_t *numbers, size_t from, size_t to)
+{
+    struct sort_heap heap;
+    sort_heap_init(&heap, numbers + from, to - from + 1);
+    while (!sort_heap_step(&heap, HEAP_SORT_STEP)) {
+        coro_maybe_yield();
+    }
+}
+
+/**
+ * Hoare partition of [from, to] around @a target, returns the last
+ * index of the lower part. The coroutine may be switched out after
+ * each PARTITION_STEP steps, the scan goes on where it was.
+ */
+size_t Partition(num_t *numbers, size_t from, size_t to, num_t target)
+{
+    size_t lower = from;
+    size_t upper = to;
+    size_t budget = PARTITION_STEP;
+    while (true) {
+        while (budget > 0 && numbers[lower] < target) {
+            lower++;
+            budget--;
+        }
+        while (budget > 0 && numbers[upper] > target) {
+            upper--;
+            budget--;
+        }
+        if (budget == 0) {
+            coro_maybe_yield();
+            budget = PARTITION_STEP;
+            continue;
+        }
+        if (lower >= upper) {
+            return upper;
+        }
+        AtomicSwap(&numbers[lower], &numbers[upper]);
+        lower++;
+        upper--;
+        budget--;
+    }
+}
+#else
+void QuickSort()
+{
+    if (coro_this()->numbers_size > 1) {
+        coro_call(SortRange, 0, coro_this()->numbers_size - 1);
+    }
+    coro_return();
+}
+
+/**
+ * Quicksort of [sort_from, sort_to]. Only the smaller part is sorted
+ * by a recursive call, the range is narrowed to the larger one and
+ * partitioned again: the depth is O(log n) even on bad pivots, which
+ * matters on the fixed-size stacks of coro_stack.h.
+ */
+void SortRange(/* size_t sort_from, size_t sort_to */)
+{
+#define SFRAME coro_this()->stack[coro_this()->stack_pointer].uframe
+    ASSERT(SFRAME.sort_from < SFRAME.sort_to);
+    while (SFRAME.sort_from < SFRAME.sort_to) {
+        LOG_DEBUG_EXTRA("SortRange %lu:%lu", SFRAME.sort_from, SFRAME.sort_to);
+        coro_this()->lower_idx = SFRAME.sort_from;
+        coro_this()->upper_idx = SFRAME.sort_to;
+        coro_this()->target = coro_this()->numbers[(SFRAME.sort_from + SFRAME.sort_to) / 2];
+        while (!PartitionStep()) {
+            coro_maybe_yield();
+        }
+
+        // Save on coro's stack because it may be overwritten after recursive call:
+        SFRAME.sep_idx = coro_this()->upper_idx;
+        LOG_DEBUG_EXTRA("Separate idx = %lu", SFRAME.sep_idx);
+        coro_maybe_yield();
+        if (SFRAME.sep_idx - SFRAME.sort_from < SFRAME.sort_to - SFRAME.sep_idx) {
+            // Sort lower part, go on with the upper one:
+            if (SFRAME.sep_idx > SFRAME.sort_from) {
+                LOG_DEBUG_EXTRA("sort lower %lu:%lu", SFRAME.sort_from, SFRAME.sep_idx);
+                coro_call(SortRange, SFRAME.sort_from, SFRAME.sep_idx);
+                coro_maybe_yield();
+            }
+            SFRAME.sort_from = SFRAME.sep_idx + 1;
+        } else {
+            // Sort upper part, go on with the lower one:
+            if (SFRAME.sort_to > (SFRAME.sep_idx + 1)) {
+                LOG_DEBUG_EXTRA("sort upper %lu:%lu", (SFRAME.sep_idx + 1), SFRAME.sort_to);
+                coro_call(SortRange, (SFRAME.sep_idx + 1), SFRAME.sort_to);
+                coro_maybe_yield();
+            }
+            SFRAME.sort_to = SFRAME.sep_idx;
+        }
+    }
+    coro_return();
+}
+
+void IntroSort()
+{
+    if (coro_this()->numbers_size > 1) {
+        coro_call(IntroSortRange, .sort_from = 0, .sort_to = coro_this()->numbers_size - 1,
+                  .depth_left = 2 * sort_log2(coro_this()->numbers_size));
+    }
+    coro_return();
+}
+
+/**
+ * Quicksort with a median of three pivot, an insertion sort for
+ * small ranges and a heap sort when the recursion gets too deep.
+ * As in SortRange(), only the smaller part is a recursive call.
+ */
+void IntroSortRange(/* size_t sort_from, size_t sort_to, size_t depth_left */)
+{
+    ASSERT(SFRAME.sort_from < SFRAME.sort_to);
+    while (SFRAME.sort_from < SFRAME.sort_to) {
+        if (SFRAME.sort_to - SFRAME.sort_from < SORT_INSERTION_MAX) {
+            sort_insertion(coro_this()->numbers + SFRAME.sort_from, SFRAME.sort_to - SFRAME.sort_from + 1);
+            break;
+        }
+        if (SFRAME.depth_left == 0) {
+            coro_call(HeapSortRange, SFRAME.sort_from, SFRAME.sort_to);
+            break;
+        }
+        sort_median_of_three(coro_this()->numbers, SFRAME.sort_from, SFRAME.sort_to);
+        coro_this()->lower_idx = SFRAME.sort_from;
+        coro_this()->upper_idx = SFRAME.sort_to;
+        coro_this()->target = coro_this()->numbers[(SFRAME.sort_from + SFRAME.sort_to) / 2];
+        while (!PartitionStep()) {
+            coro_maybe_yield();
+        }
+        SFRAME.sep_idx = coro_this()->upper_idx;
+        SFRAME.depth_left--;
+        coro_maybe_yield();
+        if (SFRAME.sep_idx - SFRAME.sort_from < SFRAME.sort_to - SFRAME.sep_idx) {
+            if (SFRAME.sep_idx > SFRAME.sort_from) {
+                coro_call(IntroSortRange, .sort_from = SFRAME.sort_from, .sort_to = SFRAME.sep_idx,
+                          .depth_left = SFRAME.depth_left);
+                coro_maybe_yield();
+            }
+            SFRAME.sort_from = SFRAME.sep_idx + 1;
+        } else {
+            if (SFRAME.sort_to > (SFRAME.sep_idx + 1)) {
+                coro_call(IntroSortRange, .sort_from = SFRAME.sep_idx + 1, .sort_to = SFRAME.sort_to,
+                          .depth_left = SFRAME.depth_left);
+                coro_maybe_yield();
+            }
+            SFRAME.sort_to = SFRAME.sep_idx;
+        }
+    }
+    coro_return();
+}
+
+void HeapSortRange(/* size_t sort_from, size_t sort_to */)
+{
+    sort_heap_init(&coro_this()->heap, coro_this()->numbers + SFRAME.sort_from,
+                   SFRAME.sort_to - SFRAME.sort_from + 1);
+    while (!sort_heap_step(&coro_this()->heap, HEAP_SORT_STEP)) {
+        coro_maybe_yield();
+    }
+    coro_return();
+}
+#endif  // CORO_BACKEND_STACK
+
+/**
+ * LSD radix sort over the key range found by SortNumbers(). The
+ * arrays are simply swapped when the result ends up in the second
+ * one. It has the capacity of the first one in the external sort,
+ * which reuses it for the next batches, and just fits the numbers
+ * otherwise.
+ */
+void RadixSort()
+{
+    struct coro *c = coro_this();
+    if (c->numbers_size <= 1) {
+        coro_return();
+    }
+    size_t tmp_capacity = opts.memory_limit != 0 ? c->numbers_capacity : c->numbers_size;
+    c->radix = (struct sort_radix*) malloc(sizeof(struct sort_radix));
+    c->radix_tmp = (num_t*) malloc(tmp_capacity * sizeof(num_t));
+    if (c->radix == NULL || c->radix_tmp == NULL) {
+        LOG_DEBUG("no memory for a radix sort of %lu numbers, using introsort", c->numbers_size);
+        free(c->radix);
+        free(c->radix_tmp);
+        c->radix = NULL;
+        c->radix_tmp = NULL;
+        c->engine = ENGINE_INTRO;
+        coro_call(IntroSort);
+        coro_return();
+    }
+    sort_radix_init(c->radix, c->numbers, c->radix_tmp, c->numbers_size, c->key_min, c->key_max,
+                    opts.use_narrow_keys);
+    c->is_narrow = c->radix->is_narrow;
+    while (!sort_radix_step(coro_this()->radix, RADIX_STEP)) {
+        coro_maybe_yield();
+    }
+    c = coro_this();
+    if (c->radix->src != c->numbers) {
+        FreeNumbers(c->numbers, c->numbers_capacity);
+        c->numbers = c->radix->src;
+        c->numbers_capacity = opts.memory_limit != 0 ? c->numbers_capacity : c->numbers_size;
+    } else {
+        free(c->radix_tmp);
+    }
+    free(c->radix);
+    c->radix_tmp = NULL;
+    c->radix = NULL;
+    coro_return();
+}
+
+/**
+ * Count the numbers into a histogram over the key range found by
+ * ParseChunk() instead of sorting them. The numbers are freed then,
+ * the histogram is the run of the coroutine, see MergeFiles(). The
+ * external sort spills runs of numbers, so there the numbers are
+ * written back in order over themselves. Falls back to introsort
+ * when the range is too wide for a histogram.
+ */
+void CountSort()
+{
+    struct coro *c = coro_this();
+    if (!sort_hist_can_count(c->key_min, c->key_max, SORT_HIST_MAX) ||
+        !sort_hist_init(&c->hist, c->key_min, c->key_max)) {
+        LOG_DEBUG("no histogram for %lu numbers, using introsort", c->numbers_size);
+        sort_hist_destroy(&c->hist);
+        c->engine = ENGINE_INTRO;
+        coro_call(IntroSort);
+        coro_return();
+    }
+    c->lower_idx = 0;
+    while (coro_this()->lower_idx < coro_this()->numbers_size) {
+        CountStep();
+        coro_maybe_yield();
+    }
+    c = coro_this();
+    if (opts.memory_limit == 0) {
+        FreeNumbers(c->numbers, c->numbers_capacity);
+        c->numbers = NULL;
+        c->numbers_size = 0;
+        c->numbers_capacity = 0;
+        coro_return();
+    }
+    c->lower_idx = 0;
+    while (CountExpandStep()) {
+        coro_maybe_yield();
+    }
+    sort_hist_destroy(&coro_this()->hist);
+    coro_return();
+}
+
+void CountStep()
+{
+    struct coro *c = coro_this();
+    size_t end = c->numbers_size - c->lower_idx > RADIX_STEP ? c->lower_idx + RADIX_STEP : c->numbers_size;
+    sort_hist_add(&c->hist, c->numbers, c->lower_idx, end);
+    c->lower_idx = end;
+}
+
+/** Write the next counted numbers back, false when all of them are. */
+bool CountExpandStep()
+{
+    struct coro *c = coro_this();
+    size_t n = sort_hist_expand(&c->hist, c->numbers + c->lower_idx, RADIX_STEP);
+    c->lower_idx += n;
+    return n > 0;
+}
+
+#ifndef CORO_BACKEND_STACK
+bool PartitionStep()
+{
+    struct coro *c = coro_this();
+    num_t *numbers = c->numbers;
+    const num_t target = c->target;
+    size_t lower = c->lower_idx;
+    size_t upper = c->upper_idx;
+    size_t budget = PARTITION_STEP;
+    bool is_done = false;
+    // Hoare partition with the state in registers, spilled back to the
+    // coroutine after a bounded amount of work:
+    while (budget > 0) {
+        while (budget > 0 && numbers[lower] < target) {
+            lower++;
+            budget--;
+        }
+        while (budget > 0 && numbers[upper] > target) {
+            upper--;
+            budget--;
+        }
+        if (budget == 0) {
+            break;
+        }
+        if (lower >= upper) {
+            is_done = true;
+            break;
+        }
+        AtomicSwap(&numbers[lower], &numbers[upper]);
+        lower++;
+        upper--;
+        budget--;
+    }
+    c->lower_idx = lower;
+    c->upper_idx = upper;
+    return is_done;
+}
+#endif  // CORO_BACKEND_STACK
+
+void AtomicSwap(num_t *x, num_t *y)
 {
     ASSERT(x != NULL);
     ASSERT(y != NULL);
@@ -346,74 +2332,777 @@ void AtomicSwap(num_t *x, num_t *y)
     *y = temp;
 }
 
+/**
+ * Merge the runs into the output. When all of them are histograms,
+ * they are summed and the output is written straight from the sum.
+ */
 bool MergeFiles()
 {
+    size_t n_histograms = 0;
+    bool has_numbers = false;
+    for (size_t i = 0; i < crt.coro_count; i++) {
+        if (crt.coros[i].hist.counts != NULL) {
+            n_histograms++;
+        } else if (crt.coros[i].numbers_size > 0) {
+            has_numbers = true;
+        }
+    }
+    if (n_histograms > 0 && !has_numbers && SumHistograms()) {
+        return WriteHistogram(&hmerge.total);
+    }
+    if (n_histograms > 0 && !ExpandHistograms()) {
+        return false;
+    }
+    // A value of the aggregated output may span slices:
+    size_t n_slices = opts.use_aggregate ? 1 : opts.merge_threads;
+    if (n_slices > crt.total_n_numbers / MERGE_SLICE_MIN) {
+        n_slices = crt.total_n_numbers / MERGE_SLICE_MIN;
+    }
+    if (n_slices > 1) {
+        return MergeParallel(n_slices);
+    }
+    struct ltree tree;
+    if (!ltree_init(&tree, crt.coro_count)) {
+        LOG_ERROR("unable to allocate a merge tree (k = %lu)", crt.coro_count);
+        return false;
+    }
+    // Runs taken by an early merge are empty:
+    static const num_t empty_run[1];
+    for (size_t i = 0; i < crt.coro_count; i++) {
+        const num_t *numbers = crt.coros[i].numbers != NULL ? crt.coros[i].numbers : empty_run;
+        ltree_set_run(&tree, i, numbers, crt.coros[i].numbers_size);
+    }
+    ltree_build(&tree);
+    bool is_ok = WriteMerged(&tree);
+    ltree_destroy(&tree);
+    return is_ok;
+}
+
+/**
+ * Sum the histograms of the runs into hmerge.total. Returns false,
+ * leaving them as they are, when their keys span more than
+ * HIST_MERGE_MAX or the sum can not be allocated.
+ */
+bool SumHistograms()
+{
+    unsigned long long min = ULLONG_MAX;
+    unsigned long long max = 0;
+    for (size_t i = 0; i < crt.coro_count; i++) {
+        const struct sort_hist *h = &crt.coros[i].hist;
+        // The range of an empty run is made up, see ParseFile():
+        if (h->counts != NULL && h->n_values > 0) {
+            min = h->min < min ? h->min : min;
+            max = h->min + h->size - 1 > max ? h->min + h->size - 1 : max;
+        }
+    }
+    if (min > max) {
+        min = num_key(0);
+        max = min;
+    }
+    if (max - min >= HIST_MERGE_MAX ||
+        !sort_hist_init(&hmerge.total, num_from_key(min), num_from_key(max))) {
+        return false;
+    }
+    for (size_t i = 0; i < crt.coro_count; i++) {
+        struct sort_hist *h = &crt.coros[i].hist;
+        if (h->counts != NULL) {
+            if (h->n_values > 0) {
+                sort_hist_merge(&hmerge.total, h);
+            }
+            sort_hist_destroy(h);
+            hmerge.n_histograms++;
+        }
+    }
+    return true;
+}
+
+/** Turn the histograms back into sorted runs of numbers. */
+bool ExpandHistograms()
+{
+    for (size_t i = 0; i < crt.coro_count; i++) {
+        struct coro *c = &crt.coros[i];
+        if (c->hist.counts == NULL) {
+            continue;
+        }
+        size_t size = c->hist.n_values;
+        num_t *numbers = (num_t*) malloc((size > 0 ? size : 1) * sizeof(num_t));
+        if (numbers == NULL) {
+            LOG_ERROR("malloc(%lu) failed", size * sizeof(num_t));
+            return false;
+        }
+        sort_hist_expand(&c->hist, numbers, size);
+        sort_hist_destroy(&c->hist);
+        c->numbers = numbers;
+        c->numbers_size = size;
+        c->numbers_capacity = size;
+        hmerge.n_expanded++;
+    }
+    return true;
+}
+
+/**
+ * Write the numbers counted by @a h in order. Each value is
+ * formatted once and copied as many times as it is counted.
+ */
+bool WriteHistogram(const struct sort_hist *h)
+{
+    if (!OpenOutput()) {
+        return false;
+    }
+    static const char zero_delta = 0;
+    num_t prev = 0;
+    for (size_t i = 0; i < h->size; i++) {
+        size_t count = h->counts[i];
+        if (count == 0) {
+            continue;
+        }
+        num_t value = num_from_key(h->min + i);
+        if (opts.use_aggregate) {
+            PutAggregate(&output, value, count);
+        } else if (opts.out_format == RFMT_TEXT) {
+            char tmp[OBUF_NUM_MAX_LEN];
+            char *begin = obuf_format_num(value, tmp + sizeof(tmp));
+            obuf_put_repeated(&output, begin, (size_t) (tmp + sizeof(tmp) - begin), count);
+        } else if (opts.out_format == RFMT_RAW) {
+            num_t le = rfmt_num_to_le(value);
+            obuf_put_repeated(&output, &le, sizeof(le), count);
+        } else {
+            obuf_put_varint(&output, rfmt_delta(&prev, value));
+            obuf_put_repeated(&output, &zero_delta, sizeof(zero_delta), count - 1);
+        }
+    }
+    return CloseOutput(h->n_values);
+}
+
+/**
+ * Merge path: the output is cut into @a n_slices equal slices, the
+ * numbers of each slice are found in every run by CoRank(). Then the
+ * threads measure their slices, which gives the offsets, and merge
+ * and write them into the output file at the same time.
+ */
+bool MergeParallel(size_t n_slices)
+{
+    size_t k = crt.coro_count;
+    struct MergeSlice *slices = (struct MergeSlice*) calloc(n_slices, sizeof(struct MergeSlice));
+    size_t *splits = (size_t*) calloc((n_slices + 1) * k, sizeof(size_t));
+    if (slices == NULL || splits == NULL) {
+        LOG_ERROR("unable to allocate a merge of %lu slices", n_slices);
+        free(slices);
+        free(splits);
+        return false;
+    }
+    pmerge.n_slices = n_slices;
+    long long stamp = GetTimeNs();
+    for (size_t s = 0; s <= n_slices; s++) {
+        CoRank(crt.total_n_numbers / n_slices * s + (s == n_slices ? crt.total_n_numbers % n_slices : 0),
+               splits + s * k);
+    }
+    pmerge.split_ns = GetTimeNs() - stamp;
+
     int fd = open(O_FILE_NAME, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     if (fd == -1) {
         LOG_ERROR("can't create an output file");
+        free(slices);
+        free(splits);
         return false;
     }
+    for (size_t s = 0; s < n_slices; s++) {
+        struct MergeSlice *slice = &slices[s];
+        slice->begin = splits + s * k;
+        slice->end = splits + (s + 1) * k;
+        slice->fd = fd;
+        // Everything before the slice is not greater than what is
+        // in it, so the number before it is the greatest of them:
+        bool has_prev = false;
+        for (size_t i = 0; i < k; i++) {
+            slice->n_numbers += slice->end[i] - slice->begin[i];
+            if (slice->begin[i] == 0) {
+                continue;
+            }
+            num_t last = crt.coros[i].numbers[slice->begin[i] - 1];
+            if (!has_prev || last > slice->prev) {
+                slice->prev = last;
+                has_prev = true;
+            }
+        }
+    }
+
+    stamp = GetTimeNs();
+    bool is_ok = RunSlices(slices, n_slices, MeasureSlice);
+    pmerge.measure_ns = GetTimeNs() - stamp;
+    off_t offset = 0;
+    if (is_ok && opts.out_format != RFMT_TEXT) {
+        char header[RFMT_HEADER_SIZE];
+        rfmt_make_header(opts.out_format, header);
+        is_ok = pwrite(fd, header, sizeof(header), 0) == (ssize_t) sizeof(header);
+        offset = sizeof(header);
+        output.bytes_written += sizeof(header);
+    }
+    for (size_t s = 0; s < n_slices; s++) {
+        slices[s].offset = offset;
+        offset += (off_t) slices[s].bytes;
+    }
+    is_ok = is_ok && RunSlices(slices, n_slices, WriteSlice);
+    for (size_t s = 0; s < n_slices; s++) {
+        output.bytes_written += slices[s].out.bytes_written;
+        output.n_writes += slices[s].out.n_writes;
+        output.write_ns += slices[s].out.write_ns;
+    }
+    phases.write_ns += output.write_ns;
+    if (close(fd) != 0) {
+        is_ok = false;
+    }
+    if (!is_ok) {
+        LOG_ERROR("unable to write to \"%s\"", O_FILE_NAME);
+    } else if (output.bytes_written != (size_t) offset) {
+        LOG_ERROR("wrote %lu bytes out of %lu", output.bytes_written, (size_t) offset);
+        is_ok = false;
+    }
+    free(slices);
+    free(splits);
+    return is_ok;
+}
+
+/**
+ * Find how many numbers of each run go before the first @a rank
+ * numbers of the merged output: the smallest value which has rank
+ * numbers not greater than it is searched for, ties on it are taken
+ * from the runs in order.
+ */
+void CoRank(size_t rank, size_t *split)
+{
+    size_t k = crt.coro_count;
+    if (rank == 0) {
+        memset(split, 0, k * sizeof(size_t));
+        return;
+    }
+    // The bisection goes over the keys, see num_key():
+    bool has_bounds = false;
+    uint64_t low = 0;
+    uint64_t high = 0;
+    for (size_t i = 0; i < k; i++) {
+        const struct coro *c = &crt.coros[i];
+        if (c->numbers_size == 0) {
+            continue;
+        }
+        uint64_t first = num_key(c->numbers[0]);
+        uint64_t last = num_key(c->numbers[c->numbers_size - 1]);
+        if (!has_bounds || first < low) {
+            low = first;
+        }
+        if (!has_bounds || last > high) {
+            high = last;
+        }
+        has_bounds = true;
+    }
+    while (low < high) {
+        uint64_t mid = low + ((high - low) >> 1);
+        if (CountRanked(num_from_key(mid)) >= rank) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    num_t value = num_from_key(low);
+    // All the numbers less than the value go first, then as many of
+    // the equal ones as needed:
+    size_t left = rank;
+    for (size_t i = 0; i < k; i++) {
+        split[i] = CountLess(&crt.coros[i], value);
+        left -= split[i];
+    }
+    for (size_t i = 0; i < k && left > 0; i++) {
+        size_t n_equal = CountNotGreater(&crt.coros[i], value) - split[i];
+        n_equal = n_equal < left ? n_equal : left;
+        split[i] += n_equal;
+        left -= n_equal;
+    }
+}
+
+/** Numbers of the run of @a c which are less than @a value. */
+size_t CountLess(const struct coro *c, num_t value)
+{
+    size_t from = 0;
+    size_t to = c->numbers_size;
+    while (from < to) {
+        size_t mid = from + (to - from) / 2;
+        if (c->numbers[mid] < value) {
+            from = mid + 1;
+        } else {
+            to = mid;
+        }
+    }
+    return from;
+}
+
+size_t CountNotGreater(const struct coro *c, num_t value)
+{
+    size_t from = 0;
+    size_t to = c->numbers_size;
+    while (from < to) {
+        size_t mid = from + (to - from) / 2;
+        if (c->numbers[mid] <= value) {
+            from = mid + 1;
+        } else {
+            to = mid;
+        }
+    }
+    return from;
+}
+
+/** Numbers of all the runs which are not greater than @a value. */
+size_t CountRanked(num_t value)
+{
+    size_t count = 0;
     for (size_t i = 0; i < crt.coro_count; i++) {
-        crt.coros[i].cur_pos = 0;
+        count += CountNotGreater(&crt.coros[i], value);
     }
+    return count;
+}
 
-    for (size_t i = 0; i < crt.total_n_numbers; i++) {
-        size_t coro_idx;
-        dprintf(fd, "%ld ", GetMinimalNumber(&coro_idx));
-        if (coro_idx == (size_t) -1) {
-            LOG_ERROR("numbers indexing out of range");
-            close(fd);
-            return false;
+/** Run @a func on each slice, in a thread per slice but the first one. */
+bool RunSlices(struct MergeSlice *slices, size_t n_slices, void *(*func)(void*))
+{
+    pthread_t *threads = (pthread_t*) calloc(n_slices, sizeof(pthread_t));
+    bool *is_started = (bool*) calloc(n_slices, sizeof(bool));
+    if (threads == NULL || is_started == NULL) {
+        LOG_ERROR("unable to allocate %lu merge threads", n_slices);
+        free(threads);
+        free(is_started);
+        return false;
+    }
+    for (size_t s = 1; s < n_slices; s++) {
+        is_started[s] = pthread_create(&threads[s], NULL, func, &slices[s]) == 0;
+    }
+    func(&slices[0]);
+    bool is_ok = true;
+    for (size_t s = 0; s < n_slices; s++) {
+        if (s > 0 && is_started[s]) {
+            pthread_join(threads[s], NULL);
+        } else if (s > 0) {
+            // No more threads, the slice is done here:
+            func(&slices[s]);
         }
+        is_ok = is_ok && slices[s].is_ok;
     }
-    close(fd);
+    free(threads);
+    free(is_started);
+    return is_ok;
+}
+
+bool InitSliceTree(const struct MergeSlice *slice, struct ltree *tree)
+{
+    if (!ltree_init(tree, crt.coro_count)) {
+        LOG_ERROR("unable to allocate a merge tree (k = %lu)", crt.coro_count);
+        return false;
+    }
+    static const num_t empty_run[1];
+    for (size_t i = 0; i < crt.coro_count; i++) {
+        const num_t *numbers = crt.coros[i].numbers != NULL ? crt.coros[i].numbers : empty_run;
+        ltree_set_run(tree, i, numbers + slice->begin[i], slice->end[i] - slice->begin[i]);
+    }
+    ltree_build(tree);
     return true;
 }
 
-num_t GetMinimalNumber(size_t *coro_idx)
+/**
+ * Find the length of the slice in the output. Lengths of the text
+ * and of the raw numbers do not depend on the order, only the delta
+ * format needs the merge.
+ */
+void *MeasureSlice(void *arg)
 {
-    size_t min_num_file_idx = 0;
-    for (min_num_file_idx = 0; min_num_file_idx < crt.coro_count; min_num_file_idx++) {
-        if (crt.coros[min_num_file_idx].cur_pos < crt.coros[min_num_file_idx].numbers_size) {
-            // Got a first valid idx
-            break;
+    struct MergeSlice *slice = (struct MergeSlice*) arg;
+    slice->bytes = 0;
+    if (opts.out_format == RFMT_RAW) {
+        slice->bytes = slice->n_numbers * sizeof(num_t);
+    } else if (opts.out_format == RFMT_TEXT) {
+        for (size_t i = 0; i < crt.coro_count; i++) {
+            for (size_t j = slice->begin[i]; j < slice->end[i]; j++) {
+                slice->bytes += obuf_num_len(crt.coros[i].numbers[j]);
+            }
+        }
+    } else {
+        struct ltree tree;
+        if (!InitSliceTree(slice, &tree)) {
+            slice->is_ok = false;
+            return NULL;
+        }
+        num_t prev = slice->prev;
+        num_t value;
+        while (ltree_pop(&tree, &value)) {
+            slice->bytes += obuf_varint_len(rfmt_delta(&prev, value));
+        }
+        ltree_destroy(&tree);
+    }
+    slice->is_ok = true;
+    return NULL;
+}
+
+/** Merge the slice and write it at its offset. */
+void *WriteSlice(void *arg)
+{
+    struct MergeSlice *slice = (struct MergeSlice*) arg;
+    slice->is_ok = false;
+    struct ltree tree;
+    if (!InitSliceTree(slice, &tree)) {
+        return NULL;
+    }
+    if (!obuf_create_at(&slice->out, slice->fd, opts.out_buf_size, opts.out_buffers, slice->offset)) {
+        LOG_ERROR("unable to allocate an output buffer (%lu)", opts.out_buf_size);
+        ltree_destroy(&tree);
+        return NULL;
+    }
+    size_t n_merged = 0;
+    num_t prev = slice->prev;
+    num_t value;
+    while (ltree_pop(&tree, &value)) {
+        if (opts.out_format == RFMT_TEXT) {
+            obuf_put_num(&slice->out, value);
+        } else if (opts.out_format == RFMT_RAW) {
+            obuf_put_raw(&slice->out, rfmt_num_to_le(value));
+        } else {
+            obuf_put_varint(&slice->out, rfmt_delta(&prev, value));
+        }
+        n_merged++;
+    }
+    ltree_destroy(&tree);
+    slice->is_ok = obuf_flush(&slice->out) && n_merged == slice->n_numbers &&
+                   slice->out.bytes_written == slice->bytes;
+    obuf_destroy(&slice->out);
+    return NULL;
+}
+
+/** Merge the sorted chunks of the current batch into a new run. */
+bool SpillBatch()
+{
+    int fd;
+    if (!CreateRun(&fd)) {
+        return false;
+    }
+    struct ltree tree;
+    if (!ltree_init(&tree, crt.coro_count)) {
+        LOG_ERROR("unable to allocate a merge tree (k = %lu)", crt.coro_count);
+        close(fd);
+        return false;
+    }
+    for (size_t i = 0; i < crt.coro_count; i++) {
+        ltree_set_run(&tree, i, crt.coros[i].numbers, crt.coros[i].numbers_size);
+    }
+    ltree_build(&tree);
+    struct obuf spill;
+    if (!obuf_create_async(&spill, fd, opts.out_buf_size, opts.out_buffers)) {
+        LOG_ERROR("unable to allocate an output buffer (%lu)", opts.out_buf_size);
+        ltree_destroy(&tree);
+        close(fd);
+        return false;
+    }
+    num_t value;
+    while (ltree_pop(&tree, &value)) {
+        obuf_put_raw(&spill, value);
+    }
+    ltree_destroy(&tree);
+    bool write_ok = obuf_flush(&spill);
+    ext.spilled_bytes += spill.bytes_written;
+    phases.write_ns += spill.write_ns;
+    obuf_destroy(&spill);
+    if (!write_ok) {
+        LOG_ERROR("unable to spill a sorted run to \"%s\"", opts.tmp_dir);
+        close(fd);
+        return false;
+    }
+    ext.run_fds[ext.n_runs++] = fd;
+    ext.n_spilled_runs++;
+    return true;
+}
+
+/** Create an anonymous temporary file for a run. */
+bool CreateRun(int *fd)
+{
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/mergesort-run-XXXXXX", opts.tmp_dir) >= (int) sizeof(path)) {
+        LOG_ERROR("too long temporary directory: \"%s\"", opts.tmp_dir);
+        return false;
+    }
+    *fd = mkstemp(path);
+    if (*fd == -1) {
+        LOG_ERROR("unable to create a temporary file in \"%s\"", opts.tmp_dir);
+        return false;
+    }
+    unlink(path);
+    return true;
+}
+
+/**
+ * Merge the spilled runs by groups of fan_in until they fit into
+ * a single merge, which writes the output.
+ */
+bool MergeRuns()
+{
+    if (ext.n_runs == 0) {
+        return MergeFiles();
+    }
+    while (ext.n_runs > ext.fan_in) {
+        size_t n_new = 0;
+        for (size_t first = 0; first < ext.n_runs; first += ext.fan_in) {
+            size_t n = ext.n_runs - first < ext.fan_in ? ext.n_runs - first : ext.fan_in;
+            int fd = ext.run_fds[first];
+            if (n > 1) {
+                if (!CreateRun(&fd) || !MergeRunGroup(first, n, fd)) {
+                    return false;
+                }
+                for (size_t i = first; i < first + n; i++) {
+                    close(ext.run_fds[i]);
+                    ext.run_fds[i] = -1;
+                }
+            }
+            ext.run_fds[n_new++] = fd;
+        }
+        ext.n_runs = n_new;
+        ext.n_passes++;
+    }
+    ext.n_passes++;
+    return MergeRunGroup(0, ext.n_runs, -1);
+}
+
+/**
+ * Merge runs [first, first + n) into the run @a out_fd, or into
+ * the output file when it is -1.
+ */
+bool MergeRunGroup(size_t first, size_t n, int out_fd)
+{
+    struct run_reader *readers = (struct run_reader*) calloc(n, sizeof(struct run_reader));
+    struct ltree tree;
+    if (readers == NULL || !ltree_init(&tree, n)) {
+        LOG_ERROR("unable to allocate a merge of %lu runs", n);
+        free(readers);
+        if (out_fd != -1) {
+            close(out_fd);
+        }
+        return false;
+    }
+    static const num_t empty_run[1];
+    bool is_ok = true;
+    size_t n_opened = 0;
+    for (; n_opened < n && is_ok; n_opened++) {
+        is_ok = run_reader_open(&readers[n_opened], ext.run_fds[first + n_opened], ext.block_bytes);
+        const num_t *begin = empty_run;
+        const num_t *end = empty_run;
+        if (is_ok && !run_reader_next(&readers[n_opened], &begin, &end)) {
+            is_ok = !readers[n_opened].failed;
+        }
+        ltree_set_run(&tree, n_opened, begin, (size_t) (end - begin));
+    }
+    tree.refill = RefillRun;
+    tree.refill_ctx = readers;
+    ltree_build(&tree);
+
+    if (!is_ok) {
+        LOG_ERROR("unable to read a sorted run");
+    } else if (out_fd == -1) {
+        is_ok = WriteMerged(&tree);
+    } else {
+        struct obuf spill;
+        if (!obuf_create_async(&spill, out_fd, opts.out_buf_size, opts.out_buffers)) {
+            LOG_ERROR("unable to allocate an output buffer (%lu)", opts.out_buf_size);
+            is_ok = false;
+        } else {
+            num_t value;
+            while (ltree_pop(&tree, &value)) {
+                obuf_put_raw(&spill, value);
+            }
+            is_ok = obuf_flush(&spill);
+            ext.spilled_bytes += spill.bytes_written;
+            phases.write_ns += spill.write_ns;
+            obuf_destroy(&spill);
+            if (!is_ok) {
+                LOG_ERROR("unable to spill a sorted run to \"%s\"", opts.tmp_dir);
+            }
+        }
+        ext.n_spilled_runs++;
+    }
+    for (size_t i = 0; i < n_opened; i++) {
+        if (readers[i].failed && is_ok) {
+            LOG_ERROR("unable to read a sorted run");
+            is_ok = false;
         }
+        run_reader_close(&readers[i]);
+    }
+    ltree_destroy(&tree);
+    free(readers);
+    if (!is_ok && out_fd != -1) {
+        close(out_fd);
     }
-    if (min_num_file_idx >= crt.coro_count) {
-        *coro_idx = (size_t) -1;
-        return 0;
+    return is_ok;
+}
+
+bool RefillRun(void *ctx, size_t id, const num_t **cur, const num_t **end)
+{
+    struct run_reader *readers = (struct run_reader*) ctx;
+    return run_reader_next(&readers[id], cur, end);
+}
+
+/** Write everything popped from @a tree to the output file. */
+bool WriteMerged(struct ltree *tree)
+{
+    if (!OpenOutput()) {
+        return false;
     }
-    num_t minimal = crt.coros[min_num_file_idx].numbers[crt.coros[min_num_file_idx].cur_pos];
-    for (size_t i = min_num_file_idx + 1; i < crt.coro_count; i++) {
-        if (crt.coros[i].cur_pos < crt.coros[i].numbers_size) {
-            num_t current = crt.coros[i].numbers[crt.coros[i].cur_pos];
-            if (minimal > current) {
-                min_num_file_idx = i;
-                minimal = current;
+    size_t n_merged = 0;
+    num_t value;
+    if (opts.use_aggregate) {
+        // Equal values come in a row:
+        num_t run_value = 0;
+        size_t run_size = 0;
+        while (ltree_pop(tree, &value)) {
+            if (run_size > 0 && value != run_value) {
+                PutAggregate(&output, run_value, run_size);
+                run_size = 0;
+            }
+            run_value = value;
+            run_size++;
+            n_merged++;
+        }
+        if (run_size > 0) {
+            PutAggregate(&output, run_value, run_size);
+        }
+    } else if (opts.out_format == RFMT_TEXT) {
+        while (ltree_pop(tree, &value)) {
+            obuf_put_num(&output, value);
+            n_merged++;
+        }
+    } else {
+        num_t prev = 0;
+        while (ltree_pop(tree, &value)) {
+            if (opts.out_format == RFMT_RAW) {
+                obuf_put_raw(&output, rfmt_num_to_le(value));
+            } else {
+                obuf_put_varint(&output, rfmt_delta(&prev, value));
             }
+            n_merged++;
         }
     }
-    crt.coros[min_num_file_idx].cur_pos++;
-    *coro_idx = min_num_file_idx;
-    return minimal;
+    return CloseOutput(n_merged);
+}
+
+/** Create the output file, a binary format starts with its header. */
+bool OpenOutput()
+{
+    int fd = open(O_FILE_NAME, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        LOG_ERROR("can't create an output file");
+        return false;
+    }
+    if (!obuf_create_async(&output, fd, opts.out_buf_size, opts.out_buffers)) {
+        LOG_ERROR("unable to allocate an output buffer (%lu)", opts.out_buf_size);
+        close(fd);
+        return false;
+    }
+    if (opts.out_format != RFMT_TEXT) {
+        char header[RFMT_HEADER_SIZE];
+        rfmt_make_header(opts.out_format, header);
+        obuf_put_bytes(&output, header, sizeof(header));
+    }
+    return true;
+}
+
+/** Flush and close the output, which must hold all the @a n_written numbers. */
+bool CloseOutput(size_t n_written)
+{
+    int fd = output.fd;
+    bool write_ok = obuf_flush(&output);
+    phases.write_ns += output.write_ns;
+    obuf_destroy(&output);
+    close(fd);
+    if (!write_ok) {
+        LOG_ERROR("unable to write to \"%s\"", O_FILE_NAME);
+        return false;
+    }
+    if (n_written != crt.total_n_numbers) {
+        LOG_ERROR("merged %lu numbers out of %lu", n_written, crt.total_n_numbers);
+        return false;
+    }
+    return true;
+}
+
+/** Append a "value count" line of the aggregated output. */
+void PutAggregate(struct obuf *out, num_t value, size_t count)
+{
+    obuf_put_num(out, value);
+    char tmp[OBUF_NUM_MAX_LEN];
+    char *end = tmp + sizeof(tmp);
+    *--end = '\n';
+    char *begin = obuf_utoa_rev(count, end);
+    obuf_put_bytes(out, begin, (size_t) (tmp + sizeof(tmp) - begin));
 }
 
 bool Free()
 {
-    ASSERT(crt.coros != NULL);
+    if (io.is_enabled) {
+        uring_destroy(&io.ring);
+        io.is_enabled = false;
+    }
+    for (size_t i = 0; i < ext.n_runs; i++) {
+        if (ext.run_fds[i] != -1) {
+            close(ext.run_fds[i]);
+        }
+    }
+    free(ext.run_fds);
+    free(ext.chunks);
+    ext.run_fds = NULL;
+    ext.chunks = NULL;
+    ext.n_runs = 0;
+    free(profile.coros);
+    profile.coros = NULL;
+    free(input_files);
+    input_files = NULL;
+    free(early.ready);
+    early.ready = NULL;
+    free(io.aio_waiters);
+    io.aio_waiters = NULL;
+    free(io.aio_list);
+    io.aio_list = NULL;
+    sort_hist_destroy(&hmerge.total);
+    if (profile.is_enabled) {
+        coro_phase_sampler = NULL;
+        ClosePerfEvents(&perf_events);
+        if (profile.has_perf_key) {
+            pthread_key_delete(profile.perf_key);
+            profile.has_perf_key = false;
+        }
+    }
+    if (crt.coros == NULL) {
+        coro_destroy();
+        return true;
+    }
+    if (opts.memory_limit != 0) {
+        // The last batch may be narrower than the allocated coroutines:
+        crt.coro_count = ext.batch_width;
+    }
     for (size_t i = 0; i < crt.coro_count; i++) {
-        free(crt.coros[i].numbers);
+        FreeNumbers(crt.coros[i].numbers, crt.coros[i].numbers_capacity);
+        free(crt.coros[i].merge_dst);
+        free(crt.coros[i].radix_tmp);
+        free(crt.coros[i].radix);
+        sort_hist_destroy(&crt.coros[i].hist);
         free(crt.coros[i].stack);
+        if (opts.input_mode == INPUT_MMAP) {
+            UnmapInput(&crt.coros[i]);
+        }
         free((char*) crt.coros[i].aio_control.aio_buf);
         crt.coros[i].numbers = NULL;
         crt.coros[i].stack = NULL;
         crt.coros[i].aio_control.aio_buf = NULL;
         // It is implied that descriptors are already destroyed:
-        ASSERT(crt.coros[i].aio_control.aio_fildes == -1);
+        if (crt.coros[i].aio_control.aio_fildes != -1) {
+            close(crt.coros[i].aio_control.aio_fildes);
+        }
     }
 
     free(crt.coros);
     crt.coros = NULL;
+    arena_destroy(&memory.arena);
+    coro_destroy();
     return true;
 }
 
@@ -423,15 +3112,222 @@ void PrintStatistics(clock_t dif_sort, clock_t dif_merge)
     clock_t clocks_per_usec = CLOCKS_PER_SEC / 1000000;
     ASSERT(clocks_per_usec != (clock_t) 0);
     size_t sum_us = 0;
+    size_t parse_bytes = 0;
+    long long parse_ns = 0;
     for (size_t i = 0; i < crt.coro_count; i++) {
-        size_t us = (size_t) (crt.coros[i].clocks_spent / clocks_per_usec);
+        size_t us = (size_t) (coro_ticks_to_ns(crt.coros[i].ticks_spent) / 1000);
+        size_t switches = crt.coros[i].switch_count;
         sum_us += us;
-        printf("--id = %2lu:\t%lu us\n", i, us);
+        printf("--id = %2lu:\t%lu us\t(switches: %lu, avg quantum: %lu us)", i, us, switches,
+               us / (switches + 1));
+        static const char *const engine_names[] = {"auto", "quick", "intro", "radix", "count"};
+        printf("\t(sort: %s%s)", engine_names[crt.coros[i].engine],
+               crt.coros[i].is_narrow ? " of 32-bit keys" : "");
+        if (crt.coros[i].parse_ns > 0) {
+            printf("\t(parse: %.1f MB/s)", (double) crt.coros[i].aio_control.aio_nbytes * 1e3 /
+                                           (double) crt.coros[i].parse_ns);
+        }
+        printf("\n");
+        parse_bytes += crt.coros[i].aio_control.aio_nbytes;
+        parse_ns += crt.coros[i].parse_ns;
+    }
+    printf("Sum: %lu\t(quantum: %lu us)\n", sum_us, opts.quantum_us);
+    if (parse_ns > 0) {
+        printf("Parse speed:\t%.1f MB/s (%lu bytes)\n", (double) parse_bytes * 1e3 / (double) parse_ns,
+               parse_bytes);
     }
-    printf("Sum: %lu\n", sum_us);
     size_t dif_sort_us = (size_t) (dif_sort / clocks_per_usec);
     size_t dif_merge_us = (size_t) (dif_merge / clocks_per_usec);
     
-    printf("\nTotal time spent:\t%lu us + %lu us\n(sort in coroutines + time to merge)\n\n",
+#ifdef CORO_BACKEND_STACK
+    for (size_t i = 0; i < crt.n_workers; i++) {
+        const struct coro_worker *w = &crt.workers[i];
+        printf("--worker %2lu:\t%5.1f%% busy (%lu of %lu us, %lu steals, %lu sleeps, %lu blocking polls)\n", i,
+               w->wall_ticks > 0 ? 100.0 * (double) w->busy_ticks / (double) w->wall_ticks : 0.0,
+               (size_t) (coro_ticks_to_ns(w->busy_ticks) / 1000),
+               (size_t) (coro_ticks_to_ns(w->wall_ticks) / 1000), w->n_steals, w->n_sleeps,
+               w->n_idle_waits);
+    }
+#endif  // CORO_BACKEND_STACK
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    static const char *const input_mode_names[] = {"aio", "mmap", "io_uring"};
+    printf("Input:\t\t\t%s%s, %s keys, %lu bytes, %lu us to load (summed over files), "
+           "%ld minor + %ld major faults\n",
+           input_mode_names[opts.input_mode], io.is_unavailable ? " (io_uring is unavailable)" : "",
+           num_kind_names[NUM_KIND], input.bytes, (size_t) (input.load_ns / 1000), usage.ru_minflt, usage.ru_majflt);
+    printf("Memory:\t\t\tpeak RSS %ld KB", usage.ru_maxrss);
+    if (memory.arena.base != NULL) {
+        printf(", numbers arena of %lu bytes%s", memory.arena.size,
+               memory.arena.has_huge_pages ? " in huge pages" : "");
+    }
+    if (memory.released_bytes > 0) {
+        printf(", %lu input bytes freed after parsing", (size_t) memory.released_bytes);
+    }
+    printf("\n");
+    if (opts.input_mode == INPUT_URING) {
+        printf("io_uring:\t\t%lu reads of <= %d bytes into %s buffers, %lu waits in the kernel\n",
+               io.n_reads, URING_READ_CHUNK, io.has_fixed_buffers ? "registered" : "plain",
+               io.n_kernel_waits);
+    } else if (opts.input_mode == INPUT_AIO) {
+        printf("aio:\t\t\t%lu waits in aio_suspend()\n", io.n_kernel_waits);
+    }
+#ifndef CORO_BACKEND_STACK
+    printf("Scheduler:\t\tready queue, %lu times idle until a parked coroutine was woken\n",
+           crt.n_idle_waits);
+#endif  // CORO_BACKEND_STACK
+    if (opts.memory_limit != 0) {
+        printf("External sort:\t\t%lu chunks of <= %lu bytes in %lu batches, %lu runs spilled "
+               "(%lu bytes), %lu merge passes (fan-in %lu, limit = %lu bytes)\n",
+               ext.n_chunks, ext.chunk_bytes, ext.n_batches, ext.n_spilled_runs,
+               ext.spilled_bytes, ext.n_passes, ext.fan_in, opts.memory_limit);
+    }
+    if (early.n_merges > 0) {
+        printf("Early merges:\t\t%lu (%lu numbers), %lu of %lu runs left to the final merge\n",
+               (size_t) early.n_merges, (size_t) early.n_numbers, early.n_ready, crt.coro_count);
+    }
+    printf("Phases (us):\t\tread=%lld\tparse=%lld\tsort=%lld\tmerge=%lld\twrite=%lld\n",
+           phases.read_ns / 1000, phases.parse_ns / 1000, phases.sort_ns / 1000,
+           phases.merge_ns / 1000, phases.write_ns / 1000);
+    PrintProfile();
+    printf("\nTotal time spent:\t%lu us + %lu us\n(sort in coroutines + time to merge)\n",
            dif_sort_us, dif_merge_us);
+    // Wall time: the CPU time of a parallel merge is summed over its threads.
+    double merge_sec = (double) phases.merge_ns / 1e9;
+    if (merge_sec > 0) {
+        printf("Merge throughput:\t%.0f numbers/s (%lu numbers from %lu runs)\n",
+               (double) crt.total_n_numbers / merge_sec, crt.total_n_numbers, crt.coro_count);
+    } else {
+        printf("Merge throughput:\tn/a (%lu numbers from %lu runs)\n",
+               crt.total_n_numbers, crt.coro_count);
+    }
+    if (hmerge.n_histograms > 0) {
+        printf("Histogram merge:\t%lu histograms summed into %lu buckets\n",
+               hmerge.n_histograms, hmerge.total.size);
+    } else if (hmerge.n_expanded > 0) {
+        printf("Histogram merge:\tnone, %lu histograms expanded into runs\n", hmerge.n_expanded);
+    }
+    if (pmerge.n_slices > 1) {
+        printf("Parallel merge:\t\t%lu slices, %lld us to split, %lld us to measure\n",
+               pmerge.n_slices, pmerge.split_ns / 1000, pmerge.measure_ns / 1000);
+    }
+    double write_sec = (double) output.write_ns / 1e9;
+    printf("Output:\t\t\t%lu bytes of %s%s in %lu writes (buffer = %lu bytes)", output.bytes_written,
+           format_names[opts.out_format], opts.use_aggregate ? " value counts" : "", output.n_writes,
+           opts.out_buf_size);
+    if (opts.out_buffers > 1) {
+        // The writes overlap with the merge, only the stalls are seen:
+        printf(", %lld us stalled on %lu buffers\n\n", output.write_ns / 1000, opts.out_buffers);
+    } else if (write_sec > 0) {
+        printf(", %.1f MB/s\n\n", (double) output.bytes_written / write_sec / 1e6);
+    } else {
+        printf("\n\n");
+    }
+}
+
+/** Append the sampled counters to a line of the profile. */
+void PrintCounters(const uint64_t *counters)
+{
+    if (!profile.is_enabled) {
+        return;
+    }
+    printf(", cpu %lu us", (size_t) (counters[COUNTER_CPU_NS] / 1000));
+    if (opts.use_perf && !profile.is_perf_unavailable) {
+        for (size_t k = COUNTER_CYCLES; k < COUNTER_COUNT; k++) {
+            printf(", %lu %s", (size_t) counters[k], counter_names[k]);
+        }
+    }
+}
+
+/**
+ * Print the phases of the coroutines summed over all of them. Wall
+ * time is counted from the start of a phase to its end, busy time
+ * only while the coroutine was scheduled.
+ */
+void PrintProfile()
+{
+    struct coro_phases sum;
+    memset(&sum, 0, sizeof(sum));
+    for (size_t i = 0; i < profile.n_coros; i++) {
+        coro_phases_add(&sum, &profile.coros[i]);
+    }
+    for (size_t p = 0; p < PHASE_COUNT; p++) {
+        printf("--phase %-6s\twall %lu us, busy %lu us, %lu switches", phase_names[p],
+               (size_t) (coro_ticks_to_ns(sum.wall[p]) / 1000),
+               (size_t) (coro_ticks_to_ns(sum.busy[p]) / 1000), sum.switches[p]);
+        PrintCounters(sum.counters[p]);
+        printf("\n");
+    }
+    printf("--phase %-6s\twall %lld us, of them %lld us in write()", "merge",
+           phases.merge_ns / 1000, phases.write_ns / 1000);
+    PrintCounters(profile.merge_counters);
+    printf("\n");
+    if (opts.use_perf && profile.is_perf_unavailable) {
+        printf("Hardware counters are unavailable (perf_event_open failed)\n");
+    }
+}
+
+/** Write the counters of a phase as members of a JSON object. */
+void WriteCountersJson(FILE *f, const uint64_t *counters)
+{
+    fprintf(f, ", \"cpu_us\": %lu", (size_t) (counters[COUNTER_CPU_NS] / 1000));
+    if (opts.use_perf && !profile.is_perf_unavailable) {
+        for (size_t k = COUNTER_CYCLES; k < COUNTER_COUNT; k++) {
+            fprintf(f, ", \"%s\": %lu", counter_names[k], (size_t) counters[k]);
+        }
+    }
+}
+
+/**
+ * Export the profile for dashboards: the global phases, then each
+ * coroutine with its phases. Times are in microseconds.
+ */
+bool WriteStatsJson(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        LOG_ERROR("unable to create \"%s\"", path);
+        return false;
+    }
+    static const char *const input_mode_names[] = {"aio", "mmap", "io_uring"};
+#ifdef CORO_BACKEND_STACK
+    const char *backend = "stack";
+#else
+    const char *backend = "jmp";
+#endif  // CORO_BACKEND_STACK
+    fprintf(f, "{\n  \"backend\": \"%s\", \"input\": \"%s\", \"keys\": \"%s\", \"workers\": %lu, "
+            "\"quantum_us\": %lu, \"numbers\": %lu, \"bytes\": %lu, \"batches\": %lu,\n",
+            backend, input_mode_names[opts.input_mode], num_kind_names[NUM_KIND], opts.n_workers, opts.quantum_us,
+            (size_t) crt.total_n_numbers, input.bytes, opts.memory_limit != 0 ? ext.n_batches : 1);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(f, "  \"perf\": %s, \"peak_rss_kb\": %ld,\n",
+            opts.use_perf && !profile.is_perf_unavailable ? "true" : "false", usage.ru_maxrss);
+    fprintf(f, "  \"phases_us\": {\"read\": %lld, \"parse\": %lld, \"sort\": %lld, "
+            "\"merge\": %lld, \"write\": %lld},\n",
+            phases.read_ns / 1000, phases.parse_ns / 1000, phases.sort_ns / 1000,
+            phases.merge_ns / 1000, phases.write_ns / 1000);
+    fprintf(f, "  \"merge\": {\"wall_us\": %lld, \"write_us\": %lld, \"histograms\": %lu",
+            phases.merge_ns / 1000, phases.write_ns / 1000, hmerge.n_histograms);
+    WriteCountersJson(f, profile.merge_counters);
+    fprintf(f, "},\n  \"coroutines\": [");
+    for (size_t i = 0; i < profile.n_coros; i++) {
+        const struct coro_phases *cp = &profile.coros[i];
+        fprintf(f, "%s\n    {\"id\": %lu, \"phases\": {", i > 0 ? "," : "", i);
+        for (size_t p = 0; p < PHASE_COUNT; p++) {
+            fprintf(f, "%s\n      \"%s\": {\"wall_us\": %lu, \"busy_us\": %lu, \"switches\": %lu",
+                    p > 0 ? "," : "", phase_names[p],
+                    (size_t) (coro_ticks_to_ns(cp->wall[p]) / 1000),
+                    (size_t) (coro_ticks_to_ns(cp->busy[p]) / 1000), cp->switches[p]);
+            WriteCountersJson(f, cp->counters[p]);
+            fprintf(f, "}");
+        }
+        fprintf(f, "}}");
+    }
+    fprintf(f, "\n  ]\n}\n");
+    if (fclose(f) != 0) {
+        LOG_ERROR("unable to write \"%s\"", path);
+        return false;
+    }
+    return true;
 }
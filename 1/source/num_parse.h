@@ -0,0 +1,260 @@
+#ifndef NUM_PARSE_H
+#define NUM_PARSE_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif  // __SSE2__
+
+/**
+ * Decimal integer parser over a memory buffer. It replaces
+ * strtol(): the buffer is given by [pos, end), so no terminating
+ * '\0' is needed, and digits are consumed 8 at a time with SWAR
+ * arithmetic. Long whitespace gaps are skipped 16 bytes at a time
+ * with SSE2 when it is available, otherwise byte by byte.
+ *
+ * Accepted grammar: whitespace separated tokens of the form
+ * [+-]?[0-9]+, a minus is only taken by signed types. A floating
+ * point num_t takes anything strtod() does but NaN, plain integers
+ * still go the fast way. num_t is expected to be defined by
+ * num_type.h before this header.
+ */
+
+enum {
+    /** Longer floating point tokens are rejected. */
+    NPARSE_FLOAT_MAX_LEN = 64,
+};
+
+enum nparse_status {
+    /** Parsed as many numbers as was asked. */
+    NPARSE_OK,
+    /** Reached the end of the buffer. */
+    NPARSE_EOF,
+    /** A symbol which can not be a part of a number. */
+    NPARSE_UNKNOWN_SYMBOL,
+    /** A number does not fit into num_t. */
+    NPARSE_OVERFLOW,
+};
+
+static inline bool
+nparse_is_space(char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline const char*
+nparse_skip_spaces(const char *pos, const char *end)
+{
+    /* The common case is a single separator, check it cheaply first. */
+    const char *scalar_end = end - pos > 16 ? pos + 16 : end;
+    while (pos < scalar_end && nparse_is_space(*pos)) {
+        pos++;
+    }
+    if (pos < scalar_end || pos == end) {
+        return pos;
+    }
+#ifdef __SSE2__
+    while (end - pos >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) pos);
+        __m128i sp = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+        /* '\t'..'\r' <=> (c - '\t') < 5 unsigned, via a signed compare after a bias. */
+        __m128i ctl = _mm_cmplt_epi8(_mm_add_epi8(v, _mm_set1_epi8((char) (0x80 - '\t'))),
+                                     _mm_set1_epi8((char) (0x80 + 5)));
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_or_si128(sp, ctl));
+        if (mask != 0xFFFF) {
+            return pos + __builtin_ctz(~mask);
+        }
+        pos += 16;
+    }
+#endif  // __SSE2__
+    while (pos < end && nparse_is_space(*pos)) {
+        pos++;
+    }
+    return pos;
+}
+
+/** Load up to 8 bytes, the missing ones are zero. */
+static inline uint64_t
+nparse_load8(const char *pos, const char *end)
+{
+    uint64_t word = 0;
+    size_t n = (size_t) (end - pos) < 8 ? (size_t) (end - pos) : 8;
+    memcpy(&word, pos, n);
+    return word;
+}
+
+/** Number of leading decimal digits in a little-endian word. */
+static inline unsigned
+nparse_digit_count8(uint64_t word)
+{
+    uint64_t x = word - 0x3030303030303030ULL;
+    uint64_t non_digit = (x | (x + 0x7676767676767676ULL)) & 0x8080808080808080ULL;
+    return non_digit == 0 ? 8 : (unsigned) __builtin_ctzll(non_digit) / 8;
+}
+
+/** Convert the first @a n (1..8) digit characters of a word. */
+static inline uint64_t
+nparse_convert8(uint64_t word, unsigned n)
+{
+    uint64_t d = (word - 0x3030303030303030ULL) << ((8 - n) * 8);
+    d = (d * 10) + (d >> 8);
+    d = (((d & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+         (((d >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+    return d;
+}
+
+static const uint64_t nparse_pow10[9] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000
+};
+
+#if NUM_IS_FLOAT
+/** Parse a floating point token with strtod() from a bounded copy. */
+static inline enum nparse_status
+nparse_float(const char **ppos, const char *end, num_t *out)
+{
+    const char *pos = *ppos;
+    size_t len = 0;
+    while (pos + len < end && !nparse_is_space(pos[len])) {
+        if (++len >= NPARSE_FLOAT_MAX_LEN) {
+            return NPARSE_UNKNOWN_SYMBOL;
+        }
+    }
+    char token[NPARSE_FLOAT_MAX_LEN];
+    memcpy(token, pos, len);
+    token[len] = '\0';
+    char *token_end;
+    double value = strtod(token, &token_end);
+    if (token_end == token || isnan(value)) {
+        return NPARSE_UNKNOWN_SYMBOL;
+    }
+    if ((size_t) (token_end - token) != len) {
+        *ppos = pos + (token_end - token);
+        return NPARSE_UNKNOWN_SYMBOL;
+    }
+    *out = value;
+    *ppos = pos + len;
+    return NPARSE_OK;
+}
+#endif  // NUM_IS_FLOAT
+
+/**
+ * Parse one token starting at a non-space symbol. On success the
+ * position is moved past the token.
+ */
+static inline enum nparse_status
+nparse_one(const char **ppos, const char *end, num_t *out)
+{
+    const char *pos = *ppos;
+    bool negative = false;
+    if (*pos == '-' || *pos == '+') {
+        negative = *pos == '-';
+        pos++;
+    }
+    if (pos == end || (unsigned char) (*pos - '0') > 9) {
+#if NUM_IS_FLOAT
+        return nparse_float(ppos, end, out);
+#else
+        /* Point at the beginning of the token, like strtol() does. */
+        return NPARSE_UNKNOWN_SYMBOL;
+#endif  // NUM_IS_FLOAT
+    }
+    while (pos < end - 1 && *pos == '0' && (unsigned char) (pos[1] - '0') <= 9) {
+        pos++;
+    }
+    uint64_t acc = 0;
+    unsigned n_digits = 0;
+    while (true) {
+        uint64_t word = nparse_load8(pos, end);
+        unsigned n = nparse_digit_count8(word);
+        if ((size_t) (end - pos) < n) {
+            n = (unsigned) (end - pos);
+        }
+        if (n == 0) {
+            break;
+        }
+        n_digits += n;
+        /* Up to 19 digits always fit, the 20th one is checked: */
+        if (n_digits > 20 || (n_digits > 19 &&
+            (__builtin_mul_overflow(acc, nparse_pow10[n], &acc) ||
+             __builtin_add_overflow(acc, nparse_convert8(word, n), &acc)))) {
+#if NUM_IS_FLOAT
+            return nparse_float(ppos, end, out);
+#else
+            *ppos = pos;
+            return NPARSE_OVERFLOW;
+#endif  // NUM_IS_FLOAT
+        }
+        if (n_digits <= 19) {
+            acc = acc * nparse_pow10[n] + nparse_convert8(word, n);
+        }
+        pos += n;
+        if (n < 8) {
+            break;
+        }
+    }
+    if (pos < end && !nparse_is_space(*pos)) {
+#if NUM_IS_FLOAT
+        return nparse_float(ppos, end, out);
+#else
+        *ppos = pos;
+        return NPARSE_UNKNOWN_SYMBOL;
+#endif  // NUM_IS_FLOAT
+    }
+#if NUM_IS_FLOAT
+    *out = negative ? -(num_t) acc : (num_t) acc;
+#else
+#if NUM_IS_SIGNED
+    uint64_t limit = NUM_MAX_MAGNITUDE + (negative ? 1 : 0);
+#else
+    uint64_t limit = negative ? 0 : NUM_MAX_MAGNITUDE;
+#endif  // NUM_IS_SIGNED
+    if (acc > limit) {
+        *ppos = pos;
+        return NPARSE_OVERFLOW;
+    }
+    *out = negative ? (num_t) (0 - acc) : (num_t) acc;
+#endif  // NUM_IS_FLOAT
+    *ppos = pos;
+    return NPARSE_OK;
+}
+
+/**
+ * Parse at most @a max numbers from [*ppos, end) into @a out. The
+ * number of parsed ones is returned via @a count. On an error
+ * *ppos points at the problematic symbol.
+ */
+static inline enum nparse_status
+nparse_numbers(const char **ppos, const char *end, num_t *out, size_t max, size_t *count)
+{
+    const char *pos = *ppos;
+    size_t n = 0;
+    enum nparse_status status = NPARSE_OK;
+    while (n < max) {
+        pos = nparse_skip_spaces(pos, end);
+        if (pos == end) {
+            status = NPARSE_EOF;
+            break;
+        }
+        status = nparse_one(&pos, end, &out[n]);
+        if (status != NPARSE_OK) {
+            break;
+        }
+        n++;
+    }
+    if (n == max && status == NPARSE_OK) {
+        pos = nparse_skip_spaces(pos, end);
+        if (pos == end) {
+            status = NPARSE_EOF;
+        }
+    }
+    *ppos = pos;
+    *count = n;
+    return status;
+}
+
+#endif  // NUM_PARSE_H
@@ -0,0 +1,125 @@
+#ifndef NUM_TYPE_H
+#define NUM_TYPE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * The key type of the numbers, chosen at compile time:
+ *
+ *   NUM_TYPE_INT64  - long int, the default;
+ *   NUM_TYPE_INT32  - half the memory traffic of parsing, sorting
+ *                     and merging when all the values fit;
+ *   NUM_TYPE_UINT64 - non-negative values up to 2^64 - 1;
+ *   NUM_TYPE_DOUBLE - decimal or scientific floating point values,
+ *                     NaN is not accepted, as it has no order.
+ *
+ * The parser, the sort engines, the merge and the formats are
+ * written over num_t and the helpers below, so each build is a
+ * specialization for one type:
+ *
+ *
+ * gcc -DNUM_TYPE_INT32 mergesort.c
+ *
+ *
+ * num_key() maps a value to an unsigned 64-bit key of the same
+ * order, radix sorts and bisections over the values work on keys.
+ * num_bits() gives the bits of a value stored by the binary formats.
+ */
+
+/** Kept in a binary file header, so a file of another type is not misread. */
+enum num_kind {
+    NUM_KIND_INT64,
+    NUM_KIND_INT32,
+    NUM_KIND_UINT64,
+    NUM_KIND_DOUBLE,
+};
+
+static const char *const num_kind_names[] = {"int64", "int32", "uint64", "double"};
+
+#if defined(NUM_TYPE_INT32)
+typedef int32_t num_t;
+#define NUM_KIND NUM_KIND_INT32
+#define NUM_IS_SIGNED 1
+#define NUM_IS_FLOAT 0
+#define NUM_MAX_MAGNITUDE ((uint64_t) INT32_MAX)
+#elif defined(NUM_TYPE_UINT64)
+typedef uint64_t num_t;
+#define NUM_KIND NUM_KIND_UINT64
+#define NUM_IS_SIGNED 0
+#define NUM_IS_FLOAT 0
+#define NUM_MAX_MAGNITUDE UINT64_MAX
+#elif defined(NUM_TYPE_DOUBLE)
+typedef double num_t;
+#define NUM_KIND NUM_KIND_DOUBLE
+#define NUM_IS_SIGNED 1
+#define NUM_IS_FLOAT 1
+#else
+typedef long int num_t;
+#define NUM_KIND NUM_KIND_INT64
+#define NUM_IS_SIGNED 1
+#define NUM_IS_FLOAT 0
+#define NUM_MAX_MAGNITUDE ((uint64_t) INT64_MAX)
+#endif
+
+#define NUM_SIGN_BIT (1ULL << 63)
+
+static inline uint64_t
+num_key(num_t value)
+{
+#if NUM_IS_FLOAT
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    /* Negative values are ordered backwards by their bits. */
+    return (bits & NUM_SIGN_BIT) != 0 ? ~bits : bits | NUM_SIGN_BIT;
+#elif NUM_IS_SIGNED
+    return (uint64_t) (int64_t) value ^ NUM_SIGN_BIT;
+#else
+    return (uint64_t) value;
+#endif
+}
+
+static inline num_t
+num_from_key(uint64_t key)
+{
+#if NUM_IS_FLOAT
+    uint64_t bits = (key & NUM_SIGN_BIT) != 0 ? key & ~NUM_SIGN_BIT : ~key;
+    num_t value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+#elif NUM_IS_SIGNED
+    return (num_t) (int64_t) (key ^ NUM_SIGN_BIT);
+#else
+    return (num_t) key;
+#endif
+}
+
+/** Bits of a value in the binary formats, integers are sign-extended. */
+static inline uint64_t
+num_bits(num_t value)
+{
+#if NUM_IS_FLOAT
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+#elif NUM_IS_SIGNED
+    return (uint64_t) (int64_t) value;
+#else
+    return (uint64_t) value;
+#endif
+}
+
+static inline num_t
+num_from_bits(uint64_t bits)
+{
+#if NUM_IS_FLOAT
+    num_t value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+#else
+    return (num_t) bits;
+#endif
+}
+
+#endif  // NUM_TYPE_H
@@ -0,0 +1,466 @@
+#ifndef OUT_BUF_H
+#define OUT_BUF_H
+
+#include <aio.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Buffered output writer. Numbers are formatted straight into one
+ * reusable buffer, which is flushed with big write() calls when it
+ * fills up. No allocations are done after obuf_create(). Possible
+ * example of usage:
+ *
+ *
+ * struct obuf out;
+ * obuf_create(&out, fd, 1 << 20);
+ * foreach (value : values)
+ *     obuf_put_num(&out, value);
+ * obuf_flush(&out);
+ * obuf_destroy(&out);
+ *
+ *
+ * obuf_create_async() makes a writer with several buffers instead:
+ * a full buffer is handed to aio_write() and the next one is filled
+ * meanwhile, so formatting overlaps with the disk. Then obuf_flush()
+ * waits for all the writes. obuf_create_at() makes a writer of a
+ * range of the file, several of them fill one file in parallel.
+ *
+ * num_t is expected to be defined by num_type.h before this header.
+ */
+
+enum {
+    /**
+     * Longest decimal num_t with a sign and a separator, a double
+     * in the exponent form is the longest one.
+     */
+    OBUF_NUM_MAX_LEN = 32,
+    OBUF_VARINT_MAX_LEN = 10,
+    OBUF_BUFFERS_MAX = 8,
+    OBUF_SIZE_DEFAULT = 1 << 20,
+};
+
+struct obuf {
+    int fd;
+    char *data;
+    size_t size;
+    size_t capacity;
+
+    /** Set when a write failed, the rest of the output is dropped. */
+    bool failed;
+
+    /** Asynchronous mode, n_buffers > 1: data is buffers[current]. */
+    struct {
+        size_t n_buffers;
+        size_t current;
+        char *buffers[OBUF_BUFFERS_MAX];
+        struct aiocb requests[OBUF_BUFFERS_MAX];
+        bool is_pending[OBUF_BUFFERS_MAX];
+        /** Where the next buffer goes in the file. */
+        off_t offset;
+        /** Writes go to offset, the file position is never used. */
+        bool is_positioned;
+    };
+
+    /** Statistics, used to tune the buffer size. */
+    struct {
+        size_t bytes_written;
+        size_t n_writes;
+        /**
+         * Wall time spent inside write(), or waiting for a buffer
+         * to be written in the asynchronous mode.
+         */
+        long long write_ns;
+    };
+};
+
+static const char obuf_digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static inline long long
+obuf_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline bool
+obuf_create(struct obuf *b, int fd, size_t capacity)
+{
+    memset(b, 0, sizeof(*b));
+    if (capacity < OBUF_NUM_MAX_LEN) {
+        capacity = OBUF_NUM_MAX_LEN;
+    }
+    b->data = (char*) malloc(capacity);
+    if (b->data == NULL) {
+        return false;
+    }
+    b->fd = fd;
+    b->capacity = capacity;
+    b->n_buffers = 1;
+    b->buffers[0] = b->data;
+    return true;
+}
+
+/**
+ * Create a writer with @a n_buffers buffers written in turn with
+ * aio_write(), starting at the current position of @a fd. One
+ * buffer makes a plain synchronous writer.
+ */
+static inline bool
+obuf_create_async(struct obuf *b, int fd, size_t capacity, size_t n_buffers)
+{
+    if (n_buffers > OBUF_BUFFERS_MAX) {
+        n_buffers = OBUF_BUFFERS_MAX;
+    }
+    if (!obuf_create(b, fd, capacity)) {
+        return false;
+    }
+    if (n_buffers <= 1) {
+        return true;
+    }
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    b->offset = offset > 0 ? offset : 0;
+    for (; b->n_buffers < n_buffers; b->n_buffers++) {
+        b->buffers[b->n_buffers] = (char*) malloc(b->capacity);
+        if (b->buffers[b->n_buffers] == NULL) {
+            break;
+        }
+    }
+    return true;
+}
+
+/**
+ * Create a writer of the file range which starts at @a offset. It
+ * writes with pwrite() or aio_write() and leaves the file position
+ * alone, so the other ranges may be written meanwhile.
+ */
+static inline bool
+obuf_create_at(struct obuf *b, int fd, size_t capacity, size_t n_buffers, off_t offset)
+{
+    if (!obuf_create_async(b, fd, capacity, n_buffers)) {
+        return false;
+    }
+    b->offset = offset;
+    b->is_positioned = true;
+    return true;
+}
+
+/** Write @a size bytes at @a offset, or at the file position if it is -1. */
+static inline bool
+obuf_write_all(struct obuf *b, const char *data, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t rc = offset < 0 ? write(b->fd, data + done, size - done)
+                                : pwrite(b->fd, data + done, size - done, offset + (off_t) done);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            b->failed = true;
+            break;
+        }
+        done += (size_t) rc;
+        b->n_writes++;
+    }
+    b->bytes_written += done;
+    return !b->failed;
+}
+
+/** Wait for the write of buffer @a i, finish it if it was short. */
+static inline void
+obuf_wait(struct obuf *b, size_t i)
+{
+    if (!b->is_pending[i]) {
+        return;
+    }
+    long long start = obuf_now_ns();
+    struct aiocb *req = &b->requests[i];
+    const struct aiocb *list[1] = {req};
+    while (aio_error(req) == EINPROGRESS) {
+        aio_suspend(list, 1, NULL);
+    }
+    b->is_pending[i] = false;
+    ssize_t rc = aio_return(req);
+    if (rc < 0) {
+        b->failed = true;
+    } else {
+        b->bytes_written += (size_t) rc;
+        if ((size_t) rc < req->aio_nbytes && !b->failed) {
+            obuf_write_all(b, (const char*) req->aio_buf + rc, req->aio_nbytes - (size_t) rc,
+                           req->aio_offset + rc);
+        }
+    }
+    b->write_ns += obuf_now_ns() - start;
+}
+
+/**
+ * Hand the filled buffer over: write it synchronously, or submit it
+ * and continue in the next buffer once that one is written.
+ */
+static inline void
+obuf_spill(struct obuf *b)
+{
+    if (b->size == 0 || b->failed) {
+        b->size = 0;
+        return;
+    }
+    if (b->n_buffers <= 1) {
+        long long start = obuf_now_ns();
+        obuf_write_all(b, b->data, b->size, b->is_positioned ? b->offset : -1);
+        b->write_ns += obuf_now_ns() - start;
+        b->offset += (off_t) b->size;
+        b->size = 0;
+        return;
+    }
+    struct aiocb *req = &b->requests[b->current];
+    memset(req, 0, sizeof(*req));
+    req->aio_fildes = b->fd;
+    req->aio_buf = b->data;
+    req->aio_nbytes = b->size;
+    req->aio_offset = b->offset;
+    b->offset += (off_t) b->size;
+    if (aio_write(req) == 0) {
+        b->is_pending[b->current] = true;
+        b->n_writes++;
+    } else {
+        long long start = obuf_now_ns();
+        obuf_write_all(b, b->data, b->size, req->aio_offset);
+        b->write_ns += obuf_now_ns() - start;
+    }
+    b->current = (b->current + 1) % b->n_buffers;
+    obuf_wait(b, b->current);
+    b->data = b->buffers[b->current];
+    b->size = 0;
+}
+
+/** Write out everything buffered, and wait for all the writes. */
+static inline bool
+obuf_flush(struct obuf *b)
+{
+    obuf_spill(b);
+    if (b->n_buffers > 1) {
+        for (size_t i = 0; i < b->n_buffers; i++) {
+            obuf_wait(b, i);
+        }
+        if (!b->is_positioned) {
+            // Like after write(): the position is at the end of the data.
+            lseek(b->fd, b->offset, SEEK_SET);
+        }
+    }
+    return !b->failed;
+}
+
+/**
+ * Format an unsigned value backwards, ending right before @a end.
+ * Returns the position of the first digit.
+ */
+static inline char*
+obuf_utoa_rev(unsigned long long v, char *end)
+{
+    while (v >= 100) {
+        unsigned idx = (unsigned) (v % 100) * 2;
+        v /= 100;
+        *--end = obuf_digit_pairs[idx + 1];
+        *--end = obuf_digit_pairs[idx];
+    }
+    if (v >= 10) {
+        unsigned idx = (unsigned) v * 2;
+        *--end = obuf_digit_pairs[idx + 1];
+        *--end = obuf_digit_pairs[idx];
+    } else {
+        *--end = (char) ('0' + v);
+    }
+    return end;
+}
+
+#if NUM_IS_FLOAT
+/** Doubles which are integers are printed as integers up to that. */
+#define OBUF_FLOAT_EXACT_INT 9007199254740992.0
+#endif  // NUM_IS_FLOAT
+
+/**
+ * Format @a value with a space after it backwards, ending right
+ * before @a end, which has OBUF_NUM_MAX_LEN bytes before it.
+ * Returns the position of the first symbol. A double which is not a
+ * small integer takes the fewest of 15 or 17 significant digits
+ * which read back the same.
+ */
+static inline char*
+obuf_format_num(num_t value, char *end)
+{
+    *--end = ' ';
+#if NUM_IS_FLOAT
+    num_t abs_value = value < 0 ? -value : value;
+    if (!(abs_value < OBUF_FLOAT_EXACT_INT && abs_value == (num_t) (unsigned long long) abs_value)) {
+        char tmp[OBUF_NUM_MAX_LEN];
+        int len = snprintf(tmp, sizeof(tmp), "%.15g", value);
+        if (strtod(tmp, NULL) != value) {
+            len = snprintf(tmp, sizeof(tmp), "%.17g", value);
+        }
+        end -= len;
+        memcpy(end, tmp, (size_t) len);
+        return end;
+    }
+    unsigned long long mag = (unsigned long long) abs_value;
+    bool is_negative = value < 0;
+#elif NUM_IS_SIGNED
+    unsigned long long mag = value < 0 ? 0ULL - (unsigned long long) value
+                                       : (unsigned long long) value;
+    bool is_negative = value < 0;
+#else
+    unsigned long long mag = (unsigned long long) value;
+    bool is_negative = false;
+#endif  // NUM_IS_FLOAT
+    char *begin = obuf_utoa_rev(mag, end);
+    if (is_negative) {
+        *--begin = '-';
+    }
+    return begin;
+}
+
+/** Bytes taken by obuf_put_num(@a value). */
+static inline size_t
+obuf_num_len(num_t value)
+{
+#if NUM_IS_FLOAT
+    char tmp[OBUF_NUM_MAX_LEN];
+    return (size_t) (tmp + sizeof(tmp) - obuf_format_num(value, tmp + sizeof(tmp)));
+#else
+#if NUM_IS_SIGNED
+    unsigned long long mag = value < 0 ? 0ULL - (unsigned long long) value
+                                       : (unsigned long long) value;
+    size_t len = value < 0 ? 3 : 2;
+#else
+    unsigned long long mag = (unsigned long long) value;
+    size_t len = 2;
+#endif  // NUM_IS_SIGNED
+    while (mag >= 10000) {
+        mag /= 10000;
+        len += 4;
+    }
+    while (mag >= 10) {
+        mag /= 10;
+        len++;
+    }
+    return len;
+#endif  // NUM_IS_FLOAT
+}
+
+/** Bytes taken by obuf_put_varint(@a value). */
+static inline size_t
+obuf_varint_len(unsigned long long value)
+{
+    size_t len = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        len++;
+    }
+    return len;
+}
+
+/** Append a number followed by a space. */
+static inline void
+obuf_put_num(struct obuf *b, num_t value)
+{
+    if (b->capacity - b->size < OBUF_NUM_MAX_LEN) {
+        obuf_spill(b);
+    }
+    char tmp[OBUF_NUM_MAX_LEN];
+    char *begin = obuf_format_num(value, tmp + sizeof(tmp));
+    size_t len = (size_t) (tmp + sizeof(tmp) - begin);
+    memcpy(b->data + b->size, begin, len);
+    b->size += len;
+}
+
+/** Append a number in the raw binary form. */
+static inline void
+obuf_put_raw(struct obuf *b, num_t value)
+{
+    if (b->capacity - b->size < sizeof(num_t)) {
+        obuf_spill(b);
+    }
+    memcpy(b->data + b->size, &value, sizeof(num_t));
+    b->size += sizeof(num_t);
+}
+
+/** Append an unsigned LEB128 varint, 7 bits per byte. */
+static inline void
+obuf_put_varint(struct obuf *b, unsigned long long value)
+{
+    if (b->capacity - b->size < OBUF_VARINT_MAX_LEN) {
+        obuf_spill(b);
+    }
+    char *out = b->data + b->size;
+    while (value >= 0x80) {
+        *out++ = (char) (value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (char) value;
+    b->size = (size_t) (out - b->data);
+}
+
+/** Append a few bytes as they are, no more than OBUF_NUM_MAX_LEN. */
+static inline void
+obuf_put_bytes(struct obuf *b, const void *data, size_t size)
+{
+    if (b->capacity - b->size < size) {
+        obuf_spill(b);
+    }
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+/**
+ * Append @a count copies of a few bytes, see obuf_put_bytes(). A
+ * value formatted once is repeated as many times as it occurs.
+ */
+static inline void
+obuf_put_repeated(struct obuf *b, const void *data, size_t size, size_t count)
+{
+    while (count > 0) {
+        if (b->capacity - b->size < size) {
+            obuf_spill(b);
+        }
+        size_t fit = (b->capacity - b->size) / size;
+        fit = fit < count ? fit : count;
+        char *out = b->data + b->size;
+        for (size_t i = 0; i < fit; i++) {
+            memcpy(out + i * size, data, size);
+        }
+        b->size += fit * size;
+        count -= fit;
+    }
+}
+
+static inline void
+obuf_destroy(struct obuf *b)
+{
+    for (size_t i = 0; i < b->n_buffers; i++) {
+        obuf_wait(b, i);
+        free(b->buffers[i]);
+        b->buffers[i] = NULL;
+    }
+    b->n_buffers = 0;
+    b->data = NULL;
+    b->size = 0;
+    b->capacity = 0;
+}
+
+#endif  // OUT_BUF_H
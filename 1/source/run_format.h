@@ -0,0 +1,185 @@
+#ifndef RUN_FORMAT_H
+#define RUN_FORMAT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Binary formats of number files, an alternative to the text for
+ * intermediate files nobody reads by hand. A binary file starts
+ * with a header: magic, version, format and the size of a number,
+ * so a reader detects the format by itself. The header also keeps
+ * the key type of num_type.h, a file of another type is not taken
+ * for a binary one. Formats:
+ *
+ *   raw   - little-endian num_t values, read without any parsing;
+ *   delta - the difference with the previous value (the first one
+ *           is taken against 0), zigzag encoded into an LEB128
+ *           varint. A sorted run of close values takes a byte or
+ *           two per number.
+ *
+ * Possible example of usage:
+ *
+ *
+ * size_t header_size;
+ * enum rfmt_format format = rfmt_detect(data, size, &header_size);
+ * const char *pos = data + header_size;
+ * num_t prev = 0;
+ * while (rfmt_decode_delta(&pos, data + size, &prev, out, max, &count) == NPARSE_OK)
+ *     consume(out, count);
+ *
+ *
+ * Writers put rfmt_make_header() and then the values, see
+ * obuf_put_raw() and obuf_put_varint() in out_buf.h. Decoders follow
+ * nparse_numbers() from num_parse.h: a truncated value is reported
+ * as NPARSE_UNKNOWN_SYMBOL, a too long varint as NPARSE_OVERFLOW.
+ */
+
+enum rfmt_format {
+    RFMT_TEXT,
+    RFMT_RAW,
+    RFMT_DELTA,
+};
+
+enum {
+    RFMT_VERSION = 1,
+    RFMT_HEADER_SIZE = 8,
+};
+
+/** Not ASCII, so a text file never starts like that. */
+static const char rfmt_magic[4] = {'\x93', 'N', 'U', 'M'};
+
+static inline void
+rfmt_make_header(enum rfmt_format format, char *header)
+{
+    memcpy(header, rfmt_magic, sizeof(rfmt_magic));
+    header[4] = RFMT_VERSION;
+    header[5] = (char) format;
+    header[6] = (char) sizeof(num_t);
+    header[7] = (char) NUM_KIND;
+}
+
+/**
+ * Detect the format by the header at @a data. Text has no header,
+ * so anything which is not a valid header is text.
+ */
+static inline enum rfmt_format
+rfmt_detect(const char *data, size_t size, size_t *header_size)
+{
+    *header_size = 0;
+    if (size < RFMT_HEADER_SIZE || memcmp(data, rfmt_magic, sizeof(rfmt_magic)) != 0 ||
+        data[4] != RFMT_VERSION || data[6] != (char) sizeof(num_t) || data[7] != (char) NUM_KIND ||
+        (data[5] != RFMT_RAW && data[5] != RFMT_DELTA)) {
+        return RFMT_TEXT;
+    }
+    *header_size = RFMT_HEADER_SIZE;
+    return (enum rfmt_format) data[5];
+}
+
+/** A value as stored by the raw format. */
+static inline num_t
+rfmt_num_to_le(num_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    uint64_t bits = num_bits(value);
+    if (sizeof(num_t) == sizeof(uint32_t)) {
+        bits = __builtin_bswap32((uint32_t) bits);
+        return (num_t) (int32_t) bits;
+    }
+    return num_from_bits(__builtin_bswap64(bits));
+#else
+    return value;
+#endif
+}
+
+static inline uint64_t
+rfmt_zigzag(uint64_t delta)
+{
+    return (delta << 1) ^ (uint64_t) -(int64_t) (delta >> 63);
+}
+
+static inline uint64_t
+rfmt_unzigzag(uint64_t v)
+{
+    return (v >> 1) ^ (uint64_t) -(int64_t) (v & 1);
+}
+
+/**
+ * The varint to write for @a value in the delta format, @a prev is
+ * the previous value, it is updated.
+ */
+static inline uint64_t
+rfmt_delta(num_t *prev, num_t value)
+{
+    uint64_t delta = num_bits(value) - num_bits(*prev);
+    *prev = value;
+    return rfmt_zigzag(delta);
+}
+
+static inline enum nparse_status
+rfmt_decode_raw(const char **ppos, const char *end, num_t *out, size_t max, size_t *count)
+{
+    size_t available = (size_t) (end - *ppos) / sizeof(num_t);
+    size_t n = available < max ? available : max;
+    memcpy(out, *ppos, n * sizeof(num_t));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for (size_t i = 0; i < n; i++) {
+        out[i] = rfmt_num_to_le(out[i]);
+    }
+#endif
+    *ppos += n * sizeof(num_t);
+    *count = n;
+    if (*ppos == end) {
+        return NPARSE_EOF;
+    }
+    return n == max ? NPARSE_OK : NPARSE_UNKNOWN_SYMBOL;
+}
+
+static inline enum nparse_status
+rfmt_decode_delta(const char **ppos, const char *end, num_t *prev, num_t *out, size_t max,
+                  size_t *count)
+{
+    const unsigned char *pos = (const unsigned char*) *ppos;
+    const unsigned char *uend = (const unsigned char*) end;
+    uint64_t value = num_bits(*prev);
+    size_t n = 0;
+    enum nparse_status status = NPARSE_OK;
+    while (n < max) {
+        if (pos == uend) {
+            status = NPARSE_EOF;
+            break;
+        }
+        uint64_t v = 0;
+        unsigned shift = 0;
+        const unsigned char *start = pos;
+        /* The common case of a small delta is a single byte. */
+        while (pos < uend && (*pos & 0x80) != 0 && shift < 63) {
+            v |= (uint64_t) (*pos++ & 0x7F) << shift;
+            shift += 7;
+        }
+        if (pos == uend) {
+            pos = start;
+            status = NPARSE_UNKNOWN_SYMBOL;
+            break;
+        }
+        if ((*pos & 0x80) != 0 || (shift == 63 && *pos > 1)) {
+            pos = start;
+            status = NPARSE_OVERFLOW;
+            break;
+        }
+        v |= (uint64_t) *pos++ << shift;
+        value += rfmt_unzigzag(v);
+        out[n++] = num_from_bits(value);
+    }
+    if (n == max && status == NPARSE_OK && pos == uend) {
+        status = NPARSE_EOF;
+    }
+    *ppos = (const char*) pos;
+    *prev = num_from_bits(value);
+    *count = n;
+    return status;
+}
+
+#endif  // RUN_FORMAT_H
@@ -0,0 +1,140 @@
+#ifndef RUN_IO_H
+#define RUN_IO_H
+
+#include <aio.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Streaming reader of a sorted run, spilled to a file as raw
+ * num_t values. The run is read in blocks into two buffers: while
+ * one block is consumed, the next one is already being read with
+ * aio_read(). Possible example of usage:
+ *
+ *
+ * struct run_reader r;
+ * run_reader_open(&r, fd, 1 << 20);
+ * const num_t *begin, *end;
+ * while (run_reader_next(&r, &begin, &end))
+ *     consume(begin, end);
+ * run_reader_close(&r);
+ *
+ *
+ * num_t is expected to be defined before this header.
+ */
+
+struct run_reader {
+    int fd;
+    /** Two blocks: one is consumed, the other one is being read. */
+    num_t *blocks[2];
+    size_t block_size;
+    int consumed;
+    struct aiocb aio;
+    bool is_in_flight;
+    off_t offset;
+    bool is_eof;
+    /** Set when a read failed, the run is treated as exhausted. */
+    bool failed;
+};
+
+/** Start reading the next block into the free buffer. */
+static inline void
+run_reader_prefetch(struct run_reader *r)
+{
+    if (r->is_eof) {
+        return;
+    }
+    memset(&r->aio, 0, sizeof(r->aio));
+    r->aio.aio_fildes = r->fd;
+    r->aio.aio_buf = r->blocks[1 - r->consumed];
+    r->aio.aio_nbytes = r->block_size * sizeof(num_t);
+    r->aio.aio_offset = r->offset;
+    if (aio_read(&r->aio) != 0) {
+        r->failed = true;
+        r->is_eof = true;
+        return;
+    }
+    r->is_in_flight = true;
+}
+
+/**
+ * Open a run, the file position does not matter. @a block_bytes
+ * is the size of each of the two read-ahead buffers.
+ */
+static inline bool
+run_reader_open(struct run_reader *r, int fd, size_t block_bytes)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->block_size = block_bytes / sizeof(num_t);
+    if (r->block_size == 0) {
+        r->block_size = 1;
+    }
+    r->blocks[0] = (num_t*) malloc(r->block_size * sizeof(num_t));
+    r->blocks[1] = (num_t*) malloc(r->block_size * sizeof(num_t));
+    if (r->blocks[0] == NULL || r->blocks[1] == NULL) {
+        free(r->blocks[0]);
+        free(r->blocks[1]);
+        r->blocks[0] = r->blocks[1] = NULL;
+        return false;
+    }
+    r->consumed = 1;
+    run_reader_prefetch(r);
+    return !r->failed;
+}
+
+/**
+ * Give the next block of the run. The previous one is reused for
+ * the read-ahead, so it must not be used after this call. Returns
+ * false when the run is over or failed.
+ */
+static inline bool
+run_reader_next(struct run_reader *r, const num_t **begin, const num_t **end)
+{
+    if (!r->is_in_flight) {
+        return false;
+    }
+    const struct aiocb *list[1] = {&r->aio};
+    int rc;
+    while ((rc = aio_error(&r->aio)) == EINPROGRESS) {
+        aio_suspend(list, 1, NULL);
+    }
+    r->is_in_flight = false;
+    ssize_t n_bytes = aio_return(&r->aio);
+    if (rc != 0 || n_bytes < 0 || n_bytes % sizeof(num_t) != 0) {
+        r->failed = true;
+        r->is_eof = true;
+        return false;
+    }
+    if (n_bytes == 0) {
+        r->is_eof = true;
+        return false;
+    }
+    r->offset += n_bytes;
+    r->consumed = 1 - r->consumed;
+    run_reader_prefetch(r);
+    *begin = r->blocks[r->consumed];
+    *end = *begin + n_bytes / sizeof(num_t);
+    return true;
+}
+
+static inline void
+run_reader_close(struct run_reader *r)
+{
+    if (r->is_in_flight) {
+        const struct aiocb *list[1] = {&r->aio};
+        while (aio_error(&r->aio) == EINPROGRESS) {
+            aio_suspend(list, 1, NULL);
+        }
+        aio_return(&r->aio);
+        r->is_in_flight = false;
+    }
+    free(r->blocks[0]);
+    free(r->blocks[1]);
+    r->blocks[0] = r->blocks[1] = NULL;
+}
+
+#endif  // RUN_IO_H
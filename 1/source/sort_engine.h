@@ -0,0 +1,464 @@
+#ifndef SORT_ENGINE_H
+#define SORT_ENGINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Building blocks of the sort engines. Everything which may take
+ * long works in bounded steps and keeps its state in a struct, so
+ * a coroutine can yield between the steps. Possible example of
+ * usage:
+ *
+ *
+ * struct sort_radix rs;
+ * sort_radix_init(&rs, numbers, tmp, size, min, max, true);
+ * while (!sort_radix_step(&rs, 8192))
+ *     coro_maybe_yield();
+ * // rs.src is the sorted array, either numbers or tmp.
+ *
+ *
+ * num_t is expected to be defined by num_type.h before this header.
+ */
+
+enum {
+    /** Ranges up to that size are finished by an insertion sort. */
+    SORT_INSERTION_MAX = 24,
+    SORT_RADIX_BUCKETS = 256,
+    SORT_RADIX_DIGITS = sizeof(num_t),
+    /** Below that size a comparison sort always wins. */
+    SORT_RADIX_MIN_SIZE = 2048,
+    /** Widest key range counted into a histogram, in keys. */
+    SORT_HIST_MAX = 1 << 16,
+};
+
+static inline void
+sort_insertion(num_t *a, size_t size)
+{
+    for (size_t i = 1; i < size; i++) {
+        num_t value = a[i];
+        size_t j = i;
+        while (j > 0 && a[j - 1] > value) {
+            a[j] = a[j - 1];
+            j--;
+        }
+        a[j] = value;
+    }
+}
+
+/**
+ * Order a[from], a[mid] and a[to], so the median of them ends up
+ * in the middle, where a Hoare partition takes its pivot from.
+ */
+static inline void
+sort_median_of_three(num_t *a, size_t from, size_t to)
+{
+    size_t mid = (from + to) / 2;
+    num_t tmp;
+    if (a[mid] < a[from]) {
+        tmp = a[mid]; a[mid] = a[from]; a[from] = tmp;
+    }
+    if (a[to] < a[mid]) {
+        tmp = a[to]; a[to] = a[mid]; a[mid] = tmp;
+        if (a[mid] < a[from]) {
+            tmp = a[mid]; a[mid] = a[from]; a[from] = tmp;
+        }
+    }
+}
+
+static inline unsigned
+sort_log2(size_t size)
+{
+    return size > 1 ? 63 - (unsigned) __builtin_clzll((unsigned long long) size) : 0;
+}
+
+/** Heap sort, the fallback of an introsort on bad pivots. */
+struct sort_heap {
+    num_t *a;
+    size_t size;
+    /** The next node to sift while the heap is being built. */
+    size_t next;
+    /** End of the heap while it is being taken apart. */
+    size_t end;
+};
+
+static inline void
+sort_heap_sift(num_t *a, size_t i, size_t size)
+{
+    num_t value = a[i];
+    while (true) {
+        size_t child = 2 * i + 1;
+        if (child >= size) {
+            break;
+        }
+        if (child + 1 < size && a[child + 1] > a[child]) {
+            child++;
+        }
+        if (a[child] <= value) {
+            break;
+        }
+        a[i] = a[child];
+        i = child;
+    }
+    a[i] = value;
+}
+
+static inline void
+sort_heap_init(struct sort_heap *h, num_t *a, size_t size)
+{
+    h->a = a;
+    h->size = size;
+    h->next = size / 2;
+    h->end = size;
+}
+
+/** Do at most @a budget sifts, return true when sorted. */
+static inline bool
+sort_heap_step(struct sort_heap *h, size_t budget)
+{
+    for (; budget > 0; budget--) {
+        if (h->next > 0) {
+            sort_heap_sift(h->a, --h->next, h->size);
+            continue;
+        }
+        if (h->end <= 1) {
+            return true;
+        }
+        h->end--;
+        num_t tmp = h->a[0];
+        h->a[0] = h->a[h->end];
+        h->a[h->end] = tmp;
+        sort_heap_sift(h->a, 0, h->end);
+    }
+    return h->next == 0 && h->end <= 1;
+}
+
+/**
+ * Find the minimum and the maximum of a[from, to). Meant to be
+ * called piece by piece, so the results are accumulated.
+ */
+static inline void
+sort_minmax(const num_t *a, size_t from, size_t to, num_t *min, num_t *max)
+{
+    num_t lo = *min;
+    num_t hi = *max;
+    for (size_t i = from; i < to; i++) {
+        lo = a[i] < lo ? a[i] : lo;
+        hi = a[i] > hi ? a[i] : hi;
+    }
+    *min = lo;
+    *max = hi;
+}
+
+/** Number of byte digits needed for keys in [min, max]. */
+static inline unsigned
+sort_radix_digit_count(num_t min, num_t max)
+{
+    unsigned long long range = num_key(max) - num_key(min);
+    unsigned n = 0;
+    while (range != 0) {
+        range >>= 8;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * A scatter pass of a radix sort streams the array twice, a
+ * comparison sort touches it about log2(size) times. So radix sort
+ * is taken when its passes are clearly fewer than that.
+ */
+static inline bool
+sort_radix_is_better(size_t size, num_t min, num_t max)
+{
+    if (size < SORT_RADIX_MIN_SIZE) {
+        return false;
+    }
+    return 2 * sort_radix_digit_count(min, max) <= sort_log2(size) + 2;
+}
+
+enum sort_radix_phase {
+    SORT_RADIX_COUNT,
+    SORT_RADIX_SCATTER,
+    SORT_RADIX_DONE,
+};
+
+/**
+ * LSD radix sort by bytes of (key - min), see num_key(), so a narrow
+ * key range needs few passes. Digits where all the keys are the same
+ * are skipped.
+ *
+ * When num_t is wider than 32 bits but the keys span less than 2^32,
+ * the sort may be narrowed: the count pass packs the 32-bit keys into
+ * the first half of the array, the passes move half the bytes, and
+ * the last pass unpacks the values into the array it writes to.
+ */
+struct sort_radix {
+    /** Source of the current pass; the result when done. */
+    num_t *src;
+    num_t *dst;
+    size_t size;
+    unsigned long long min;
+    bool is_narrow;
+    /** The first value, all of them when no pass is needed. */
+    num_t first;
+    enum sort_radix_phase phase;
+    size_t pos;
+
+    unsigned n_digits;
+    /** Digits which really need a pass, and the current one. */
+    unsigned passes[SORT_RADIX_DIGITS];
+    unsigned n_passes;
+    unsigned pass;
+    size_t counts[SORT_RADIX_DIGITS][SORT_RADIX_BUCKETS];
+    size_t offsets[SORT_RADIX_BUCKETS];
+};
+
+/** Whether the sort of keys in [min, max] can be narrowed to 32 bits. */
+static inline bool
+sort_radix_can_narrow(num_t min, num_t max)
+{
+    return sizeof(num_t) > sizeof(uint32_t) && num_key(max) - num_key(min) <= UINT32_MAX;
+}
+
+static inline void
+sort_radix_init(struct sort_radix *rs, num_t *a, num_t *tmp, size_t size, num_t min, num_t max,
+                bool is_narrow)
+{
+    rs->src = a;
+    rs->dst = tmp;
+    rs->size = size;
+    rs->min = num_key(min);
+    rs->is_narrow = is_narrow && sort_radix_can_narrow(min, max);
+    rs->first = size > 0 ? a[0] : min;
+    rs->phase = SORT_RADIX_COUNT;
+    rs->pos = 0;
+    rs->n_digits = sort_radix_digit_count(min, max);
+    rs->n_passes = 0;
+    rs->pass = 0;
+    memset(rs->counts, 0, sizeof(rs->counts));
+    if (rs->n_digits == 0) {
+        rs->phase = SORT_RADIX_DONE;
+    }
+}
+
+static inline unsigned
+sort_radix_digit(const struct sort_radix *rs, num_t value, unsigned digit)
+{
+    return (unsigned) (((num_key(value) - rs->min) >> (digit * 8)) & 0xFF);
+}
+
+/** A scatter step of a narrowed sort, the last pass unpacks the values. */
+static inline void
+sort_radix_scatter_narrow(struct sort_radix *rs, unsigned digit, size_t end)
+{
+    const uint32_t *src = (const uint32_t*) rs->src;
+    unsigned shift = digit * 8;
+    if (rs->pass + 1 < rs->n_passes) {
+        uint32_t *dst = (uint32_t*) rs->dst;
+        for (size_t i = rs->pos; i < end; i++) {
+            dst[rs->offsets[(src[i] >> shift) & 0xFF]++] = src[i];
+        }
+        return;
+    }
+    num_t *dst = rs->dst;
+    for (size_t i = rs->pos; i < end; i++) {
+        dst[rs->offsets[(src[i] >> shift) & 0xFF]++] = num_from_key(rs->min + src[i]);
+    }
+}
+
+/** Start the pass rs->pass: turn its counts into offsets. */
+static inline void
+sort_radix_begin_pass(struct sort_radix *rs)
+{
+    const size_t *counts = rs->counts[rs->passes[rs->pass]];
+    size_t sum = 0;
+    for (unsigned b = 0; b < SORT_RADIX_BUCKETS; b++) {
+        rs->offsets[b] = sum;
+        sum += counts[b];
+    }
+    rs->pos = 0;
+    rs->phase = SORT_RADIX_SCATTER;
+}
+
+/**
+ * Process at most about @a budget numbers, return true when the
+ * array is sorted. The result is in rs->src.
+ */
+static inline bool
+sort_radix_step(struct sort_radix *rs, size_t budget)
+{
+    if (rs->phase == SORT_RADIX_COUNT) {
+        size_t end = rs->size - rs->pos > budget ? rs->pos + budget : rs->size;
+        /* Packed key i never overwrites a value not read yet. */
+        uint32_t *packed = (uint32_t*) rs->src;
+        for (size_t i = rs->pos; i < end; i++) {
+            unsigned long long key = num_key(rs->src[i]) - rs->min;
+            for (unsigned d = 0; d < rs->n_digits; d++) {
+                rs->counts[d][(key >> (d * 8)) & 0xFF]++;
+            }
+            if (rs->is_narrow) {
+                packed[i] = (uint32_t) key;
+            }
+        }
+        rs->pos = end;
+        if (rs->pos < rs->size) {
+            return false;
+        }
+        for (unsigned d = 0; d < rs->n_digits; d++) {
+            bool is_trivial = false;
+            for (unsigned b = 0; b < SORT_RADIX_BUCKETS; b++) {
+                if (rs->counts[d][b] == rs->size) {
+                    is_trivial = true;
+                    break;
+                }
+            }
+            if (!is_trivial) {
+                rs->passes[rs->n_passes++] = d;
+            }
+        }
+        if (rs->n_passes == 0) {
+            for (size_t i = 0; i < rs->size && rs->is_narrow; i++) {
+                rs->src[i] = rs->first;
+            }
+            rs->phase = SORT_RADIX_DONE;
+            return true;
+        }
+        sort_radix_begin_pass(rs);
+        return false;
+    }
+    if (rs->phase == SORT_RADIX_SCATTER) {
+        unsigned digit = rs->passes[rs->pass];
+        size_t end = rs->size - rs->pos > budget ? rs->pos + budget : rs->size;
+        num_t *dst = rs->dst;
+        if (rs->is_narrow) {
+            sort_radix_scatter_narrow(rs, digit, end);
+        } else {
+            const num_t *src = rs->src;
+            for (size_t i = rs->pos; i < end; i++) {
+                dst[rs->offsets[sort_radix_digit(rs, src[i], digit)]++] = src[i];
+            }
+        }
+        rs->pos = end;
+        if (rs->pos < rs->size) {
+            return false;
+        }
+        rs->dst = rs->src;
+        rs->src = dst;
+        if (++rs->pass == rs->n_passes) {
+            rs->phase = SORT_RADIX_DONE;
+            return true;
+        }
+        sort_radix_begin_pass(rs);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Histogram of the keys in [min, min + size), see num_key(): a
+ * counting sort. When a run holds many numbers of a narrow key range
+ * it is counted instead of sorted, the histograms of several runs are
+ * merged by adding them up, and the sorted numbers are written back
+ * out of the counts, bucket by bucket.
+ */
+struct sort_hist {
+    size_t *counts;
+    size_t size;
+    unsigned long long min;
+    /** Sum of the counts. */
+    size_t n_values;
+    /** Where sort_hist_expand() stopped: a bucket and its values written. */
+    size_t bucket;
+    size_t taken;
+};
+
+/** Whether keys in [min, max] fit into a histogram of at most @a max_size buckets. */
+static inline bool
+sort_hist_can_count(num_t min, num_t max, size_t max_size)
+{
+    return num_key(max) - num_key(min) < max_size;
+}
+
+/** A histogram is not bigger than the run it replaces. */
+static inline bool
+sort_hist_is_better(size_t size, num_t min, num_t max)
+{
+    return sort_hist_can_count(min, max, SORT_HIST_MAX) && num_key(max) - num_key(min) < size;
+}
+
+/** Returns false when the counts can not be allocated. */
+static inline bool
+sort_hist_init(struct sort_hist *h, num_t min, num_t max)
+{
+    h->min = num_key(min);
+    h->size = (size_t) (num_key(max) - h->min) + 1;
+    h->n_values = 0;
+    h->bucket = 0;
+    h->taken = 0;
+    h->counts = (size_t*) calloc(h->size, sizeof(size_t));
+    return h->counts != NULL;
+}
+
+/** Count a[from, to), all of them must be in the range of @a h. */
+static inline void
+sort_hist_add(struct sort_hist *h, const num_t *a, size_t from, size_t to)
+{
+    size_t *counts = h->counts;
+    unsigned long long min = h->min;
+    for (size_t i = from; i < to; i++) {
+        counts[num_key(a[i]) - min]++;
+    }
+    h->n_values += to - from;
+}
+
+/** Add @a src up to @a dst, the range of @a dst must cover it. */
+static inline void
+sort_hist_merge(struct sort_hist *dst, const struct sort_hist *src)
+{
+    size_t *counts = dst->counts + (src->min - dst->min);
+    for (size_t i = 0; i < src->size; i++) {
+        counts[i] += src->counts[i];
+    }
+    dst->n_values += src->n_values;
+}
+
+/**
+ * Write the next at most @a budget sorted values to @a out, which
+ * continues where the previous call stopped. Returns the number of
+ * values written, 0 when all of them are.
+ */
+static inline size_t
+sort_hist_expand(struct sort_hist *h, num_t *out, size_t budget)
+{
+    size_t n = 0;
+    while (n < budget && h->bucket < h->size) {
+        size_t left = h->counts[h->bucket] - h->taken;
+        size_t take = left < budget - n ? left : budget - n;
+        num_t value = num_from_key(h->min + h->bucket);
+        for (size_t i = 0; i < take; i++) {
+            out[n + i] = value;
+        }
+        n += take;
+        h->taken += take;
+        if (h->taken == h->counts[h->bucket]) {
+            h->bucket++;
+            h->taken = 0;
+        }
+    }
+    return n;
+}
+
+static inline void
+sort_hist_destroy(struct sort_hist *h)
+{
+    free(h->counts);
+    h->counts = NULL;
+    h->size = 0;
+    h->n_values = 0;
+}
+
+#endif  // SORT_ENGINE_H
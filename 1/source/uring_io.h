@@ -0,0 +1,220 @@
+#ifndef URING_IO_H
+#define URING_IO_H
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * Minimal io_uring wrapper on raw system calls, without liburing.
+ * One thread submits at a time and one thread reaps at a time, the
+ * callers are responsible for that. Possible example of usage:
+ *
+ *
+ * struct uring ring;
+ * if (!uring_create(&ring, 64))
+ *     fall_back_to_something_else();
+ * uring_prep_read(&ring, fd, buf, size, offset, -1, cookie);
+ * uring_submit(&ring, 0);
+ * struct io_uring_cqe cqe;
+ * while (!uring_peek(&ring, &cqe))
+ *     uring_submit(&ring, 1);
+ * handle(cqe.user_data, cqe.res);
+ * uring_destroy(&ring);
+ *
+ *
+ * uring_create() fails when the kernel has no io_uring or it is
+ * disabled, so the caller can fall back to another I/O method.
+ */
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned cq_entries;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    /** Prepared entries which the kernel has not taken yet. */
+    unsigned n_to_submit;
+
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static inline void
+uring_destroy(struct uring *u)
+{
+    if (u->sqes != NULL) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->cq_ring != NULL && u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if (u->sq_ring != NULL) {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+    if (u->fd >= 0) {
+        close(u->fd);
+    }
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+static inline bool
+uring_create(struct uring *u, unsigned entries)
+{
+    memset(u, 0, sizeof(*u));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    u->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (u->fd < 0) {
+        u->fd = -1;
+        return false;
+    }
+    u->sq_entries = params.sq_entries;
+    u->cq_entries = params.cq_entries;
+    u->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0 && u->cq_ring_size > u->sq_ring_size) {
+        u->sq_ring_size = u->cq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        uring_destroy(u);
+        return false;
+    }
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) {
+            u->cq_ring = NULL;
+            uring_destroy(u);
+            return false;
+        }
+    }
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe*) mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        uring_destroy(u);
+        return false;
+    }
+    char *sq = (char*) u->sq_ring;
+    u->sq_head = (unsigned*) (sq + params.sq_off.head);
+    u->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    u->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+    u->sq_array = (unsigned*) (sq + params.sq_off.array);
+    char *cq = (char*) u->cq_ring;
+    u->cq_head = (unsigned*) (cq + params.cq_off.head);
+    u->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    u->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    return true;
+}
+
+/**
+ * Register buffers for IORING_OP_READ_FIXED, they are referred to
+ * by their index in @a iov. The pages are pinned, so it may fail
+ * on a low RLIMIT_MEMLOCK.
+ */
+static inline bool
+uring_register_buffers(struct uring *u, const struct iovec *iov, unsigned n)
+{
+    return syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iov, n) == 0;
+}
+
+/** Take a free submission entry, NULL if the ring is full. */
+static inline struct io_uring_sqe*
+uring_get_sqe(struct uring *u)
+{
+    unsigned tail = *u->sq_tail;
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= u->sq_entries) {
+        return NULL;
+    }
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->n_to_submit++;
+    return sqe;
+}
+
+/**
+ * Queue a read of @a size bytes at @a offset. @a buf_index is the
+ * index of a registered buffer containing @a buf, or -1.
+ */
+static inline bool
+uring_prep_read(struct uring *u, int fd, void *buf, unsigned size, uint64_t offset, int buf_index,
+                uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (sqe == NULL) {
+        return false;
+    }
+    sqe->opcode = buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->buf_index = buf_index >= 0 ? (uint16_t) buf_index : 0;
+    sqe->user_data = user_data;
+    return true;
+}
+
+/**
+ * Hand the prepared entries to the kernel and wait until at least
+ * @a wait_nr completions are ready.
+ */
+static inline bool
+uring_submit(struct uring *u, unsigned wait_nr)
+{
+    while (true) {
+        long rc = syscall(__NR_io_uring_enter, u->fd, u->n_to_submit, wait_nr,
+                          wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (rc >= 0) {
+            u->n_to_submit -= (unsigned) rc;
+            return true;
+        }
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+/** Take a completion if there is one, without a system call. */
+static inline bool
+uring_peek(struct uring *u, struct io_uring_cqe *cqe)
+{
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *cqe = u->cqes[head & *u->cq_mask];
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#endif  // URING_IO_H
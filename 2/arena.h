@@ -0,0 +1,153 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Bump allocator over a chain of blocks, it holds everything parsed
+ * from one command line. Nothing is freed one by one: the arena is
+ * reset before the next line, the blocks are kept and filled again,
+ * so once they have grown to fit the longest line no more malloc()
+ * calls are done. The last allocation may be resized in place, an
+ * array being filled can grow there. Possible example of usage:
+ *
+ *
+ * shell_Arena arena;
+ * shell_ArenaCreate(&arena, 4096);
+ * while (getline(&line, &n, stdin) != -1) {
+ *     shell_ArenaReset(&arena);
+ *     node = shell_ArenaAlloc(&arena, sizeof(*node));
+ *     ...
+ * }
+ * shell_ArenaDestroy(&arena);
+ */
+
+enum {
+    /** All allocations are aligned to it. */
+    SHELL_ARENA_ALIGN = 16,
+    SHELL_ARENA_BLOCK_DEFAULT = 16 << 10,
+};
+
+typedef struct shell_ArenaBlock
+{
+    struct shell_ArenaBlock *next;
+    size_t size;
+    size_t used;
+    _Alignas(SHELL_ARENA_ALIGN) char data[];
+} shell_ArenaBlock;
+
+typedef struct shell_Arena
+{
+    shell_ArenaBlock *first;
+    shell_ArenaBlock *last_block;
+    /** The block allocated from, the ones after it are empty. */
+    shell_ArenaBlock *current;
+    /** The size of the next block, it doubles with each one. */
+    size_t block_size;
+    /** The last allocation, it may be resized in place. */
+    char *last;
+
+    /** Statistics. */
+    size_t n_blocks;
+    size_t capacity;
+} shell_Arena;
+
+/** No memory is taken until the first allocation. */
+static inline void
+shell_ArenaCreate(shell_Arena *a, size_t block_size)
+{
+    memset(a, 0, sizeof(*a));
+    a->block_size = block_size > 0 ? block_size : SHELL_ARENA_BLOCK_DEFAULT;
+}
+
+static inline size_t
+shell_ArenaRound(size_t size)
+{
+    return (size + SHELL_ARENA_ALIGN - 1) / SHELL_ARENA_ALIGN * SHELL_ARENA_ALIGN;
+}
+
+/** Returns NULL when there is no memory. */
+static inline void*
+shell_ArenaAlloc(shell_Arena *a, size_t size)
+{
+    size = shell_ArenaRound(size);
+    shell_ArenaBlock *b = a->current;
+    while (b != NULL && b->size - b->used < size) {
+        b = b->next;
+    }
+    if (b == NULL) {
+        size_t block_size = a->block_size > size ? a->block_size : size;
+        b = (shell_ArenaBlock*) malloc(sizeof(shell_ArenaBlock) + block_size);
+        if (b == NULL) {
+            return NULL;
+        }
+        b->next = NULL;
+        b->size = block_size;
+        b->used = 0;
+        if (a->last_block != NULL) {
+            a->last_block->next = b;
+        } else {
+            a->first = b;
+        }
+        a->last_block = b;
+        a->block_size = block_size * 2;
+        a->n_blocks++;
+        a->capacity += block_size;
+    }
+    a->current = b;
+    a->last = b->data + b->used;
+    b->used += size;
+    return a->last;
+}
+
+/**
+ * Resize @a ptr of @a old_size bytes to @a new_size. The last
+ * allocation is resized in place while its block has room, any
+ * other one is copied to a new allocation. Returns NULL when there
+ * is no memory, @a ptr stays valid then.
+ */
+static inline void*
+shell_ArenaResize(shell_Arena *a, void *ptr, size_t old_size, size_t new_size)
+{
+    if (ptr != NULL && ptr == a->last) {
+        shell_ArenaBlock *b = a->current;
+        size_t start = (size_t) (a->last - b->data);
+        if (b->size - start >= shell_ArenaRound(new_size)) {
+            b->used = start + shell_ArenaRound(new_size);
+            return ptr;
+        }
+    }
+    void *new_ptr = shell_ArenaAlloc(a, new_size);
+    if (new_ptr != NULL && old_size > 0) {
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    }
+    return new_ptr;
+}
+
+/** Forget all the allocations, the blocks are kept for the next ones. */
+static inline void
+shell_ArenaReset(shell_Arena *a)
+{
+    for (shell_ArenaBlock *b = a->first; b != NULL; b = b->next) {
+        b->used = 0;
+    }
+    a->current = a->first;
+    a->last = NULL;
+}
+
+static inline void
+shell_ArenaDestroy(shell_Arena *a)
+{
+    shell_ArenaBlock *b = a->first;
+    while (b != NULL) {
+        shell_ArenaBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+    memset(a, 0, sizeof(*a));
+}
+
+#endif  // ARENA_H
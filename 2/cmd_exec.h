@@ -0,0 +1,554 @@
+#ifndef CMD_EXEC_H
+#define CMD_EXEC_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "cmd_parse.h"
+#include "job_table.h"
+#include "macro.h"
+#include "path_cache.h"
+
+/**
+ * Executor of a shell_CommandFlow. Each stage of a pipeline is
+ * started with posix_spawn(), which runs the child on the memory of
+ * the shell until it execs (vfork semantics, CLONE_VM | CLONE_VFORK
+ * in glibc). So nothing is copied, while a fork() copies the page
+ * tables of the whole shell for every command. Pipes and redirects
+ * are set up by the file actions of the spawn, the redirected files
+ * are opened by the shell itself: an error of a file action can not
+ * be told from one of exec by posix_spawn(). A plain fork() and
+ * exec is kept to compare with, see exec_bench.c. Command names are
+ * resolved once through the cache of path_cache.h, the spawn gets
+ * the path and does not scan $PATH. Possible example of usage:
+ *
+ *
+ * shell_Executor ex;
+ * shell_ExecutorCreate(&ex, false);
+ * while (getline(&line, &n, stdin) != -1)
+ *     shell_Execute(&ex, shell_GetExpression(&lexer, line, len));
+ * shell_ExecutorDestroy(&ex);
+ *
+ *
+ * A list is run left to right, && and || look at the status of the
+ * pipeline before them. A list ending with '&' is not waited for: a
+ * single pipeline is spawned as it is, a list with && or || is run by
+ * a forked copy of the shell. Either one is a job of job_table.h, the
+ * caller reaps them when the signalfd of the table is readable. The
+ * exit status of a command killed by
+ * a signal is 128 + the signal, as in sh, one which can not be run
+ * has status 127 and one with a redirect which can not be opened has
+ * status 1.
+ *
+ * The builtins are run when they are a pipeline by themselves:
+ * `hash` prints the path cache, `hash -r` empties it and `hash
+ * NAME...` looks the names up, `jobs` prints the running jobs and
+ * `wait` waits for all of them.
+ *
+ * _GNU_SOURCE is expected to be defined before the includes.
+ */
+
+enum {
+    SHELL_STATUS_NOT_FOUND = 127,
+};
+
+typedef struct shell_Executor
+{
+    /** NUL-terminated argv and paths of the flow being run. */
+    shell_Arena arena;
+    shell_PathCache paths;
+    shell_JobTable jobs;
+    /** Start commands with fork() and execv() instead of posix_spawn(). */
+    bool use_fork;
+    /** Exit status of the last pipeline. */
+    int status;
+    /**
+     * Called before waiting for a pipeline, while its commands run:
+     * a batch shell parses the next lines there.
+     */
+    void (*on_wait)(void *arg);
+    void *wait_arg;
+
+    /** Statistics. */
+    size_t n_spawned;
+    size_t n_failed;
+    /** Time of the spawn or fork calls, the parent side of starting a command. */
+    long long spawn_ns;
+} shell_Executor;
+
+static inline void
+shell_ExecutorCreate(shell_Executor *ex, bool use_fork)
+{
+    memset(ex, 0, sizeof(*ex));
+    shell_ArenaCreate(&ex->arena, SHELL_ARENA_BLOCK_DEFAULT);
+    shell_PathCacheCreate(&ex->paths);
+    shell_JobTableCreate(&ex->jobs);
+    ex->use_fork = use_fork;
+}
+
+static inline void
+shell_ExecutorDestroy(shell_Executor *ex)
+{
+    shell_JobTableDestroy(&ex->jobs);
+    shell_PathCacheDestroy(&ex->paths);
+    shell_ArenaDestroy(&ex->arena);
+}
+
+static inline long long
+shell_TimeNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** A NUL-terminated copy of @a token in the arena, NULL without memory. */
+static inline char*
+shell_TokenString(shell_Executor *ex, shell_Token token)
+{
+    char *str = (char*) shell_ArenaAlloc(&ex->arena, token.len + 1);
+    if (str != NULL) {
+        memcpy(str, token.str, token.len);
+        str[token.len] = '\0';
+    }
+    return str;
+}
+
+/** argv of @a cmd for exec, NULL-terminated. */
+static inline char**
+shell_MakeArgv(shell_Executor *ex, const shell_Command *cmd)
+{
+    char **argv = (char**) shell_ArenaAlloc(&ex->arena, (cmd->argc + 1) * sizeof(char*));
+    if (argv == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < cmd->argc; i++) {
+        argv[i] = shell_TokenString(ex, cmd->argv[i]);
+        if (argv[i] == NULL) {
+            return NULL;
+        }
+    }
+    argv[cmd->argc] = NULL;
+    return argv;
+}
+
+static inline int
+shell_OutFlags(const shell_Command *cmd)
+{
+    return O_WRONLY | O_CREAT | (cmd->is_append ? O_APPEND : O_TRUNC);
+}
+
+/**
+ * Open the redirects of @a cmd, close-on-exec: a stage gets dup2()
+ * copies of them. @a in_fd and @a out_fd are left -1 when there is
+ * no such redirect. A file which can not be opened is reported and
+ * false is returned, nothing is left open then.
+ */
+static inline bool
+shell_OpenRedirects(shell_Executor *ex, const shell_Command *cmd, int *in_fd, int *out_fd)
+{
+    *in_fd = -1;
+    *out_fd = -1;
+    if (cmd->in_file.str != NULL) {
+        char *in_path = shell_TokenString(ex, cmd->in_file);
+        *in_fd = in_path == NULL ? -1 : open(in_path, O_RDONLY | O_CLOEXEC);
+        if (*in_fd == -1) {
+            LOG_ERROR("unable to open \"%.*s\"", (int) cmd->in_file.len, cmd->in_file.str);
+            errno = 0;
+            return false;
+        }
+    }
+    if (cmd->out_file.str != NULL) {
+        char *out_path = shell_TokenString(ex, cmd->out_file);
+        *out_fd = out_path == NULL ? -1 : open(out_path, shell_OutFlags(cmd) | O_CLOEXEC, 0666);
+        if (*out_fd == -1) {
+            LOG_ERROR("unable to open \"%.*s\"", (int) cmd->out_file.len, cmd->out_file.str);
+            errno = 0;
+            if (*in_fd != -1) {
+                close(*in_fd);
+                *in_fd = -1;
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Start a command from @a path with posix_spawn(), reading @a in_fd
+ * and writing @a out_fd when they are not -1. Returns 0 or an errno
+ * value, the error of exec is seen here as well.
+ */
+static inline int
+shell_SpawnStage(const char *path, char **argv, int in_fd, int out_fd, pid_t *pid)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    int rc = posix_spawn_file_actions_init(&actions);
+    if (rc != 0) {
+        return rc;
+    }
+    rc = posix_spawnattr_init(&attr);
+    if (rc != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        return rc;
+    }
+    // The pipes and files are close-on-exec, only their dup2() copies are left:
+    if (rc == 0 && in_fd != -1) {
+        rc = posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (rc == 0 && out_fd != -1) {
+        rc = posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    // The shell may block signals for itself, the command starts clean:
+    sigset_t mask;
+    sigemptyset(&mask);
+    short flags = POSIX_SPAWN_SETSIGMASK;
+#ifdef POSIX_SPAWN_USEVFORK
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif  // POSIX_SPAWN_USEVFORK
+    if (rc == 0) {
+        rc = posix_spawnattr_setflags(&attr, flags);
+    }
+    if (rc == 0) {
+        rc = posix_spawnattr_setsigmask(&attr, &mask);
+    }
+    if (rc == 0) {
+        rc = posix_spawn(pid, path, &actions, &attr, argv, environ);
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return rc;
+}
+
+/**
+ * The same as shell_SpawnStage() with fork() and execv(). The error
+ * of exec is in the child, it exits with status 127.
+ */
+static inline int
+shell_ForkStage(const char *path, char **argv, int in_fd, int out_fd, pid_t *pid)
+{
+    *pid = fork();
+    if (*pid == -1) {
+        return errno;
+    }
+    if (*pid > 0) {
+        return 0;
+    }
+    if ((in_fd != -1 && dup2(in_fd, STDIN_FILENO) == -1) ||
+        (out_fd != -1 && dup2(out_fd, STDOUT_FILENO) == -1)) {
+        _exit(1);
+    }
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    execv(path, argv);
+    LOG_ERROR("unable to run \"%s\"", argv[0]);
+    _exit(SHELL_STATUS_NOT_FOUND);
+}
+
+/**
+ * Start @a argv from its cached path. A cached path which fails to
+ * exec is forgotten and $PATH is scanned once more, the command may
+ * have moved since it was cached. The redirects are opened already,
+ * so ENOENT and EACCES are about the path.
+ */
+static inline int
+shell_StartStage(shell_Executor *ex, char **argv, int in_fd, int out_fd, pid_t *pid)
+{
+    int rc = ENOENT;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        const char *path = shell_PathCacheFind(&ex->paths, argv[0]);
+        if (path == NULL) {
+            return ENOENT;
+        }
+        rc = ex->use_fork ? shell_ForkStage(path, argv, in_fd, out_fd, pid) :
+                            shell_SpawnStage(path, argv, in_fd, out_fd, pid);
+        if ((rc != ENOENT && rc != EACCES && rc != ENOEXEC) || path == argv[0]) {
+            return rc;
+        }
+        shell_PathCacheForget(&ex->paths, argv[0]);
+    }
+    return rc;
+}
+
+/** Wait for @a pid, returns its exit status as sh sees it. */
+static inline int
+shell_WaitStatus(pid_t pid)
+{
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) == -1) {
+        if (errno != EINTR) {
+            return 1;
+        }
+    }
+    return shell_ExitStatus(wstatus);
+}
+
+/**
+ * Run the pipeline @a cmds[0, @a n), each stage reads the pipe of
+ * the one before it. Returns the status of the last stage, or 0 at
+ * once when it is not waited for: the stages are a job then.
+ */
+static inline int
+shell_RunPipeline(shell_Executor *ex, const shell_Command *cmds, size_t n, bool is_waited)
+{
+    pid_t *pids = (pid_t*) shell_ArenaAlloc(&ex->arena, n * sizeof(pid_t));
+    if (pids == NULL) {
+        LOG_ERROR("no memory for a pipeline of %lu commands", n);
+        return 1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        pids[i] = -1;
+    }
+    int in_fd = -1;
+    bool is_broken = false;
+    int not_run_status = SHELL_STATUS_NOT_FOUND;
+    uint32_t job = SHELL_NO_JOB;
+    for (size_t i = 0; i < n; i++) {
+        int pipe_fds[2] = {-1, -1};
+        if (i + 1 < n && pipe2(pipe_fds, O_CLOEXEC) != 0) {
+            LOG_ERROR("unable to create a pipe");
+            is_broken = true;
+            break;
+        }
+        char **argv = shell_MakeArgv(ex, &cmds[i]);
+        long long start = shell_TimeNs();
+        int in_file_fd = -1;
+        int out_file_fd = -1;
+        int rc = argv == NULL ? ENOMEM : 0;
+        bool is_opened = rc == 0 && shell_OpenRedirects(ex, &cmds[i], &in_file_fd, &out_file_fd);
+        if (is_opened) {
+            // Redirects win over the pipes, as in sh:
+            rc = shell_StartStage(ex, argv, in_file_fd != -1 ? in_file_fd : in_fd,
+                                  out_file_fd != -1 ? out_file_fd : pipe_fds[1], &pids[i]);
+        }
+        if (in_file_fd != -1) {
+            close(in_file_fd);
+        }
+        if (out_file_fd != -1) {
+            close(out_file_fd);
+        }
+        ex->spawn_ns += shell_TimeNs() - start;
+        if (rc == 0 && !is_opened) {
+            // Reported already, the stage fails with status 1 as in sh:
+            ex->n_failed++;
+            if (i + 1 == n) {
+                not_run_status = 1;
+            }
+        } else if (rc == 0) {
+            ex->n_spawned++;
+            if (!is_waited && job == SHELL_NO_JOB) {
+                job = shell_JobStart(&ex->jobs);
+            }
+            if (job != SHELL_NO_JOB) {
+                shell_JobAddPid(&ex->jobs, job, pids[i], i + 1 == n);
+            }
+        } else {
+            errno = rc;
+            LOG_ERROR("unable to run \"%.*s\"", (int) cmds[i].argv[0].len, cmds[i].argv[0].str);
+            errno = 0;
+            ex->n_failed++;
+        }
+        if (in_fd != -1) {
+            close(in_fd);
+        }
+        if (pipe_fds[1] != -1) {
+            close(pipe_fds[1]);
+        }
+        in_fd = pipe_fds[0];
+    }
+    if (in_fd != -1) {
+        close(in_fd);
+    }
+    if (!is_waited) {
+        shell_JobCommit(&ex->jobs, job);
+        return 0;
+    }
+    if (ex->on_wait != NULL && ex->n_spawned > 0) {
+        ex->on_wait(ex->wait_arg);
+    }
+    int status = is_broken ? 1 : not_run_status;
+    for (size_t i = 0; i < n; i++) {
+        if (pids[i] == -1) {
+            continue;
+        }
+        int stage_status = shell_WaitStatus(pids[i]);
+        if (i + 1 == n && !is_broken) {
+            status = stage_status;
+        }
+    }
+    return status;
+}
+
+/** `hash [-r] [NAME...]`, see path_cache.h. */
+static inline int
+shell_RunHash(shell_Executor *ex, const shell_Command *cmd, char **argv, int fd)
+{
+    int status = 0;
+    if (cmd->argc == 1) {
+        shell_PathCachePrint(&ex->paths, fd);
+    }
+    for (size_t i = 1; i < cmd->argc; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            shell_PathCacheClear(&ex->paths);
+        } else if (argv[i][0] == '-') {
+            dprintf(STDERR_FILENO, "hash: usage: hash [-r] [NAME...]\n");
+            status = 2;
+            break;
+        } else if (shell_PathCacheFind(&ex->paths, argv[i]) == NULL) {
+            dprintf(STDERR_FILENO, "hash: %s: not found\n", argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+static inline int
+shell_RunJobs(shell_Executor *ex, const shell_Command *cmd, char **argv, int fd)
+{
+    (void) cmd;
+    (void) argv;
+    shell_JobTableReap(&ex->jobs);
+    shell_JobTablePrint(&ex->jobs, fd);
+    return 0;
+}
+
+static inline int
+shell_RunWait(shell_Executor *ex, const shell_Command *cmd, char **argv, int fd)
+{
+    (void) cmd;
+    (void) argv;
+    (void) fd;
+    shell_JobTableWait(&ex->jobs);
+    return 0;
+}
+
+typedef int (*shell_Builtin)(shell_Executor *ex, const shell_Command *cmd, char **argv, int fd);
+
+static inline shell_Builtin
+shell_FindBuiltin(const shell_Command *cmd)
+{
+    static const struct {
+        const char *name;
+        shell_Builtin run;
+    } builtins[] = {
+        {"hash", shell_RunHash},
+        {"jobs", shell_RunJobs},
+        {"wait", shell_RunWait},
+    };
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (cmd->argv[0].len == strlen(builtins[i].name) &&
+            memcmp(cmd->argv[0].str, builtins[i].name, cmd->argv[0].len) == 0) {
+            return builtins[i].run;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Run a builtin in the shell itself, its output goes to the redirect
+ * of @a cmd or to stdout. Returns the exit status.
+ */
+static inline int
+shell_RunBuiltin(shell_Executor *ex, const shell_Command *cmd, shell_Builtin run)
+{
+    char **argv = shell_MakeArgv(ex, cmd);
+    if (argv == NULL) {
+        LOG_ERROR("no memory for \"%.*s\"", (int) cmd->argv[0].len, cmd->argv[0].str);
+        return 1;
+    }
+    int fd = STDOUT_FILENO;
+    if (cmd->out_file.str != NULL) {
+        char *out_path = shell_TokenString(ex, cmd->out_file);
+        fd = out_path == NULL ? -1 : open(out_path, shell_OutFlags(cmd) | O_CLOEXEC, 0666);
+        if (fd == -1) {
+            LOG_ERROR("unable to open \"%.*s\"", (int) cmd->out_file.len, cmd->out_file.str);
+            return 1;
+        }
+    } else {
+        fflush(stdout);
+    }
+    int status = run(ex, cmd, argv, fd);
+    if (fd != STDOUT_FILENO) {
+        close(fd);
+    }
+    return status;
+}
+
+/**
+ * Run the list @a cmds[0, @a n): pipelines joined by && and ||. A
+ * background list with them goes to a forked copy of the shell.
+ */
+static inline void
+shell_RunList(shell_Executor *ex, const shell_Command *cmds, size_t n, bool is_background)
+{
+    bool has_junctions = false;
+    for (size_t i = 0; i + 1 < n; i++) {
+        has_junctions |= cmds[i].postfix == SHELL_AND || cmds[i].postfix == SHELL_OR;
+    }
+    if (is_background && has_junctions) {
+        fflush(NULL);
+        pid_t pid = fork();
+        if (pid == 0) {
+            ex->on_wait = NULL;
+            shell_RunList(ex, cmds, n, false);
+            _exit(ex->status);
+        }
+        if (pid == -1) {
+            LOG_ERROR("unable to fork a background list");
+            ex->status = 1;
+            return;
+        }
+        uint32_t job = shell_JobStart(&ex->jobs);
+        if (job != SHELL_NO_JOB) {
+            shell_JobAddPid(&ex->jobs, job, pid, true);
+        }
+        ex->status = 0;
+        return;
+    }
+    enum shell_LexerState junction = SHELL_SEQUENCE;
+    for (size_t i = 0; i < n;) {
+        size_t end = i;
+        while (end + 1 < n && cmds[end].postfix == SHELL_PIPE) {
+            end++;
+        }
+        if (junction == SHELL_SEQUENCE || (junction == SHELL_AND && ex->status == 0) ||
+            (junction == SHELL_OR && ex->status != 0)) {
+            shell_Builtin builtin = end == i ? shell_FindBuiltin(&cmds[i]) : NULL;
+            ex->status = builtin != NULL ? shell_RunBuiltin(ex, &cmds[i], builtin) :
+                         shell_RunPipeline(ex, cmds + i, end - i + 1, !is_background);
+        }
+        junction = cmds[end].postfix;
+        i = end + 1;
+    }
+}
+
+/** Run @a flow, returns the status of its last pipeline. */
+static inline int
+shell_Execute(shell_Executor *ex, const shell_CommandFlow *flow)
+{
+    shell_ArenaReset(&ex->arena);
+    for (size_t i = 0; i < flow->n;) {
+        size_t end = i;
+        while (flow->commands[end].postfix != SHELL_SEQUENCE &&
+               flow->commands[end].postfix != SHELL_BACKGROUND && flow->commands[end].postfix != SHELL_END) {
+            end++;
+        }
+        shell_RunList(ex, flow->commands + i, end - i + 1, flow->commands[end].postfix == SHELL_BACKGROUND);
+        i = end + 1;
+    }
+    return ex->status;
+}
+
+#endif  // CMD_EXEC_H
@@ -1,65 +1,424 @@
 #ifndef CMD_PARSE_H
 #define CMD_PARSE_H
 
-#include <ctype.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
 
-typedef struct shell_CommandFlow
+#include "arena.h"
+
+/**
+ * Lexer and parser of command lines. A line is parsed into a
+ * shell_CommandFlow: its commands in order, each one with the
+ * operator which joins it with the next one. Words are views of the
+ * input, only a word with quotes or escapes is unquoted into a copy.
+ * All of a line lives in the arena of the lexer, which is reset by
+ * the next line: the input must outlive the flow, and once the arena
+ * has grown a line is parsed in O(length) without malloc() calls.
+ * Possible example of usage:
+ *
+ *
+ * shell_Lexer lexer;
+ * shell_LexerCreate(&lexer);
+ * while ((len = getline(&line, &n, stdin)) != -1) {
+ *     shell_CommandFlow *flow = shell_GetExpression(&lexer, line, len);
+ *     if (flow == NULL)
+ *         report(shell_parse_errors[lexer.status], lexer.error_pos);
+ *     foreach (cmd : flow->commands)
+ *         run(cmd.argv, cmd.argc, cmd.postfix);
+ * }
+ * shell_LexerDestroy(&lexer);
+ *
+ *
+ * The grammar, a '#' at the start of a word comments the rest out:
+ *
+ * line     := [list]
+ * list     := and_or { (';' | '&') and_or } [';' | '&']
+ * and_or   := pipeline { ('&&' | '||') pipeline }
+ * pipeline := command { '|' command }
+ * command  := { word | redirect }, with at least one word
+ * redirect := ('<' | '>' | '>>') word
+ *
+ * Words are unquoted as in sh: '...' is taken as it is, "..." keeps
+ * backslashes except before " \ $ `, a backslash out of quotes
+ * escapes any symbol. Nothing is expanded.
+ */
+
+/** What the lexer has read last. */
+enum shell_LexerState
 {
-    size_t n;
-    shell_Command* commands
-} shell_CommandFlow;
+    SHELL_END,
+    SHELL_WORD,
+
+    // Postfixes:
+    SHELL_PIPE,
+    SHELL_AND,
+    SHELL_OR,
+    SHELL_BACKGROUND,
+    SHELL_SEQUENCE,
+
+    // Redirects, followed by a word:
+    SHELL_REDIRECT_IN,
+    SHELL_REDIRECT_OUT,
+    SHELL_REDIRECT_APPEND,
+};
+
+enum shell_ParseStatus
+{
+    SHELL_PARSE_OK,
+    /** An operator or the end where a word is expected. */
+    SHELL_PARSE_UNEXPECTED,
+    SHELL_PARSE_UNTERMINATED_QUOTE,
+    SHELL_PARSE_NO_MEMORY,
+};
+
+static const char *const shell_parse_errors[] = {
+    "ok", "unexpected token", "unterminated quote", "out of memory",
+};
+
+/** A word: a view of the input, or of the arena when it is unquoted. */
+typedef struct shell_Token
+{
+    const char *str;
+    size_t len;
+} shell_Token;
 
 typedef struct shell_Command
 {
-    char **argv;
+    shell_Token *argv;
     size_t argc;
+    /** Redirects of stdin and stdout, str is NULL without them. */
+    shell_Token in_file;
+    shell_Token out_file;
+    bool is_append;
+    /** How the command is joined with the next one, SHELL_END for the last one. */
+    enum shell_LexerState postfix;
 } shell_Command;
 
+typedef struct shell_CommandFlow
+{
+    size_t n;
+    shell_Command *commands;
+} shell_CommandFlow;
 
-enum shell_LexerState
+typedef struct shell_Lexer
 {
-    GENERAL,
+    shell_Arena arena;
+    const char *pos;
+    const char *end;
+    enum shell_LexerState state;
+    /** The last word, or where the last token starts. */
+    shell_Token token;
 
-    COMMAND,
+    /** Set when shell_GetExpression() fails. */
+    enum shell_ParseStatus status;
+    const char *error_pos;
 
-    // Postfixes:
-    PIPE,
-    AND,
-    OR,
-    BACKGROUND,
-    REDIRECT,
+    /** Statistics. */
+    size_t n_lines;
+    size_t n_words;
+    /** Words copied to be unquoted. */
+    size_t n_copied;
+} shell_Lexer;
+
+enum {
+    /** Symbol classes, see shell_symbols. */
+    SHELL_SYMBOL_WORD = 0,
+    SHELL_SYMBOL_SPACE,
+    SHELL_SYMBOL_OPERATOR,
+    SHELL_SYMBOL_QUOTE,
+};
+
+/** Anything not listed here is a part of a word. */
+static const unsigned char shell_symbols[256] = {
+    [' '] = SHELL_SYMBOL_SPACE,
+    ['\t'] = SHELL_SYMBOL_SPACE,
+    ['\n'] = SHELL_SYMBOL_SPACE,
+    ['\r'] = SHELL_SYMBOL_SPACE,
+    ['|'] = SHELL_SYMBOL_OPERATOR,
+    ['&'] = SHELL_SYMBOL_OPERATOR,
+    [';'] = SHELL_SYMBOL_OPERATOR,
+    ['<'] = SHELL_SYMBOL_OPERATOR,
+    ['>'] = SHELL_SYMBOL_OPERATOR,
+    ['\''] = SHELL_SYMBOL_QUOTE,
+    ['"'] = SHELL_SYMBOL_QUOTE,
+    ['\\'] = SHELL_SYMBOL_QUOTE,
 };
 
-struct shell_Lexer
+static inline void
+shell_LexerCreate(shell_Lexer *lx)
+{
+    memset(lx, 0, sizeof(*lx));
+    shell_ArenaCreate(&lx->arena, SHELL_ARENA_BLOCK_DEFAULT);
+}
+
+static inline void
+shell_LexerDestroy(shell_Lexer *lx)
 {
-    const char *buf
-    size_t buf_idx;
-    size_t token_start;
-    size_t token_end;
-    LexerState state;
-} shell_lexer;
-
-shell_CommandFlow *shell_GetExpression(const char* buf)
+    shell_ArenaDestroy(&lx->arena);
+}
+
+static inline bool
+shell_LexerFail(shell_Lexer *lx, enum shell_ParseStatus status, const char *pos)
 {
-    shell_lexer.buf = buf;
-    do {
-        shell_Command *cmd = shell_GetCommand();
-    } while (shell_GetJunction(cmd));
-    shell_GetPostfix();
-    return cmd;
+    lx->status = status;
+    lx->error_pos = pos;
+    return false;
 }
 
-bool shell_GetToken()
+/**
+ * Find the end of a quoted word which starts at @a from, the quotes
+ * and escapes are checked but left as they are. Returns NULL when a
+ * quote is not closed, @a *error_pos is set to it then.
+ */
+static inline const char*
+shell_SkipQuoted(const char *from, const char *end, const char **error_pos)
 {
-    switch(shell_lexer.state) {
-        case GENERAL:
-            shell_lexer.state = COMMAND;
+    const char *pos = from;
+    while (pos < end) {
+        unsigned char symbol = shell_symbols[(unsigned char) *pos];
+        if (symbol == SHELL_SYMBOL_WORD) {
+            pos++;
+        } else if (*pos == '\\') {
+            pos += pos + 1 < end ? 2 : 1;
+        } else if (*pos == '\'') {
+            const char *close = (const char*) memchr(pos + 1, '\'', (size_t) (end - pos - 1));
+            if (close == NULL) {
+                *error_pos = pos;
+                return NULL;
+            }
+            pos = close + 1;
+        } else if (*pos == '"') {
+            const char *open = pos++;
+            while (pos < end && *pos != '"') {
+                pos += *pos == '\\' && pos + 1 < end ? 2 : 1;
+            }
+            if (pos == end) {
+                *error_pos = open;
+                return NULL;
+            }
+            pos++;
+        } else {
             break;
-        case COMMAND:
-            
+        }
+    }
+    return pos;
+}
+
+/** Unquote [@a from, @a to) into @a out, returns the length. */
+static inline size_t
+shell_Unquote(const char *from, const char *to, char *out)
+{
+    char *begin = out;
+    const char *pos = from;
+    while (pos < to) {
+        if (*pos == '\\') {
+            if (pos + 1 < to) {
+                pos++;
+            }
+            *out++ = *pos++;
+        } else if (*pos == '\'') {
+            for (pos++; *pos != '\''; pos++) {
+                *out++ = *pos;
+            }
+            pos++;
+        } else if (*pos == '"') {
+            for (pos++; *pos != '"'; pos++) {
+                if (*pos == '\\' && (pos[1] == '"' || pos[1] == '\\' || pos[1] == '$' || pos[1] == '`')) {
+                    pos++;
+                }
+                *out++ = *pos;
+            }
+            pos++;
+        } else {
+            *out++ = *pos++;
+        }
+    }
+    return (size_t) (out - begin);
+}
+
+/** Read a word, it is copied only when it has quotes or escapes. */
+static inline bool
+shell_ReadWord(shell_Lexer *lx)
+{
+    const char *start = lx->pos;
+    const char *pos = start;
+    while (pos < lx->end && shell_symbols[(unsigned char) *pos] == SHELL_SYMBOL_WORD) {
+        pos++;
+    }
+    lx->state = SHELL_WORD;
+    lx->n_words++;
+    if (pos == lx->end || shell_symbols[(unsigned char) *pos] != SHELL_SYMBOL_QUOTE) {
+        lx->token.str = start;
+        lx->token.len = (size_t) (pos - start);
+        lx->pos = pos;
+        return true;
+    }
+    const char *error_pos = NULL;
+    pos = shell_SkipQuoted(pos, lx->end, &error_pos);
+    if (pos == NULL) {
+        return shell_LexerFail(lx, SHELL_PARSE_UNTERMINATED_QUOTE, error_pos);
+    }
+    // Unquoting never makes a word longer:
+    size_t raw_len = (size_t) (pos - start);
+    char *copy = (char*) shell_ArenaAlloc(&lx->arena, raw_len);
+    if (copy == NULL) {
+        return shell_LexerFail(lx, SHELL_PARSE_NO_MEMORY, start);
+    }
+    lx->token.str = copy;
+    lx->token.len = shell_Unquote(start, pos, copy);
+    shell_ArenaResize(&lx->arena, copy, raw_len, lx->token.len);
+    lx->pos = pos;
+    lx->n_copied++;
+    return true;
+}
+
+/** Read the next token into lx->state, and lx->token for a word. */
+static inline bool
+shell_GetToken(shell_Lexer *lx)
+{
+    while (lx->pos < lx->end && shell_symbols[(unsigned char) *lx->pos] == SHELL_SYMBOL_SPACE) {
+        lx->pos++;
+    }
+    lx->token.str = lx->pos;
+    lx->token.len = 0;
+    if (lx->pos == lx->end || *lx->pos == '#') {
+        lx->state = SHELL_END;
+        return true;
+    }
+    char next = lx->pos + 1 < lx->end ? lx->pos[1] : '\0';
+    switch (*lx->pos) {
+        case '|':
+            lx->state = next == '|' ? SHELL_OR : SHELL_PIPE;
+            break;
+        case '&':
+            lx->state = next == '&' ? SHELL_AND : SHELL_BACKGROUND;
             break;
-        case :
+        case ';':
+            lx->state = SHELL_SEQUENCE;
+            break;
+        case '<':
+            lx->state = SHELL_REDIRECT_IN;
+            break;
+        case '>':
+            lx->state = next == '>' ? SHELL_REDIRECT_APPEND : SHELL_REDIRECT_OUT;
+            break;
+        default:
+            return shell_ReadWord(lx);
+    }
+    bool is_double = lx->state == SHELL_OR || lx->state == SHELL_AND || lx->state == SHELL_REDIRECT_APPEND;
+    lx->pos += is_double ? 2 : 1;
+    lx->token.len = is_double ? 2 : 1;
+    return true;
+}
+
+/**
+ * Parse the words and redirects of a command, up to the operator
+ * after it. A command without words is left for the caller to check.
+ */
+static inline bool
+shell_GetCommand(shell_Lexer *lx, shell_Command *cmd)
+{
+    memset(cmd, 0, sizeof(*cmd));
+    size_t capacity = 0;
+    while (true) {
+        if (!shell_GetToken(lx)) {
+            return false;
+        }
+        if (lx->state == SHELL_WORD) {
+            if (cmd->argc == capacity) {
+                size_t new_capacity = capacity > 0 ? capacity * 2 : 4;
+                shell_Token *argv = (shell_Token*) shell_ArenaResize(
+                    &lx->arena, cmd->argv, capacity * sizeof(shell_Token), new_capacity * sizeof(shell_Token));
+                if (argv == NULL) {
+                    return shell_LexerFail(lx, SHELL_PARSE_NO_MEMORY, lx->token.str);
+                }
+                cmd->argv = argv;
+                capacity = new_capacity;
+            }
+            cmd->argv[cmd->argc++] = lx->token;
+            continue;
+        }
+        if (lx->state < SHELL_REDIRECT_IN) {
+            break;
+        }
+        enum shell_LexerState redirect = lx->state;
+        if (!shell_GetToken(lx)) {
+            return false;
+        }
+        if (lx->state != SHELL_WORD) {
+            return shell_LexerFail(lx, SHELL_PARSE_UNEXPECTED, lx->token.str);
+        }
+        if (redirect == SHELL_REDIRECT_IN) {
+            cmd->in_file = lx->token;
+        } else {
+            cmd->out_file = lx->token;
+            cmd->is_append = redirect == SHELL_REDIRECT_APPEND;
+        }
+    }
+    cmd->postfix = lx->state;
+    return true;
+}
 
+/**
+ * Parse a line of @a len bytes, a newline at its end is ignored.
+ * Returns NULL on an error, see lx->status and lx->error_pos. The
+ * flow is valid until the next call.
+ */
+static inline shell_CommandFlow*
+shell_GetExpression(shell_Lexer *lx, const char *buf, size_t len)
+{
+    shell_ArenaReset(&lx->arena);
+    if (len > 0 && buf[len - 1] == '\n') {
+        len--;
+    }
+    lx->pos = buf;
+    lx->end = buf + len;
+    lx->status = SHELL_PARSE_OK;
+    lx->error_pos = NULL;
+    lx->n_lines++;
+    shell_CommandFlow *flow = (shell_CommandFlow*) shell_ArenaAlloc(&lx->arena, sizeof(shell_CommandFlow));
+    if (flow == NULL) {
+        shell_LexerFail(lx, SHELL_PARSE_NO_MEMORY, buf);
+        return NULL;
     }
+    flow->n = 0;
+    flow->commands = NULL;
+    size_t capacity = 0;
+    while (true) {
+        if (flow->n == capacity) {
+            size_t new_capacity = capacity > 0 ? capacity * 2 : 4;
+            shell_Command *commands = (shell_Command*) shell_ArenaResize(
+                &lx->arena, flow->commands, capacity * sizeof(shell_Command),
+                new_capacity * sizeof(shell_Command));
+            if (commands == NULL) {
+                shell_LexerFail(lx, SHELL_PARSE_NO_MEMORY, lx->pos);
+                return NULL;
+            }
+            flow->commands = commands;
+            capacity = new_capacity;
+        }
+        shell_Command *cmd = &flow->commands[flow->n];
+        if (!shell_GetCommand(lx, cmd)) {
+            return NULL;
+        }
+        if (cmd->argc == 0) {
+            // Only a list may end with nothing: after ';', '&', or an empty line.
+            enum shell_LexerState prev = flow->n > 0 ? flow->commands[flow->n - 1].postfix : SHELL_SEQUENCE;
+            bool is_list_end = cmd->postfix == SHELL_END && cmd->in_file.str == NULL &&
+                               cmd->out_file.str == NULL && (prev == SHELL_SEQUENCE || prev == SHELL_BACKGROUND);
+            if (!is_list_end) {
+                shell_LexerFail(lx, SHELL_PARSE_UNEXPECTED, lx->token.str);
+                return NULL;
+            }
+            break;
+        }
+        flow->n++;
+        if (cmd->postfix == SHELL_END) {
+            break;
+        }
+    }
+    return flow;
 }
+
 #endif  // CMD_PARSE_H
@@ -0,0 +1,117 @@
+#ifndef CMD_QUEUE_H
+#define CMD_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "cmd_parse.h"
+
+/**
+ * Ring of lines parsed ahead of the one being run. Each slot has a
+ * lexer of its own, so a flow stays valid while the next ones are
+ * parsed: a batch shell parses into the free slots while it waits for
+ * a command, and the parsing is off the critical path. Parsing has no
+ * side effects, nothing of a line depends on the ones before it being
+ * run. Possible example of usage:
+ *
+ *
+ * shell_CommandQueue queue;
+ * shell_CommandQueueCreate(&queue);
+ * while (!shell_CommandQueueIsFull(&queue) && (line = next_line()) != NULL)
+ *     shell_CommandQueuePush(&queue, line, len);
+ * shell_QueueSlot *slot = shell_CommandQueuePop(&queue);
+ * run(slot->flow);  // more lines may be pushed meanwhile
+ * shell_CommandQueueDestroy(&queue);
+ *
+ *
+ * A popped slot stays valid until the next pop, so the queue holds
+ * SHELL_QUEUE_SIZE - 1 lines besides the one being run. The lines
+ * must outlive their slots, the queue keeps views of them.
+ */
+
+enum {
+    /** Slots of the ring, a power of 2. */
+    SHELL_QUEUE_SIZE = 32,
+};
+
+typedef struct shell_QueueSlot
+{
+    shell_Lexer lexer;
+    /** NULL on a parse error, see lexer.status and lexer.error_pos. */
+    shell_CommandFlow *flow;
+    const char *line;
+    size_t len;
+} shell_QueueSlot;
+
+typedef struct shell_CommandQueue
+{
+    shell_QueueSlot slots[SHELL_QUEUE_SIZE];
+    /** Slots [head, tail) are parsed, head - 1 is being run. Both only grow. */
+    size_t head;
+    size_t tail;
+} shell_CommandQueue;
+
+static inline void
+shell_CommandQueueCreate(shell_CommandQueue *q)
+{
+    memset(q, 0, sizeof(*q));
+    for (size_t i = 0; i < SHELL_QUEUE_SIZE; i++) {
+        shell_LexerCreate(&q->slots[i].lexer);
+    }
+}
+
+static inline void
+shell_CommandQueueDestroy(shell_CommandQueue *q)
+{
+    for (size_t i = 0; i < SHELL_QUEUE_SIZE; i++) {
+        shell_LexerDestroy(&q->slots[i].lexer);
+    }
+}
+
+static inline bool
+shell_CommandQueueIsEmpty(const shell_CommandQueue *q)
+{
+    return q->head == q->tail;
+}
+
+static inline bool
+shell_CommandQueueIsFull(const shell_CommandQueue *q)
+{
+    return q->tail - q->head == SHELL_QUEUE_SIZE - 1;
+}
+
+/** Parse @a line into the next slot, the queue must not be full. */
+static inline shell_QueueSlot*
+shell_CommandQueuePush(shell_CommandQueue *q, const char *line, size_t len)
+{
+    shell_QueueSlot *slot = &q->slots[q->tail++ & (SHELL_QUEUE_SIZE - 1)];
+    slot->flow = shell_GetExpression(&slot->lexer, line, len);
+    slot->line = line;
+    slot->len = len;
+    return slot;
+}
+
+/** The oldest line, the queue must not be empty. */
+static inline shell_QueueSlot*
+shell_CommandQueuePop(shell_CommandQueue *q)
+{
+    return &q->slots[q->head++ & (SHELL_QUEUE_SIZE - 1)];
+}
+
+/** Statistics of all the slots' lexers summed into @a total. */
+static inline void
+shell_CommandQueueStats(const shell_CommandQueue *q, shell_Lexer *total)
+{
+    memset(total, 0, sizeof(*total));
+    for (size_t i = 0; i < SHELL_QUEUE_SIZE; i++) {
+        const shell_Lexer *lx = &q->slots[i].lexer;
+        total->n_lines += lx->n_lines;
+        total->n_words += lx->n_words;
+        total->n_copied += lx->n_copied;
+        total->arena.n_blocks += lx->arena.n_blocks;
+        total->arena.capacity += lx->arena.capacity;
+    }
+}
+
+#endif  // CMD_QUEUE_H
@@ -0,0 +1,115 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cmd_exec.h"
+#include "cmd_parse.h"
+#include "macro.h"
+
+/**
+ * Commands/s of the executor with posix_spawn() against fork() and
+ * execv(). The shell is made big first: a fork() copies the page
+ * tables of all its touched memory for every command, a spawn does
+ * not. Each line is run N times in both ways. The cost of finding a
+ * command in $PATH is printed as well, with the cache of path_cache.h
+ * and with a scan of the directories each time.
+ *
+ * Usage: exec_bench [N [HEAP_MB]]
+ */
+
+enum
+{
+    RUNS_DEFAULT = 1000,
+    HEAP_MB_DEFAULT = 256,
+};
+
+static const char *const lines[] = {
+    "true",
+    "true | true | true | true | true | true | true | true",
+};
+
+bool RunLine(shell_Lexer *lexer, const char *line, size_t n_runs, bool use_fork);
+void FindPaths(size_t n_runs);
+
+int main(int argc, char *argv[])
+{
+    size_t n_runs = argc > 1 ? strtoul(argv[1], NULL, 10) : RUNS_DEFAULT;
+    size_t heap_mb = argc > 2 ? strtoul(argv[2], NULL, 10) : HEAP_MB_DEFAULT;
+    if (n_runs == 0) {
+        dprintf(STDERR_FILENO, "usage: %s [N [HEAP_MB]]\n", argv[0]);
+        return 2;
+    }
+    char *heap = (char*) malloc(heap_mb << 20 > 0 ? heap_mb << 20 : 1);
+    if (heap == NULL) {
+        LOG_ERROR("malloc(%lu MB) failed", heap_mb);
+        return 1;
+    }
+    memset(heap, 1, heap_mb << 20);
+    printf("%lu runs of each line, %lu MB of touched heap\n", n_runs, heap_mb);
+    shell_Lexer lexer;
+    shell_LexerCreate(&lexer);
+    bool is_ok = true;
+    for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]) && is_ok; i++) {
+        is_ok = RunLine(&lexer, lines[i], n_runs, false) && RunLine(&lexer, lines[i], n_runs, true);
+    }
+    shell_LexerDestroy(&lexer);
+    if (is_ok) {
+        FindPaths(n_runs * 100);
+    }
+    free(heap);
+    return is_ok ? 0 : 1;
+}
+
+bool RunLine(shell_Lexer *lexer, const char *line, size_t n_runs, bool use_fork)
+{
+    shell_CommandFlow *flow = shell_GetExpression(lexer, line, strlen(line));
+    if (flow == NULL) {
+        LOG_ERROR("unable to parse \"%s\"", line);
+        return false;
+    }
+    shell_Executor ex;
+    shell_ExecutorCreate(&ex, use_fork);
+    long long start = shell_TimeNs();
+    for (size_t i = 0; i < n_runs && ex.status == 0; i++) {
+        shell_Execute(&ex, flow);
+    }
+    double sec = (double) (shell_TimeNs() - start) / 1e9;
+    bool is_ok = ex.status == 0 && ex.n_failed == 0;
+    if (is_ok) {
+        printf("%-16s %lu commands/line: %9.0f commands/s, %6.1f us per start\n",
+               use_fork ? "fork+execv" : "posix_spawn", flow->n, (double) ex.n_spawned / sec,
+               (double) ex.spawn_ns / 1e3 / (double) ex.n_spawned);
+    } else {
+        LOG_ERROR("\"%s\" failed with status %d", line, ex.status);
+    }
+    shell_ExecutorDestroy(&ex);
+    return is_ok;
+}
+
+void FindPaths(size_t n_runs)
+{
+    static const char *const names[] = {"true", "sort", "cat", "tr"};
+    enum { N_NAMES = sizeof(names) / sizeof(names[0]) };
+    shell_PathCache cache;
+    shell_PathCacheCreate(&cache);
+    size_t n_found = 0;
+    long long start = shell_TimeNs();
+    for (size_t i = 0; i < n_runs; i++) {
+        n_found += shell_PathCacheFind(&cache, names[i % N_NAMES]) != NULL;
+    }
+    long long cached_ns = shell_TimeNs() - start;
+    shell_PathCacheDestroy(&cache);
+
+    const char *env_path = getenv("PATH") != NULL ? getenv("PATH") : SHELL_DEFAULT_PATH;
+    char path[PATH_MAX];
+    start = shell_TimeNs();
+    for (size_t i = 0; i < n_runs; i++) {
+        n_found += shell_PathResolve(env_path, names[i % N_NAMES], path);
+    }
+    long long scan_ns = shell_TimeNs() - start;
+    printf("%lu lookups of %d names, %lu found: %.1f ns cached, %.1f ns with a $PATH scan\n",
+           n_runs, N_NAMES, n_found / 2, (double) cached_ns / (double) n_runs, (double) scan_ns / (double) n_runs);
+}
@@ -0,0 +1,358 @@
+#ifndef JOB_TABLE_H
+#define JOB_TABLE_H
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "macro.h"
+
+/**
+ * Table of background jobs, a job being a pipeline or a list started
+ * with '&'. SIGCHLD is blocked and comes through a signalfd, so the
+ * shell waits for it in the same epoll() as for its input and never
+ * blocks in waitpid() while there is input to run. Possible example
+ * of usage:
+ *
+ *
+ * shell_JobTable jobs;
+ * shell_JobTableCreate(&jobs);
+ * uint32_t id = shell_JobStart(&jobs);
+ * shell_JobAddPid(&jobs, id, pid, true);
+ * ...
+ * epoll_wait(...);  // jobs.signal_fd is readable
+ * shell_JobTableReap(&jobs);
+ * shell_JobTableDestroy(&jobs);
+ *
+ *
+ * The jobs are a dense array indexed by the job id - 1, a finished
+ * job goes to a free list and its slot is taken by the next one. An
+ * exited pid is found in an open-addressing map of pid to job, so
+ * a reap costs O(1) per exited process however many jobs are running.
+ * The exit status of a job is the one of its last process.
+ *
+ * Several SIGCHLD may come as one, so some exits have no signal of
+ * their own. They are found by a sweep with waitpid(-1), which walks
+ * all the children in the kernel: it is done at most once per
+ * SHELL_JOB_SWEEP_MS, the caller polls with that timeout while jobs
+ * are running.
+ */
+
+enum {
+    /** Slots of the first pid map, a power of 2. */
+    SHELL_JOB_PIDS_SIZE = 64,
+    SHELL_JOB_INFOS_MAX = 64,
+    SHELL_JOB_SWEEP_MS = 20,
+};
+
+#define SHELL_NO_JOB UINT32_MAX
+
+typedef struct shell_Job
+{
+    /** The last process of the pipeline, 0 while the slot is free. */
+    pid_t last_pid;
+    uint32_t n_alive;
+    int status;
+    /** The next free slot while this one is free. */
+    uint32_t next_free;
+} shell_Job;
+
+/** An empty slot has pid 0, a tombstone has pid -1. */
+typedef struct shell_JobPid
+{
+    pid_t pid;
+    uint32_t job;
+} shell_JobPid;
+
+typedef struct shell_JobTable
+{
+    shell_Job *jobs;
+    size_t capacity;
+    /** Slots ever used, the ones below are running or free. */
+    size_t n_slots;
+    size_t n_jobs;
+    uint32_t first_free;
+
+    shell_JobPid *pids;
+    /** Power of 2. */
+    size_t pids_size;
+    size_t n_pids;
+    size_t n_tombstones;
+
+    /** SIGCHLD, -1 when there is no signalfd: reaps are polls then. */
+    int signal_fd;
+    sigset_t old_mask;
+    long long last_sweep_ms;
+
+    /** Statistics. */
+    size_t n_started;
+    size_t n_done;
+    size_t n_reaped;
+    size_t max_jobs;
+} shell_JobTable;
+
+/** The exit status of a waited process as sh sees it. */
+static inline int
+shell_ExitStatus(int wstatus)
+{
+    return WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus) : WEXITSTATUS(wstatus);
+}
+
+/** A coarse clock is enough for the sweeps and costs no syscall. */
+static inline long long
+shell_JobClockMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Block SIGCHLD and open its signalfd. */
+static inline void
+shell_JobTableCreate(shell_JobTable *t)
+{
+    memset(t, 0, sizeof(*t));
+    t->first_free = SHELL_NO_JOB;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &t->old_mask);
+    t->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (t->signal_fd == -1) {
+        LOG_ERROR("unable to create a signalfd for SIGCHLD");
+        errno = 0;
+    }
+}
+
+/** Running jobs are left as they are, as sh does on exit. */
+static inline void
+shell_JobTableDestroy(shell_JobTable *t)
+{
+    if (t->signal_fd != -1) {
+        close(t->signal_fd);
+    }
+    sigprocmask(SIG_SETMASK, &t->old_mask, NULL);
+    free(t->jobs);
+    free(t->pids);
+    memset(t, 0, sizeof(*t));
+    t->signal_fd = -1;
+}
+
+static inline size_t
+shell_JobPidSlot(const shell_JobTable *t, pid_t pid)
+{
+    size_t mask = t->pids_size - 1;
+    size_t i = ((size_t) pid * 2654435761u) & mask;
+    while (t->pids[i].pid != 0 && t->pids[i].pid != pid) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/** The pid map doubles at 3/4 of used and tombstone slots, see path_cache.h. */
+static inline bool
+shell_JobPidsReserve(shell_JobTable *t)
+{
+    if (t->pids != NULL && (t->n_pids + t->n_tombstones + 1) * 4 <= t->pids_size * 3) {
+        return true;
+    }
+    size_t size = t->pids_size == 0 ? SHELL_JOB_PIDS_SIZE :
+                  (t->n_pids + 1) * 2 > t->pids_size ? t->pids_size * 2 : t->pids_size;
+    shell_JobPid *pids = (shell_JobPid*) calloc(size, sizeof(shell_JobPid));
+    if (pids == NULL) {
+        return false;
+    }
+    shell_JobPid *old_pids = t->pids;
+    size_t old_size = t->pids_size;
+    t->pids = pids;
+    t->pids_size = size;
+    t->n_tombstones = 0;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old_pids[i].pid > 0) {
+            t->pids[shell_JobPidSlot(t, old_pids[i].pid)] = old_pids[i];
+        }
+    }
+    free(old_pids);
+    return true;
+}
+
+/** A new job without processes, returns its id or SHELL_NO_JOB without memory. */
+static inline uint32_t
+shell_JobStart(shell_JobTable *t)
+{
+    uint32_t slot = t->first_free;
+    if (slot != SHELL_NO_JOB) {
+        t->first_free = t->jobs[slot].next_free;
+    } else {
+        if (t->n_slots == t->capacity) {
+            size_t capacity = t->capacity == 0 ? 16 : t->capacity * 2;
+            shell_Job *jobs = (shell_Job*) realloc(t->jobs, capacity * sizeof(shell_Job));
+            if (jobs == NULL) {
+                return SHELL_NO_JOB;
+            }
+            t->jobs = jobs;
+            t->capacity = capacity;
+        }
+        slot = (uint32_t) t->n_slots++;
+    }
+    t->jobs[slot] = (shell_Job) {.last_pid = 0, .n_alive = 0, .status = 0, .next_free = SHELL_NO_JOB};
+    t->n_jobs++;
+    t->n_started++;
+    if (t->n_jobs > t->max_jobs) {
+        t->max_jobs = t->n_jobs;
+    }
+    return slot + 1;
+}
+
+static inline void
+shell_JobFinish(shell_JobTable *t, uint32_t id)
+{
+    shell_Job *job = &t->jobs[id - 1];
+    job->last_pid = 0;
+    job->next_free = t->first_free;
+    t->first_free = id - 1;
+    t->n_jobs--;
+    t->n_done++;
+}
+
+/**
+ * Add the process @a pid to the job @a id, @a is_last when it gives
+ * the exit status. Returns false without memory, @a pid is not
+ * tracked then and is reaped as an unknown child.
+ */
+static inline bool
+shell_JobAddPid(shell_JobTable *t, uint32_t id, pid_t pid, bool is_last)
+{
+    if (!shell_JobPidsReserve(t)) {
+        return false;
+    }
+    size_t i = shell_JobPidSlot(t, pid);
+    t->pids[i] = (shell_JobPid) {.pid = pid, .job = id};
+    t->n_pids++;
+    shell_Job *job = &t->jobs[id - 1];
+    job->n_alive++;
+    if (is_last || job->last_pid == 0) {
+        job->last_pid = pid;
+    }
+    return true;
+}
+
+/** Finish a job which got no process at all, all of them failed to start. */
+static inline void
+shell_JobCommit(shell_JobTable *t, uint32_t id)
+{
+    if (id != SHELL_NO_JOB && t->jobs[id - 1].n_alive == 0) {
+        shell_JobFinish(t, id);
+    }
+}
+
+static inline void
+shell_JobExited(shell_JobTable *t, pid_t pid, int wstatus)
+{
+    t->n_reaped++;
+    if (t->pids == NULL) {
+        return;
+    }
+    size_t i = shell_JobPidSlot(t, pid);
+    if (t->pids[i].pid != pid) {
+        return;
+    }
+    uint32_t id = t->pids[i].job;
+    t->pids[i].pid = -1;
+    t->n_pids--;
+    t->n_tombstones++;
+    shell_Job *job = &t->jobs[id - 1];
+    if (job->last_pid == pid) {
+        job->status = shell_ExitStatus(wstatus);
+    }
+    if (--job->n_alive == 0) {
+        shell_JobFinish(t, id);
+    }
+}
+
+/**
+ * Drain the signalfd and reap the pid of each SIGCHLD. Sweep for the
+ * exits without a signal when the last sweep is SHELL_JOB_SWEEP_MS
+ * old, or always without a signalfd. Returns the number of children
+ * reaped.
+ */
+static inline size_t
+shell_JobTableReap(shell_JobTable *t)
+{
+    size_t n_reaped = 0;
+    int wstatus;
+    if (t->signal_fd != -1) {
+        struct signalfd_siginfo infos[SHELL_JOB_INFOS_MAX];
+        ssize_t n;
+        do {
+            n = read(t->signal_fd, infos, sizeof(infos));
+            for (ssize_t i = 0; i < n / (ssize_t) sizeof(infos[0]); i++) {
+                pid_t pid = (pid_t) infos[i].ssi_pid;
+                if (pid > 0 && waitpid(pid, &wstatus, WNOHANG) == pid) {
+                    shell_JobExited(t, pid, wstatus);
+                    n_reaped++;
+                }
+            }
+        } while (n == (ssize_t) sizeof(infos));
+    }
+    long long now_ms = shell_JobClockMs();
+    if (t->signal_fd != -1 && now_ms - t->last_sweep_ms < SHELL_JOB_SWEEP_MS) {
+        return n_reaped;
+    }
+    t->last_sweep_ms = now_ms;
+    pid_t pid;
+    while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+        shell_JobExited(t, pid, wstatus);
+        n_reaped++;
+    }
+    errno = 0;
+    return n_reaped;
+}
+
+/** Wait until all the jobs are done, the `wait` builtin. */
+static inline void
+shell_JobTableWait(shell_JobTable *t)
+{
+    shell_JobTableReap(t);
+    while (t->n_jobs > 0) {
+        if (t->signal_fd != -1) {
+            struct pollfd pfd = {.fd = t->signal_fd, .events = POLLIN};
+            if (poll(&pfd, 1, SHELL_JOB_SWEEP_MS) == -1 && errno != EINTR) {
+                LOG_ERROR("unable to wait for SIGCHLD");
+                return;
+            }
+        } else {
+            int wstatus;
+            pid_t pid = waitpid(-1, &wstatus, 0);
+            if (pid == -1) {
+                return;
+            }
+            shell_JobExited(t, pid, wstatus);
+        }
+        shell_JobTableReap(t);
+    }
+}
+
+/** Print the running jobs, the `jobs` builtin. */
+static inline void
+shell_JobTablePrint(const shell_JobTable *t, int fd)
+{
+    for (size_t i = 0; i < t->n_slots; i++) {
+        if (t->jobs[i].last_pid != 0) {
+            dprintf(fd, "[%lu]\tRunning\tpid %d, %u processes\n", i + 1, (int) t->jobs[i].last_pid,
+                    t->jobs[i].n_alive);
+        }
+    }
+}
+
+#endif  // JOB_TABLE_H
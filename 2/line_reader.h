@@ -0,0 +1,166 @@
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Lines of a file descriptor, read with read() into one buffer and
+ * split in place. Unlike a FILE, nothing is kept out of sight: when
+ * shell_LineReaderNext() returns NULL all the buffered input is gone
+ * and epoll() on the descriptor tells when there is more. Possible
+ * example of usage:
+ *
+ *
+ * shell_LineReader reader;
+ * shell_LineReaderCreate(&reader, STDIN_FILENO, 4096);
+ * while (shell_LineReaderFill(&reader) > 0 || !reader.is_eof) {
+ *     while ((line = shell_LineReaderNext(&reader, &len)) != NULL)
+ *         ...
+ * }
+ * shell_LineReaderDestroy(&reader);
+ *
+ *
+ * A line is valid until the next fill, it ends with its '\n' unless
+ * it is the last one of the input. A regular file may be mapped as a
+ * whole instead, see shell_LineReaderMap(): then there is nothing to
+ * fill and the lines are valid until the reader is destroyed.
+ */
+
+typedef struct shell_LineReader
+{
+    int fd;
+    char *buf;
+    size_t size;
+    /** The next line starts at pos, the data read ends at end. */
+    size_t pos;
+    size_t end;
+    /** The size of one read, the buffer grows for longer lines. */
+    size_t block_size;
+    bool is_eof;
+    bool is_mapped;
+
+    /** Statistics. */
+    size_t n_reads;
+    size_t n_bytes;
+} shell_LineReader;
+
+static inline void
+shell_LineReaderCreate(shell_LineReader *r, int fd, size_t block_size)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->block_size = block_size;
+}
+
+static inline void
+shell_LineReaderDestroy(shell_LineReader *r)
+{
+    if (r->is_mapped) {
+        munmap(r->buf, r->size);
+    } else {
+        free(r->buf);
+    }
+    memset(r, 0, sizeof(*r));
+}
+
+/**
+ * Map the file of the reader as a whole when it is a regular one.
+ * Returns false when it can not be mapped, it is read as usual then.
+ */
+static inline bool
+shell_LineReaderMap(shell_LineReader *r)
+{
+    struct stat st;
+    if (r->size > 0 || fstat(r->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        errno = 0;
+        return false;
+    }
+    void *buf = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, r->fd, 0);
+    if (buf == MAP_FAILED) {
+        errno = 0;
+        return false;
+    }
+    madvise(buf, (size_t) st.st_size, MADV_SEQUENTIAL);
+    r->buf = (char*) buf;
+    r->size = (size_t) st.st_size;
+    r->end = r->size;
+    r->is_eof = true;
+    r->is_mapped = true;
+    r->n_bytes = r->size;
+    return true;
+}
+
+/**
+ * Read once into the buffer, after what is left of a line. Returns
+ * the number of bytes read, 0 at the end of the input or -1 with
+ * errno set. EAGAIN and EINTR are not errors, 0 is returned.
+ */
+static inline ssize_t
+shell_LineReaderFill(shell_LineReader *r)
+{
+    if (r->is_eof) {
+        return 0;
+    }
+    if (r->pos > 0) {
+        memmove(r->buf, r->buf + r->pos, r->end - r->pos);
+        r->end -= r->pos;
+        r->pos = 0;
+    }
+    if (r->size - r->end < r->block_size) {
+        size_t size = r->size == 0 ? r->block_size : r->size * 2;
+        while (size - r->end < r->block_size) {
+            size *= 2;
+        }
+        char *buf = (char*) realloc(r->buf, size);
+        if (buf == NULL) {
+            return -1;
+        }
+        r->buf = buf;
+        r->size = size;
+    }
+    ssize_t n = read(r->fd, r->buf + r->end, r->size - r->end);
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EINTR) {
+            errno = 0;
+            return 0;
+        }
+        return -1;
+    }
+    if (n == 0) {
+        r->is_eof = true;
+    }
+    r->end += (size_t) n;
+    r->n_reads++;
+    r->n_bytes += (size_t) n;
+    return n;
+}
+
+/**
+ * The next complete line and its @a len with the '\n', or NULL when
+ * there is none left in the buffer. At the end of the input the rest
+ * is a line as well.
+ */
+static inline char*
+shell_LineReaderNext(shell_LineReader *r, size_t *len)
+{
+    if (r->pos == r->end) {
+        return NULL;
+    }
+    char *line = r->buf + r->pos;
+    char *nl = (char*) memchr(line, '\n', r->end - r->pos);
+    if (nl == NULL && !r->is_eof) {
+        return NULL;
+    }
+    *len = nl != NULL ? (size_t) (nl - line) + 1 : r->end - r->pos;
+    r->pos += *len;
+    return line;
+}
+
+#endif  // LINE_READER_H
@@ -1,45 +1,422 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "cmd_exec.h"
 #include "cmd_parse.h"
+#include "cmd_queue.h"
+#include "line_reader.h"
 #include "macro.h"
-#include <stdio.h>
-#include <stdbool.h>
 
-void CheckArgv(ShellCommand *cmd);
-void CheckRedirrect(ShellCommand *cmd);
-void CheckBackground(ShellCommand *cmd);
+/**
+ * Parses the lines of SCRIPT, or of stdin, and prints each one back:
+ * a word in brackets, redirects and operators as they are, or an
+ * error with its column. With -q nothing is printed but the parser
+ * throughput. With -x each line is run instead, see cmd_exec.h, and
+ * -F runs the commands with fork() and execv() instead of
+ * posix_spawn(). When lines are run, one epoll() waits both for input
+ * and for SIGCHLD of the background jobs, which are reaped as they
+ * exit.
+ *
+ * -b runs a script in batch mode, nothing is interactive: a SCRIPT
+ * file is mapped as a whole, stdin is read in big blocks, and the
+ * lines are split in place. Up to SHELL_QUEUE_SIZE lines are parsed
+ * ahead, see cmd_queue.h, while the executor waits for a command.
+ * The time of reading, parsing and running is printed at the end.
+ *
+ * Usage: parse_test [-q] [-x [-F] | -b [-F]] [SCRIPT]
+ */
+
+enum {
+    INPUT_BLOCK_SIZE = 64 << 10,
+    BATCH_BLOCK_SIZE = 1 << 20,
+};
 
-void main()
+typedef struct Context
 {
-    char *buf = NULL;
-    size_t n = 0;
-    while (true) {
-        getline(&buf, &n, stdin);
-        CmdFlow* cmds = ParseCommands(buf);
-        ASSERT(cmds != NULL);
+    shell_Lexer lexer;
+    shell_Executor executor;
+    bool is_quiet;
+    bool is_executed;
+    bool is_batch;
+    /** Batch mode: the lines parsed ahead and where they come from. */
+    shell_CommandQueue queue;
+    shell_LineReader *reader;
+
+    /** Statistics. */
+    size_t n_errors;
+    size_t n_commands;
+    size_t n_parsed_ahead;
+    long long ingest_ns;
+    long long parse_ns;
+    long long execute_ns;
+    /** Reaps of the event loop, the ones of `wait` are not counted. */
+    size_t n_loop_reaped;
+    long long reap_ns;
+} Context;
+
+bool OpenInput(Context *ctx, shell_LineReader *reader, const char *path);
+ssize_t Ingest(Context *ctx, shell_LineReader *reader);
+void RunLines(Context *ctx, shell_LineReader *reader);
+void Execute(Context *ctx, const shell_CommandFlow *cmds);
+void ReportError(Context *ctx, const shell_Lexer *lexer, const char *line);
+bool ReadLoop(Context *ctx, shell_LineReader *reader);
+bool EventLoop(Context *ctx, shell_LineReader *reader);
+bool BatchLoop(Context *ctx, shell_LineReader *reader);
+void FillQueue(Context *ctx, bool is_ahead);
+void ParseAhead(void *arg);
+void Reap(Context *ctx);
+void PrintStats(const Context *ctx, const shell_LineReader *reader);
+void CheckArgv(const shell_Command *cmd);
+void CheckRedirect(const shell_Command *cmd);
+void CheckPostfix(const shell_Command *cmd);
+void PrintToken(const char *prefix, shell_Token token);
+
+int main(int argc, char *argv[])
+{
+    Context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    bool use_fork = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "qxbF")) != -1) {
+        switch (opt) {
+            case 'q':
+                ctx.is_quiet = true;
+                break;
+            case 'x':
+                ctx.is_executed = true;
+                break;
+            case 'b':
+                ctx.is_executed = true;
+                ctx.is_batch = true;
+                break;
+            case 'F':
+                ctx.is_executed = true;
+                use_fork = true;
+                break;
+            default:
+                dprintf(STDERR_FILENO, "usage: %s [-q] [-x [-F] | -b [-F]] [SCRIPT]\n", argv[0]);
+                return 2;
+        }
+    }
+    shell_LineReader reader;
+    if (!OpenInput(&ctx, &reader, optind < argc ? argv[optind] : NULL)) {
+        return 1;
+    }
+    shell_LexerCreate(&ctx.lexer);
+    if (ctx.is_executed) {
+        shell_ExecutorCreate(&ctx.executor, use_fork);
+    }
+    bool is_ok;
+    if (ctx.is_batch) {
+        shell_CommandQueueCreate(&ctx.queue);
+        is_ok = BatchLoop(&ctx, &reader);
+    } else {
+        is_ok = ctx.is_executed ? EventLoop(&ctx, &reader) : ReadLoop(&ctx, &reader);
+    }
+    PrintStats(&ctx, &reader);
+    if (ctx.is_batch) {
+        shell_CommandQueueDestroy(&ctx.queue);
+    }
+    if (ctx.is_executed) {
+        shell_ExecutorDestroy(&ctx.executor);
+    }
+    shell_LexerDestroy(&ctx.lexer);
+    if (reader.fd != STDIN_FILENO) {
+        close(reader.fd);
+    }
+    shell_LineReaderDestroy(&reader);
+    return is_ok ? 0 : 1;
+}
+
+/** A SCRIPT at @a path or stdin, a batch SCRIPT is mapped when it can be. */
+bool OpenInput(Context *ctx, shell_LineReader *reader, const char *path)
+{
+    int fd = STDIN_FILENO;
+    if (path != NULL) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            LOG_ERROR("unable to open \"%s\"", path);
+            return false;
+        }
+    }
+    shell_LineReaderCreate(reader, fd, ctx->is_batch ? BATCH_BLOCK_SIZE : INPUT_BLOCK_SIZE);
+    if (ctx->is_batch && path != NULL) {
+        long long start = shell_TimeNs();
+        shell_LineReaderMap(reader);
+        ctx->ingest_ns += shell_TimeNs() - start;
+    }
+    return true;
+}
 
-        for (size_t i = 0; i < cmds->n) {
-            ShellCommand cmd = cmds->commands[i];
+ssize_t Ingest(Context *ctx, shell_LineReader *reader)
+{
+    long long start = shell_TimeNs();
+    ssize_t n = shell_LineReaderFill(reader);
+    ctx->ingest_ns += shell_TimeNs() - start;
+    if (n == -1) {
+        LOG_ERROR("unable to read the script");
+    }
+    return n;
+}
+
+/** Parse, and print or run, the complete lines of @a reader. */
+void RunLines(Context *ctx, shell_LineReader *reader)
+{
+    char *line;
+    size_t len;
+    while ((line = shell_LineReaderNext(reader, &len)) != NULL) {
+        long long start = shell_TimeNs();
+        shell_CommandFlow *cmds = shell_GetExpression(&ctx->lexer, line, len);
+        ctx->parse_ns += shell_TimeNs() - start;
+        if (cmds == NULL) {
+            ReportError(ctx, &ctx->lexer, line);
+            continue;
+        }
+        if (ctx->is_executed) {
+            Execute(ctx, cmds);
+            continue;
+        }
+        ctx->n_commands += cmds->n;
+        if (ctx->is_quiet) {
+            continue;
+        }
+        for (size_t i = 0; i < cmds->n; i++) {
+            const shell_Command *cmd = &cmds->commands[i];
+            printf("%s", i > 0 ? " " : "");
             CheckArgv(cmd);
-            CheckRedirrect(cmd);
-            CheckBackground(cmd);
+            CheckRedirect(cmd);
+            CheckPostfix(cmd);
         }
+        printf("\n");
     }
 }
 
-void CheckArgv(ShellCommand *cmd)
+/** Run @a cmds, the time parsed ahead meanwhile is not counted. */
+void Execute(Context *ctx, const shell_CommandFlow *cmds)
+{
+    ctx->n_commands += cmds->n;
+    long long parse_ns = ctx->parse_ns;
+    long long start = shell_TimeNs();
+    shell_Execute(&ctx->executor, cmds);
+    ctx->execute_ns += shell_TimeNs() - start - (ctx->parse_ns - parse_ns);
+}
+
+void ReportError(Context *ctx, const shell_Lexer *lexer, const char *line)
+{
+    ctx->n_errors++;
+    if (!ctx->is_quiet) {
+        fprintf(ctx->is_executed ? stderr : stdout, "error: %s at column %lu\n",
+                shell_parse_errors[lexer->status], (size_t) (lexer->error_pos - line) + 1);
+    }
+}
+
+bool ReadLoop(Context *ctx, shell_LineReader *reader)
+{
+    while (!reader->is_eof) {
+        if (Ingest(ctx, reader) == -1) {
+            return false;
+        }
+        RunLines(ctx, reader);
+    }
+    return true;
+}
+
+/**
+ * Run the lines as they come and reap the jobs as they exit. A
+ * regular file can not be polled, it is always readable: the loop
+ * only looks for SIGCHLD between its blocks then. While jobs are
+ * running the wait times out for the sweeps of job_table.h.
+ */
+bool EventLoop(Context *ctx, shell_LineReader *reader)
+{
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        LOG_ERROR("unable to create an epoll");
+        return false;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = reader->fd};
+    bool is_input_polled = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reader->fd, &ev) == 0;
+    errno = 0;
+    int signal_fd = ctx->executor.jobs.signal_fd;
+    if (signal_fd != -1) {
+        ev.data.fd = signal_fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev) != 0) {
+            LOG_ERROR("unable to poll the signalfd");
+            close(epoll_fd);
+            return false;
+        }
+    }
+    bool is_ok = true;
+    while (is_ok && !reader->is_eof) {
+        struct epoll_event events[2];
+        int timeout_ms = !is_input_polled ? 0 : ctx->executor.jobs.n_jobs > 0 ? SHELL_JOB_SWEEP_MS : -1;
+        int n_events = epoll_wait(epoll_fd, events, 2, timeout_ms);
+        if (n_events == -1) {
+            if (errno != EINTR) {
+                LOG_ERROR("unable to wait for events");
+                is_ok = false;
+            }
+            errno = 0;
+            continue;
+        }
+        bool is_readable = !is_input_polled;
+        bool is_reaped = signal_fd == -1 || (n_events == 0 && ctx->executor.jobs.n_jobs > 0);
+        for (int i = 0; i < n_events; i++) {
+            if (events[i].data.fd == signal_fd) {
+                is_reaped = true;
+            } else {
+                is_readable = true;
+            }
+        }
+        if (is_reaped) {
+            Reap(ctx);
+        }
+        if (is_readable) {
+            is_ok = Ingest(ctx, reader) != -1;
+            RunLines(ctx, reader);
+        }
+    }
+    close(epoll_fd);
+    return is_ok;
+}
+
+/**
+ * Run the lines of the queue one by one. The queue is refilled while
+ * they run, see ParseAhead(), and here only when it is empty: then
+ * no line is left in the buffer of @a reader and it is safe to read,
+ * a read may move the buffer. The jobs are reaped after each line.
+ */
+bool BatchLoop(Context *ctx, shell_LineReader *reader)
+{
+    ctx->reader = reader;
+    ctx->executor.on_wait = ParseAhead;
+    ctx->executor.wait_arg = ctx;
+    while (true) {
+        if (shell_CommandQueueIsEmpty(&ctx->queue)) {
+            FillQueue(ctx, false);
+        }
+        if (shell_CommandQueueIsEmpty(&ctx->queue)) {
+            if (reader->is_eof) {
+                return true;
+            }
+            if (Ingest(ctx, reader) == -1) {
+                return false;
+            }
+            continue;
+        }
+        shell_QueueSlot *slot = shell_CommandQueuePop(&ctx->queue);
+        if (slot->flow == NULL) {
+            ReportError(ctx, &slot->lexer, slot->line);
+        } else {
+            Execute(ctx, slot->flow);
+        }
+        Reap(ctx);
+    }
+}
+
+/** Parse the lines in the buffer into the free slots of the queue. */
+void FillQueue(Context *ctx, bool is_ahead)
+{
+    long long start = shell_TimeNs();
+    char *line;
+    size_t len;
+    while (!shell_CommandQueueIsFull(&ctx->queue) && (line = shell_LineReaderNext(ctx->reader, &len)) != NULL) {
+        shell_CommandQueuePush(&ctx->queue, line, len);
+        ctx->n_parsed_ahead += is_ahead;
+    }
+    ctx->parse_ns += shell_TimeNs() - start;
+}
+
+/** The hook of the executor, a command is running. */
+void ParseAhead(void *arg)
+{
+    FillQueue((Context*) arg, true);
+}
+
+void Reap(Context *ctx)
+{
+    long long start = shell_TimeNs();
+    ctx->n_loop_reaped += shell_JobTableReap(&ctx->executor.jobs);
+    ctx->reap_ns += shell_TimeNs() - start;
+}
+
+void PrintStats(const Context *ctx, const shell_LineReader *reader)
+{
+    shell_Lexer lexer = ctx->lexer;
+    if (ctx->is_batch) {
+        shell_CommandQueueStats(&ctx->queue, &lexer);
+    }
+    double parse_sec = (double) ctx->parse_ns / 1e9;
+    fprintf(stderr, "Parsed:\t%lu lines, %lu commands, %lu errors (%lu bytes) in %lld us",
+            lexer.n_lines, ctx->n_commands, ctx->n_errors, reader->n_bytes, ctx->parse_ns / 1000);
+    if (parse_sec > 0) {
+        fprintf(stderr, ", %.0f lines/s, %.1f MB/s", (double) lexer.n_lines / parse_sec,
+                (double) reader->n_bytes / parse_sec / 1e6);
+    }
+    fprintf(stderr, "\nWords:\t%lu, %lu copied to be unquoted\n", lexer.n_words, lexer.n_copied);
+    fprintf(stderr, "Arena:\t%lu blocks, %lu bytes\n", lexer.arena.n_blocks, lexer.arena.capacity);
+    if (!ctx->is_executed) {
+        return;
+    }
+    fprintf(stderr, "Time:\tingest %.2f ms (%s), parse %.2f ms, execute %.2f ms\n",
+            (double) ctx->ingest_ns / 1e6, reader->is_mapped ? "mapped" : "read", (double) ctx->parse_ns / 1e6,
+            (double) ctx->execute_ns / 1e6);
+    if (ctx->is_batch) {
+        fprintf(stderr, "Batch:\t%lu of %lu lines parsed while a command ran, %lu reads\n",
+                ctx->n_parsed_ahead, lexer.n_lines, reader->n_reads);
+    }
+    const shell_Executor *ex = &ctx->executor;
+    fprintf(stderr, "Executed:\t%lu commands with %s, %lu failed, %.1f us per start, last status %d\n",
+            ex->n_spawned, ex->use_fork ? "fork()" : "posix_spawn()", ex->n_failed,
+            ex->n_spawned > 0 ? (double) ex->spawn_ns / 1e3 / (double) ex->n_spawned : 0.0, ex->status);
+    fprintf(stderr, "Paths:\t%lu hits, %lu misses, %lu cached\n", ex->paths.n_hits, ex->paths.n_misses,
+            ex->paths.n_used);
+    fprintf(stderr, "Jobs:\t%lu started, %lu at most at once, %lu running at exit, %lu processes reaped",
+            ex->jobs.n_started, ex->jobs.max_jobs, ex->jobs.n_jobs, ex->jobs.n_reaped);
+    if (ctx->n_loop_reaped > 0) {
+        fprintf(stderr, ", %.2f us per reap in the loop", (double) ctx->reap_ns / 1e3 / (double) ctx->n_loop_reaped);
+    }
+    fprintf(stderr, "\n");
+}
+
+void CheckArgv(const shell_Command *cmd)
 {
     ASSERT(cmd != NULL);
-    size_t n = cmd->argc;
-    for (size_t i = 0; i < n; i++) {
-        printf("%s\n", cmd->argv[i]);
+    ASSERT(cmd->argc > 0);
+    for (size_t i = 0; i < cmd->argc; i++) {
+        PrintToken(i > 0 ? " " : "", cmd->argv[i]);
     }
 }
 
-void CheckBackground(ShellCommand *cmd)
+void CheckRedirect(const shell_Command *cmd)
 {
     ASSERT(cmd != NULL);
+    if (cmd->in_file.str != NULL) {
+        PrintToken(" <", cmd->in_file);
+    }
+    if (cmd->out_file.str != NULL) {
+        PrintToken(cmd->is_append ? " >>" : " >", cmd->out_file);
+    }
 }
 
-void CheckBackground(ShellCommand *cmd)
+void CheckPostfix(const shell_Command *cmd)
 {
     ASSERT(cmd != NULL);
+    static const char *const postfixes[] = {
+        [SHELL_END] = "", [SHELL_PIPE] = " |", [SHELL_AND] = " &&", [SHELL_OR] = " ||",
+        [SHELL_BACKGROUND] = " &", [SHELL_SEQUENCE] = " ;",
+    };
+    ASSERT(cmd->postfix < sizeof(postfixes) / sizeof(postfixes[0]) && postfixes[cmd->postfix] != NULL);
+    printf("%s", postfixes[cmd->postfix]);
+}
+
+void PrintToken(const char *prefix, shell_Token token)
+{
+    printf("%s[%.*s]", prefix, (int) token.len, token.str);
 }
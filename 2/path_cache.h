@@ -0,0 +1,289 @@
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arena.h"
+
+/**
+ * Cache of command names resolved to absolute paths, as the hash
+ * builtin of bash. Without it each command scans the directories of
+ * $PATH with a stat() per directory until it is found, with it the
+ * scan is done once per name and then a lookup is a hash and a
+ * compare or two. The table uses open addressing with linear probing,
+ * the names and the paths live in an arena owned by the cache.
+ * Possible example of usage:
+ *
+ *
+ * shell_PathCache cache;
+ * shell_PathCacheCreate(&cache);
+ * const char *path = shell_PathCacheFind(&cache, argv[0]);
+ * if (path != NULL && posix_spawn(&pid, path, ...) != 0)
+ *     shell_PathCacheForget(&cache, argv[0]);
+ * shell_PathCacheDestroy(&cache);
+ *
+ *
+ * Invalidation is cheap: each lookup compares $PATH with the value
+ * the table was filled with and drops the whole table when it is not
+ * the same, the arena is reset and no memory is freed. A path which
+ * failed to exec is forgotten alone, its slot becomes a tombstone.
+ * Names with a '/' are not looked up, they are used as they are.
+ */
+
+enum {
+    /** Slots of the first table, a power of 2. */
+    SHELL_PATH_CACHE_SIZE = 64,
+};
+
+/** The PATH of execvp() when there is none. */
+#define SHELL_DEFAULT_PATH "/bin:/usr/bin"
+
+/**
+ * An empty slot has no name, a tombstone has a name and no path:
+ * the probing goes on over it.
+ */
+typedef struct shell_PathEntry
+{
+    const char *name;
+    const char *path;
+    uint32_t hash;
+    uint32_t hits;
+} shell_PathEntry;
+
+typedef struct shell_PathCache
+{
+    shell_PathEntry *slots;
+    /** Power of 2. */
+    size_t size;
+    /** Slots with a path, and tombstones: both are kept below 3/4 of size. */
+    size_t n_used;
+    size_t n_tombstones;
+    /** $PATH the entries were resolved with, malloc()'ed. */
+    char *env_path;
+    shell_Arena arena;
+
+    /** Statistics. */
+    size_t n_hits;
+    size_t n_misses;
+    /** Entries dropped after a failed exec, and whole tables dropped. */
+    size_t n_forgotten;
+    size_t n_clears;
+} shell_PathCache;
+
+static inline void
+shell_PathCacheCreate(shell_PathCache *c)
+{
+    memset(c, 0, sizeof(*c));
+    shell_ArenaCreate(&c->arena, 4096);
+}
+
+static inline void
+shell_PathCacheDestroy(shell_PathCache *c)
+{
+    free(c->slots);
+    free(c->env_path);
+    shell_ArenaDestroy(&c->arena);
+    memset(c, 0, sizeof(*c));
+}
+
+/** FNV-1a. */
+static inline uint32_t
+shell_PathHash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char*) name; *p != '\0'; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+/** Forget all the entries, the slots and the arena blocks are kept. */
+static inline void
+shell_PathCacheClear(shell_PathCache *c)
+{
+    if (c->slots != NULL) {
+        memset(c->slots, 0, c->size * sizeof(shell_PathEntry));
+    }
+    c->n_used = 0;
+    c->n_tombstones = 0;
+    shell_ArenaReset(&c->arena);
+    c->n_clears++;
+}
+
+/** The slot of @a name, or the empty one where it would go. */
+static inline shell_PathEntry*
+shell_PathCacheSlot(shell_PathCache *c, const char *name, uint32_t hash)
+{
+    size_t mask = c->size - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        shell_PathEntry *e = &c->slots[i];
+        if (e->name == NULL || (e->path != NULL && e->hash == hash && strcmp(e->name, name) == 0)) {
+            return e;
+        }
+    }
+}
+
+/**
+ * Make room for one more entry: the table doubles at 3/4 of used and
+ * tombstone slots, or is rebuilt at the same size when the tombstones
+ * are most of them. Returns false when there is no memory.
+ */
+static inline bool
+shell_PathCacheReserve(shell_PathCache *c)
+{
+    if (c->slots != NULL && (c->n_used + c->n_tombstones + 1) * 4 <= c->size * 3) {
+        return true;
+    }
+    size_t size = c->size == 0 ? SHELL_PATH_CACHE_SIZE :
+                  (c->n_used + 1) * 2 > c->size ? c->size * 2 : c->size;
+    shell_PathEntry *slots = (shell_PathEntry*) calloc(size, sizeof(shell_PathEntry));
+    if (slots == NULL) {
+        return false;
+    }
+    shell_PathEntry *old_slots = c->slots;
+    size_t old_size = c->size;
+    c->slots = slots;
+    c->size = size;
+    c->n_tombstones = 0;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old_slots[i].path != NULL) {
+            *shell_PathCacheSlot(c, old_slots[i].name, old_slots[i].hash) = old_slots[i];
+        }
+    }
+    free(old_slots);
+    return true;
+}
+
+/** Drop the table when $PATH is not the one it was filled with. */
+static inline void
+shell_PathCacheCheckEnv(shell_PathCache *c)
+{
+    const char *env_path = getenv("PATH");
+    if (env_path == NULL) {
+        env_path = SHELL_DEFAULT_PATH;
+    }
+    if (c->env_path != NULL && strcmp(c->env_path, env_path) == 0) {
+        return;
+    }
+    if (c->env_path != NULL) {
+        shell_PathCacheClear(c);
+    }
+    free(c->env_path);
+    c->env_path = strdup(env_path);
+}
+
+/**
+ * Scan the directories of @a env_path for an executable file
+ * @a name, as execvp() does. An empty directory is the current one.
+ * Returns false when there is none, @a path is filled otherwise.
+ */
+static inline bool
+shell_PathResolve(const char *env_path, const char *name, char path[PATH_MAX])
+{
+    size_t name_len = strlen(name);
+    const char *dir = env_path;
+    while (true) {
+        const char *dir_end = strchrnul(dir, ':');
+        size_t dir_len = dir_end == dir ? 1 : (size_t) (dir_end - dir);
+        if (dir_len + 1 + name_len < PATH_MAX) {
+            memcpy(path, dir_end == dir ? "." : dir, dir_len);
+            path[dir_len] = '/';
+            memcpy(path + dir_len + 1, name, name_len + 1);
+            struct stat st;
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0) {
+                return true;
+            }
+        }
+        if (*dir_end == '\0') {
+            return false;
+        }
+        dir = dir_end + 1;
+    }
+}
+
+/**
+ * The path to exec @a name with, from the table or from a scan of
+ * $PATH which is added to it. Returns NULL when there is no such
+ * command or no memory, names which are not found are not cached.
+ */
+static inline const char*
+shell_PathCacheFind(shell_PathCache *c, const char *name)
+{
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+    if (*name == '\0') {
+        return NULL;
+    }
+    shell_PathCacheCheckEnv(c);
+    uint32_t hash = shell_PathHash(name);
+    if (c->slots != NULL) {
+        shell_PathEntry *e = shell_PathCacheSlot(c, name, hash);
+        if (e->name != NULL) {
+            e->hits++;
+            c->n_hits++;
+            return e->path;
+        }
+    }
+    c->n_misses++;
+    char path[PATH_MAX];
+    if (c->env_path == NULL || !shell_PathResolve(c->env_path, name, path) || !shell_PathCacheReserve(c)) {
+        return NULL;
+    }
+    size_t name_size = strlen(name) + 1;
+    size_t path_size = strlen(path) + 1;
+    char *strs = (char*) shell_ArenaAlloc(&c->arena, name_size + path_size);
+    if (strs == NULL) {
+        return NULL;
+    }
+    memcpy(strs, name, name_size);
+    memcpy(strs + name_size, path, path_size);
+    shell_PathEntry *e = shell_PathCacheSlot(c, name, hash);
+    *e = (shell_PathEntry) {.name = strs, .path = strs + name_size, .hash = hash, .hits = 1};
+    c->n_used++;
+    return e->path;
+}
+
+/** Drop @a name after its path failed to exec, the next lookup scans $PATH again. */
+static inline void
+shell_PathCacheForget(shell_PathCache *c, const char *name)
+{
+    if (c->slots == NULL || strchr(name, '/') != NULL) {
+        return;
+    }
+    shell_PathEntry *e = shell_PathCacheSlot(c, name, shell_PathHash(name));
+    if (e->name != NULL) {
+        e->path = NULL;
+        c->n_used--;
+        c->n_tombstones++;
+        c->n_forgotten++;
+    }
+}
+
+/** Print the table as `hash` of bash does, with the statistics after it. */
+static inline void
+shell_PathCachePrint(const shell_PathCache *c, int fd)
+{
+    if (c->n_used == 0) {
+        dprintf(fd, "hash: hash table empty\n");
+    } else {
+        dprintf(fd, "hits\tcommand\n");
+        for (size_t i = 0; i < c->size; i++) {
+            if (c->slots[i].path != NULL) {
+                dprintf(fd, "%4u\t%s\n", c->slots[i].hits, c->slots[i].path);
+            }
+        }
+    }
+    dprintf(fd, "hash: %lu hits, %lu misses, %lu forgotten, %lu clears\n", c->n_hits, c->n_misses,
+            c->n_forgotten, c->n_clears);
+}
+
+#endif  // PATH_CACHE_H